@@ -3,20 +3,47 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "norFAT.h"
+#include "norFATkernel.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if NORFAT_THREAD_SAFE && defined(__linux__)
+#include <pthread.h>
+#endif
 
 #define NORFAT_SECTORS		    2048
 #define NORFAT_SECTOR_SIZE	    4096
+//The jig build sets NORFAT_ENTRY_BITS 16, 2048 sectors fit its 12 bit next
+#if NORFAT_ENTRY_BITS == 16
+#define NORFAT_TABLE_SECTORS	2
+#else
 #define NORFAT_TABLE_SECTORS	3
+#endif
 #define NORFAT_TABLE_COUNT		6
 
+/* The jig build fixes the sector, program and table sizes with the
+ * NORFAT_STATIC_ profile. tableCount stays out, fs2 has fewer tables */
+#if (NORFAT_STATIC_SECTOR_SIZE && NORFAT_STATIC_SECTOR_SIZE != NORFAT_SECTOR_SIZE) || \
+	(NORFAT_STATIC_PROGRAM_SIZE && NORFAT_STATIC_PROGRAM_SIZE != 256) || \
+	(NORFAT_STATIC_TABLE_SECTORS && NORFAT_STATIC_TABLE_SECTORS != NORFAT_TABLE_SECTORS)
+#error The NORFAT_STATIC_ geometry does not match the jig volumes
+#endif
+
 #define TRACE_BUFFER_SIZE (10 * 1024 * 1024)
 uint32_t POWER_CYCLE_COUNT = 2500;
 #define BLOCK_SIZE (NORFAT_SECTORS * NORFAT_SECTOR_SIZE)
 uint8_t block[BLOCK_SIZE];
 
 uint32_t EraseCounts[NORFAT_SECTORS];
+uint32_t TableProgramBytes = 0;
+uint32_t ReadBytes = 0;
+uint32_t ProgramCount = 0;
+uint32_t ReadCount = 0;
 
 uint32_t takeDownPeriod = 0;
 uint32_t takeDownTest = 0;
@@ -41,6 +68,8 @@ uint32_t read_block_device(uint32_t address, uint8_t* data, uint32_t len) {
 		}
 	}
 	//printf("Read 0x%X len 0x%X\r\n", address, len);
+	ReadBytes += len;
+	ReadCount++;
 	memcpy(data, &block[address], len);
 	return 0;
 }
@@ -73,8 +102,10 @@ uint32_t erase_block_sector(uint32_t address)
 uint32_t program_block_page(uint32_t address, uint8_t* data, uint32_t length)
 {	
 	uint32_t i;
+	ProgramCount++;
 	if (address < NORFAT_TABLE_SECTORS * NORFAT_TABLE_COUNT * NORFAT_SECTOR_SIZE) {
 		traceHandler("program_block_page(0x%X)(%i)\r\n", address, length);
+		TableProgramBytes += length;
 	}
 	if (address + length > BLOCK_SIZE) {
 		NORFAT_ASSERT(0);
@@ -92,9 +123,7 @@ uint32_t program_block_page(uint32_t address, uint8_t* data, uint32_t length)
 			return 1;
 		}
 	}
-	for (i = 0; i < length; i++) {
-		block[address + i] &= data[i];
-	}
+	norfat_k_and(&block[address], data, length);
 	return 0;
 }
 
@@ -186,6 +215,176 @@ void assertHandler(char* file, int line) {
 
 }
 
+/* Byte at a time reference, the engine norFAT shipped with */
+static uint32_t referenceCrc32(const uint8_t* p, uint32_t len, uint32_t crc) {
+	static uint32_t table[256];
+	uint32_t i, j, c;
+	if (!table[1]) {
+		for (i = 0; i < 256; ++i) {
+			for (c = i << 24, j = 8; j > 0; --j)
+				c = c & 0x80000000 ? (c << 1) ^ 0x04c11db7 : (c << 1);
+			table[i] = c;
+		}
+	}
+	for (; len > 0; ++p, --len)
+		crc = (crc << 8) ^ table[(crc >> 24) ^ *p];
+	return crc;
+}
+
+int crcBenchmark(void) {
+	uint32_t i, len, offset, seed;
+	uint32_t crcRef = 0, crcNew = 0;
+	uint32_t rounds = 64;
+	uint32_t size = 0x40000;
+	clock_t start;
+	double refTime, newTime;
+	uint8_t* data = malloc(size);
+	assert(data);
+	for (i = 0; i < size; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	//Bit identical for any length, alignment and seed
+	for (i = 0; i < 2000; i++) {
+		offset = getRand() % 64;
+		len = getRand() % 600;
+		seed = i & 1 ? 0xFFFFFFFF : getRand();
+		if (referenceCrc32(&data[offset], len, seed) != norfat_crc32(&data[offset], len, seed)) {
+			printf("CRC mismatch len %i offset %i seed 0x%X\r\n", len, offset, seed);
+			free(data);
+			return 1;
+		}
+	}
+	start = clock();
+	for (i = 0; i < rounds; i++) {
+		crcRef ^= referenceCrc32(data, size, 0xFFFFFFFF);
+	}
+	refTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+	start = clock();
+	for (i = 0; i < rounds; i++) {
+		crcNew ^= norfat_crc32(data, size, 0xFFFFFFFF);
+	}
+	newTime = (double)(clock() - start) / CLOCKS_PER_SEC;
+	free(data);
+	if (crcRef != crcNew) {
+		printf("CRC mismatch 0x%X 0x%X\r\n", crcRef, crcNew);
+		return 1;
+	}
+	printf("CRC bytewise %8.1f MB/s, NORFAT_CRC %8.1f MB/s\r\n",
+		refTime > 0 ? (rounds * (double)size) / (refTime * 1000000) : 0.0,
+		newTime > 0 ? (rounds * (double)size) / (newTime * 1000000) : 0.0);
+	return 0;
+}
+
+/* Plain kernels against the portable ones on random lengths, offsets and
+ * entries, then the rate of each over a flash sized buffer */
+int kernelBenchmark(void) {
+	uint32_t i, k, len, offset, first, mask, match;
+	uint32_t rounds = 64;
+	uint32_t size = 0x40000;
+	uint32_t count = size / sizeof(_sector);
+	uint32_t words = ((64 + count) / 32) + 2;
+	uint32_t sum = 0;
+	uint32_t masks[4];
+	clock_t start;
+	double t[2][3];
+	uint8_t* data = malloc(size);
+	uint8_t* other = malloc(size);
+	uint32_t* mapA = malloc(words * sizeof(uint32_t));
+	uint32_t* mapB = malloc(words * sizeof(uint32_t));
+	_sector* e = (_sector*)data;
+	assert(data && other && mapA && mapB);
+	//Top bit, top two, state nibble and the whole entry
+	masks[0] = 1u << (NORFAT_ENTRY_BITS - 1);
+	masks[1] = 3u << (NORFAT_ENTRY_BITS - 2);
+	masks[2] = 15u << (NORFAT_ENTRY_BITS - 4);
+	masks[3] = NORFAT_ENTRY_BITS == 16 ? 0xFFFF : 0xFFFFFFFF;
+	for (i = 0; i < 4000; i++) {
+		for (k = 0; k < 1024; k++) {
+			data[k] = i & 1 ? 0xFF : (uint8_t)getRand();
+			other[k] = (uint8_t)getRand();
+		}
+		offset = getRand() % 64;
+		len = getRand() % 900;
+		if (i & 2) {
+			data[offset + (getRand() % (len + 1))] &= (uint8_t)getRand();
+		}
+		if (norfat_k_blank(&data[offset], len) != norfat_k_blank_portable(&data[offset], len)) {
+			printf("Kernel blank mismatch len %i offset %i\r\n", len, offset);
+			goto fail;
+		}
+		memcpy(mapA, data, 1024);
+		memcpy(mapB, data, 1024);
+		norfat_k_and((uint8_t*)mapA + offset, &other[offset], len);
+		norfat_k_and_portable((uint8_t*)mapB + offset, &other[offset], len);
+		if (memcmp(mapA, mapB, 1024)) {
+			printf("Kernel and mismatch len %i offset %i\r\n", len, offset);
+			goto fail;
+		}
+		//Sparse matches on every other round
+		if (i & 4) {
+			memset(data, 0, 1024);
+			data[getRand() % 1024] = 0xFF;
+		}
+		offset = getRand() % 8;
+		len = getRand() % ((1024 / sizeof(_sector)) - 8);
+		first = getRand() % 64;
+		mask = masks[getRand() % 4];
+		match = e[offset + (getRand() % (len + 1))].base & mask;
+		memset(mapA, 0, words * sizeof(uint32_t));
+		memset(mapB, 0, words * sizeof(uint32_t));
+		if (norfat_k_find(&e[offset], len, mask, match) != norfat_k_find_portable(&e[offset], len, mask, match) ||
+			norfat_k_match(&e[offset], len, mask, match, mapA, first) !=
+			norfat_k_match_portable(&e[offset], len, mask, match, mapB, first) ||
+			memcmp(mapA, mapB, words * sizeof(uint32_t))) {
+			printf("Kernel entry mismatch len %i offset %i mask 0x%X\r\n", len, offset, mask);
+			goto fail;
+		}
+	}
+	//Blank flash with no entry to find, the common case for all three
+	memset(data, 0xFF, size);
+	memset(other, 0xFF, size);
+	for (k = 0; k < 2; k++) {
+		start = clock();
+		for (i = 0; i < rounds; i++) {
+			sum += k ? norfat_k_blank(data, size) : norfat_k_blank_portable(data, size);
+		}
+		t[k][0] = (double)(clock() - start) / CLOCKS_PER_SEC;
+		start = clock();
+		for (i = 0; i < rounds; i++) {
+			k ? norfat_k_and(data, other, size) : norfat_k_and_portable(data, other, size);
+		}
+		t[k][1] = (double)(clock() - start) / CLOCKS_PER_SEC;
+		start = clock();
+		for (i = 0; i < rounds; i++) {
+			sum += k ? norfat_k_find(e, count, masks[0], 0) : norfat_k_find_portable(e, count, masks[0], 0);
+			sum += k ? norfat_k_match(e, count, masks[0], 0, mapA, 0) : norfat_k_match_portable(e, count, masks[0], 0, mapA, 0);
+		}
+		t[k][2] = (double)(clock() - start) / CLOCKS_PER_SEC;
+	}
+	free(data);
+	free(other);
+	free(mapA);
+	free(mapB);
+	if (sum != 2 * rounds * (1 + count)) {
+		printf("Kernel benchmark mismatch %i\r\n", sum);
+		return 1;
+	}
+	for (k = 0; k < 2; k++) {
+		printf("Kernels %-8s blank %8.1f MB/s, and %8.1f MB/s, scan %8.1f Mentries/s\r\n",
+			k ? norfat_k_name() : "portable",
+			t[k][0] > 0 ? (rounds * (double)size) / (t[k][0] * 1000000) : 0.0,
+			t[k][1] > 0 ? (rounds * (double)size) / (t[k][1] * 1000000) : 0.0,
+			t[k][2] > 0 ? (2 * rounds * (double)count) / (t[k][2] * 1000000) : 0.0);
+	}
+	return 0;
+fail:
+	free(data);
+	free(other);
+	free(mapA);
+	free(mapB);
+	return 1;
+}
+
 int PowerFailOnWriteTest(norFAT_FS* fs) {
 	uint32_t i, j, tl, testLength, powered;
 	uint32_t rnd = 0;
@@ -344,6 +543,22 @@ int PowerStressTest(norFAT_FS* fs) {
 			printf("File close Failed %i\r\n", res);
 			break;
 		}
+		//Appended cycle counts never go backwards
+		f = norfat_fopen(fs, "log.bin", "r");
+		if (f != NULL) {
+			tl = norfat_fread(fs, compare, 1, 0x10000, f);
+			res = norfat_fclose(fs, f);
+			for (j = 4; j + 4 <= tl; j += 4) {
+				if (*(uint32_t*)&compare[j] < *(uint32_t*)&compare[j - 4]) {
+					res = 11;
+				}
+			}
+			if (res || tl % 4) {
+				printf("Append log corrupt at %i of %i\r\n", j, tl);
+				res = 11;
+				break;
+			}
+		}
 		takeDownTest = 1;
 
 		//powerCycleTest = 0;
@@ -364,6 +579,11 @@ int PowerStressTest(norFAT_FS* fs) {
 				res = norfat_fwrite(fs, &powerCycleTest, 1, 4, f);
 				res = norfat_fclose(fs, f);
 			}
+			f = norfat_fopen(fs, "log.bin", "ab");
+			if (f != NULL) {
+				res = norfat_fwrite(fs, &powerCycleTest, 1, 4, f);
+				res = norfat_fclose(fs, f);
+			}
 	}
 		else {
 			if (norfat_errno(fs) != NORFAT_ERR_IO) {
@@ -420,6 +640,26 @@ int PowerStressTest(norFAT_FS* fs) {
 					break;
 				}
 			}
+			else if (i % 16 == 0) {
+				//Clean shutdown now and then, power may fail in there too
+				res = norfat_unmount(fs);
+				if (res == 0) {
+					res = norfat_mount(fs);
+				}
+			}
+			else if (i % 4 == 0) {
+				//Idle time erase, power may fail in there too
+				res = norfat_maintain(fs, 4);
+				if (res > 0) {
+					res = 0;
+				}
+			}
+			else if (i % 4 == 2) {
+				res = norfat_gc_step(fs);
+				if (res > 0) {
+					res = 0;
+				}
+			}
 		}
 		if (res != NORFAT_ERR_IO) {
 			printf("\r\nPower test stress failed err %i\r\n", res);
@@ -718,86 +958,1855 @@ int deleteTest(norFAT_FS* fs) {
 	return 0;
 }
 
-int runTestSuite(norFAT_FS* fs) {
-	int res = 0;
-	res = PowerStressTest(fs);
+int deltaCommitTest(norFAT_FS* fs) {
+	int res;
+	uint32_t i;
+	uint8_t buf[32];
+	norfat_FILE* f;
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	for (i = 0; i < 10; i++) {
+		sprintf(buf, "delta%i.txt", i);
+		f = norfat_fopen(fs, buf, "w");
+		if (f == NULL) {
+			return 1;
+		}
+		TableProgramBytes = 0;
+		res = norfat_fwrite(fs, buf, 1, (uint32_t)strlen(buf), f);
+		res = norfat_fclose(fs, f);
+		if (res) {
+			return res;
+		}
+		//A small file only touches a few table pages in each copy
+		if (fs->fat->swapCount == 0 &&
+			TableProgramBytes > 2 * 4 * fs->programSize) {
+			printf("Commit programmed %i table bytes\r\n", TableProgramBytes);
+			return 1;
+		}
+	}
+	res = norfat_mount(fs);
 	if (res) {
-		printf("Power cycle stress test failed err %i\r\n", res);
-		writeTraceToFile();
 		return res;
 	}
-	res = deleteTest(fs);
+	for (i = 0; i < 10; i++) {
+		sprintf(buf, "delta%i.txt", i);
+		if (norfat_exists(fs, buf) != (int)strlen(buf)) {
+			printf("File %s lost after remount\r\n", buf);
+			return 1;
+		}
+	}
+	printf("Delta commit test passed\r\n");
+	return 0;
+}
+
+static int batchWrite(norFAT_FS* fs, uint32_t count) {
+	static uint8_t stamp = 0;
+	uint32_t i;
+	uint8_t buf[32];
+	uint8_t content[32];
+	norfat_FILE* f;
+	for (i = 0; i < count; i++) {
+		sprintf(buf, "batch%i.cfg", i);
+		f = norfat_fopen(fs, buf, "w");
+		if (f == NULL) {
+			return 1;
+		}
+		//New content every time, an unchanged rewrite would not commit
+		strcpy(content, buf);
+		content[0] = stamp++;
+		norfat_fwrite(fs, content, 1, (uint32_t)strlen(buf), f);
+		if (norfat_fclose(fs, f)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int batchCommitTest(norFAT_FS* fs) {
+	int res;
+	uint32_t i, spills;
+	uint8_t buf[32];
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	//Power lost before norfat_commit, none of the batch survives
+	norfat_begin(fs);
+	TableProgramBytes = 0;
+#if NORFAT_FAT_CACHE_PAGES
+	//Pages that overflow the cache spill to the table, nothing else
+	spills = fs->cacheSpills;
+#endif
+	if (batchWrite(fs, 20)) {
+		return 1;
+	}
+#if NORFAT_FAT_CACHE_PAGES
+	TableProgramBytes -= (fs->cacheSpills - spills) * fs->programSize;
+#endif
+	if (TableProgramBytes) {
+		printf("Batch committed early\r\n");
+		return 1;
+	}
+	res = norfat_mount(fs);
+	for (i = 0; i < 20; i++) {
+		sprintf(buf, "batch%i.cfg", i);
+		if (norfat_exists(fs, buf)) {
+			printf("File %s exists without commit\r\n", buf);
+			return 1;
+		}
+	}
+	//Committed batch survives as a whole
+	norfat_begin(fs);
+	if (batchWrite(fs, 20)) {
+		return 1;
+	}
+	res = norfat_commit(fs);
 	if (res) {
-		printf("Delete test err %i\r\n", res);
-		writeTraceToFile();
 		return res;
 	}
+	res = norfat_mount(fs);
+	for (i = 0; i < 20; i++) {
+		sprintf(buf, "batch%i.cfg", i);
+		if (norfat_exists(fs, buf) != (int)strlen(buf)) {
+			printf("File %s lost after commit\r\n", buf);
+			return 1;
+		}
+	}
+	printf("Batch commit test passed\r\n");
+	return 0;
+}
 
-	res = fillupTest(fs);
+int unmountTest(norFAT_FS* fs) {
+	int res;
+	uint32_t fullRead, fastRead;
+	uint8_t data[NORFAT_PACK_THRESHOLD + 4];
+	norfat_FILE* f;
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	if (batchWrite(fs, 5)) {
+		return 1;
+	}
+	ReadBytes = 0;
+	res = norfat_mount(fs);
+	fullRead = ReadBytes;
 	if (res) {
-		printf("Fill up test err %i\r\n", res);
-		writeTraceToFile();
 		return res;
 	}
-	res = randomWriteLengths(fs);
+	res = norfat_unmount(fs);
 	if (res) {
-		printf("Random write length test err %i\r\n", res);
-		writeTraceToFile();
 		return res;
 	}
-	res = wearLeveling(fs);
+	ReadBytes = 0;
+	res = norfat_mount(fs);
+	fastRead = ReadBytes;
 	if (res) {
-		printf("Wear leveling test failed %i\r\n", res);
-		writeTraceToFile();
 		return res;
 	}
+	if (fastRead >= fullRead || norfat_exists(fs, "batch4.cfg") != 10) {
+		printf("Clean mount read %i bytes, full mount %i\r\n", fastRead, fullRead);
+		return 1;
+	}
+	//Unmount with a file still being written leaves the marker off.
+	//Batched writes are sector files, so they commit
+	norfat_begin(fs);
+	if (batchWrite(fs, 1) || norfat_commit(fs)) {
+		return 1;
+	}
+	//Too big to pack, so it has sectors in write state. A full mount
+	//reads at least as much again, more when table pages miss the cache
+	memset(data, 'o', sizeof(data));
+	f = norfat_fopen(fs, "open.bin", "w");
+	norfat_fwrite(fs, data, 1, sizeof(data), f);
+	res = norfat_unmount(fs);
+	ReadBytes = 0;
+	res = norfat_mount(fs);
+	if (res || ReadBytes < fullRead) {
+		printf("Clean mount with a file open\r\n");
+		return 1;
+	}
+	//A commit after the clean mount removes the marker
+	res = norfat_unmount(fs);
+	res = norfat_mount(fs);
+	norfat_begin(fs);
+	if (batchWrite(fs, 1) || norfat_commit(fs)) {
+		return 1;
+	}
+	ReadBytes = 0;
+	res = norfat_mount(fs);
+	if (res || ReadBytes < fullRead || norfat_exists(fs, "batch0.cfg") != 10) {
+		printf("Marker survived a commit\r\n");
+		return 1;
+	}
+	printf("Unmount test passed, mount read %i -> %i bytes\r\n", fullRead, fastRead);
+	return 0;
+}
 
-	res = PowerFailOnWriteTest(fs);
+int indexTest(norFAT_FS* fs) {
+	int res;
+	uint32_t i;
+	uint8_t buf[32];
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	if (batchWrite(fs, 20)) {
+		return 1;
+	}
+	res = norfat_remove(fs, "batch3.cfg");
 	if (res) {
-		printf("Half write test failed %i\r\n", res);
-		writeTraceToFile();
 		return res;
 	}
-	printf("Passed all tests\r\n");
-	return res;
+	res = norfat_mount(fs);
+	//First lookup builds the index, misses after that read nothing
+	norfat_exists(fs, "batch0.cfg");
+	ReadBytes = 0;
+	for (i = 0; i < 20; i++) {
+		sprintf(buf, "missing%i.cfg", i);
+		if (norfat_exists(fs, buf)) {
+			return 1;
+		}
+	}
+	//Only when all 20 files fit the index
+	if (NORFAT_HASH_INDEX_SIZE >= 32 && ReadBytes) {
+		printf("Lookup of missing files read %i bytes\r\n", ReadBytes);
+		return 1;
+	}
+	//Index follows rewrites and removes
+	if (batchWrite(fs, 2)) {
+		return 1;
+	}
+	res = norfat_remove(fs, "batch7.cfg");
+	if (res) {
+		return res;
+	}
+	for (i = 0; i < 20; i++) {
+		sprintf(buf, "batch%i.cfg", i);
+		res = norfat_exists(fs, buf);
+		if (res != ((i == 3 || i == 7) ? 0 : (int)strlen(buf))) {
+			printf("File %s lookup returned %i\r\n", buf, res);
+			return 1;
+		}
+	}
+	ReadBytes = 0;
+	if (norfat_exists(fs, "batch7.cfg") || (NORFAT_HASH_INDEX_SIZE >= 32 && ReadBytes)) {
+		printf("Index incomplete after rewrite\r\n");
+		return 1;
+	}
+	printf("Index test passed\r\n");
+	return 0;
 }
 
-int main(int argv, char** argc) {
+static uint32_t totalErases(void) {
+	uint32_t i;
+	uint32_t total = 0;
+	for (i = 0; i < NORFAT_SECTORS; i++) {
+		total += EraseCounts[i];
+	}
+	return total;
+}
 
-	norFAT_FS fs1 = {
-		.addressStart = 0,
-		.tableCount = NORFAT_TABLE_COUNT + 4,//FAT tables carved out of flash sectors
-		.tableSectors = NORFAT_TABLE_SECTORS,
-		.flashSectors = NORFAT_SECTORS,
-		.sectorSize = NORFAT_SECTOR_SIZE,
-		.programSize = 256,
-		.erase_block_sector = erase_block_sector,
-		.program_block_page = program_block_page,
-		.read_block_device = read_block_device
-	};
+static int readBack(norFAT_FS* fs, const char* name, uint8_t* expect, uint32_t len) {
+	int res;
+	uint8_t* data = malloc(len);
+	norfat_FILE* f = norfat_fopen(fs, name, "r");
+	if (f == NULL) {
+		free(data);
+		return 1;
+	}
+	res = norfat_fread(fs, data, 1, len, f) != len || memcmp(data, expect, len);
+	norfat_fclose(fs, f);
+	free(data);
+	return res;
+}
 
-	norFAT_FS fs2 = {
-	.addressStart = 0,
-	.tableCount = NORFAT_TABLE_COUNT,//FAT tables carved out of flash sectors
-	.tableSectors = NORFAT_TABLE_SECTORS,
-	.flashSectors = NORFAT_SECTORS,
-	.sectorSize = NORFAT_SECTOR_SIZE,
-	.programSize = 256,
-	.erase_block_sector = erase_block_sector,
-	.program_block_page = program_block_page,
-	.read_block_device = read_block_device
-	};
+int preEraseTest(norFAT_FS* fs) {
+	int res;
+	uint32_t erases;
+	uint32_t len = NORFAT_SECTOR_SIZE * 3;
+	uint8_t* data = malloc(len * 2);
+	norfat_FILE* f;
+	if (NORFAT_PREERASE_POOL < 5) {
+		printf("Pre-erase test skipped\r\n");
+		return 0;
+	}
+	memset(data, 0x5A, len);
+	memset(data + len, 0xA5, len);
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	res = norfat_maintain(fs, 64);
+	if (res != NORFAT_PREERASE_POOL) {
+		printf("Pool filled %i sectors\r\n", res);
+		return 1;
+	}
+	//Pool survives a power loss
+	res = norfat_mount(fs);
+	res = norfat_maintain(fs, 64);
+	if (res) {
+		printf("Pool lost on mount, %i erased\r\n", res);
+		return 1;
+	}
+	//Writes only program
+	erases = totalErases();
+	f = norfat_fopen(fs, "pool.bin", "w");
+	norfat_fwrite(fs, data, 1, len, f);
+	res = norfat_fclose(fs, f);
+	if (res || totalErases() != erases) {
+		printf("Write erased %i sectors\r\n", totalErases() - erases);
+		return 1;
+	}
+	//A pool sector written without fclose is not trusted after power loss
+	f = norfat_fopen(fs, "open.bin", "w");
+	norfat_fwrite(fs, data, 1, 1000, f);
+	res = norfat_mount(fs);
+	res = norfat_maintain(fs, 64);
+	if (res != 5) {
+		printf("Refilled %i sectors after power loss\r\n", res);
+		return 1;
+	}
+	f = norfat_fopen(fs, "pool2.bin", "w");
+	norfat_fwrite(fs, data + len, 1, len, f);
+	res = norfat_fclose(fs, f);
+	if (res || readBack(fs, "pool.bin", data, len) || readBack(fs, "pool2.bin", data + len, len)) {
+		printf("Pool file corrupt\r\n");
+		return 1;
+	}
+	free(data);
+	printf("Pre-erase test passed\r\n");
+	return 0;
+}
 
-	printf("norFAT test jig 1.00, norFAT Version %s\r\n", NORFAT_VERSION);
-	if (argv > 1) {
-		POWER_CYCLE_COUNT = strtol(argc[1], NULL, 10);
-		printf("Testing cycles set to %i\r\n", POWER_CYCLE_COUNT);
+//Rewrites gc.bin until norfat_gc_step starts a collection
+static int gcFill(norFAT_FS* fs, uint8_t* data, uint32_t len) {
+	int res;
+	norfat_FILE* f;
+	while ((res = norfat_gc_step(fs)) == 0) {
+		f = norfat_fopen(fs, "gc.bin", "w");
+		if (f == NULL) {
+			return 1;
+		}
+		norfat_fwrite(fs, data, 1, len, f);
+		if (norfat_fclose(fs, f)) {
+			return 1;
+		}
 	}
-	memset(block, 0xFF, BLOCK_SIZE);
-	fs1.buff = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
-	fs1.fat = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
-	fs2.buff = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
-	fs2.fat = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
+	return res != 1;
+}
+
+int gcTest(norFAT_FS* fs) {
+	int res;
+	uint32_t steps, erases, swaps;
+	uint32_t len = NORFAT_SECTOR_SIZE * 64;
+	uint8_t* data = malloc(len);
+	norfat_FILE* f;
+	memset(data, 0x3C, len);
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	if (gcFill(fs, data, len)) {
+		printf("Collection never started\r\n");
+		return 1;
+	}
+	//One erase at most per step
+	steps = 0;
+	do {
+		erases = totalErases();
+		res = norfat_gc_step(fs);
+		if (res < 0 || totalErases() - erases > 1) {
+			printf("GC step %i erased %i sectors\r\n", steps, totalErases() - erases);
+			return 1;
+		}
+		steps++;
+	} while (res);
+	if (steps != fs->tableSectors * 2 + 2) {
+		printf("GC took %i steps\r\n", steps);
+		return 1;
+	}
+	//The next write finds space without a collection
+	swaps = fs->fat->swapCount;
+	f = norfat_fopen(fs, "after.bin", "w");
+	norfat_fwrite(fs, data, 1, len, f);
+	res = norfat_fclose(fs, f);
+	if (res || fs->fat->swapCount != swaps) {
+		printf("Write after GC swapped tables\r\n");
+		return 1;
+	}
+	//A commit in the middle of a collection finishes it first
+	if (gcFill(fs, data, len)) {
+		return 1;
+	}
+	norfat_gc_step(fs);
+	norfat_gc_step(fs);
+	f = norfat_fopen(fs, "mid.bin", "w");
+	norfat_fwrite(fs, data, 1, 1000, f);
+	res = norfat_fclose(fs, f);
+	if (res || norfat_gc_step(fs)) {
+		printf("Collection left pending after commit\r\n");
+		return 1;
+	}
+	res = norfat_mount(fs);
+	if (res || readBack(fs, "mid.bin", data, 1000) || readBack(fs, "gc.bin", data, len) ||
+		readBack(fs, "after.bin", data, len)) {
+		printf("Files lost after GC\r\n");
+		return 1;
+	}
+	free(data);
+	printf("GC test passed\r\n");
+	return 0;
+}
+
+int smallWriteTest(norFAT_FS* fs) {
+	int res;
+	uint32_t i;
+	uint8_t* data = malloc(4000);
+	norfat_FILE* f;
+	for (i = 0; i < 4000; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	//Serializer style, 4 bytes at a time
+	f = norfat_fopen(fs, "small.bin", "w");
+	ProgramCount = 0;
+	for (i = 0; i < 1000; i++) {
+		norfat_fwrite(fs, &data[i * 4], 1, 4, f);
+	}
+	if (NORFAT_WRITE_BUFFER && ProgramCount != 4000 / fs->programSize) {
+		printf("1000 small writes took %i programs\r\n", ProgramCount);
+		return 1;
+	}
+	res = norfat_fclose(fs, f);
+	if (res || readBack(fs, "small.bin", data, 4000)) {
+		printf("Small writes did not read back\r\n");
+		return 1;
+	}
+	//Flushed page is topped up by later writes
+	f = norfat_fopen(fs, "flush.bin", "w");
+	norfat_fwrite(fs, data, 1, 10, f);
+	res = norfat_fflush(fs, f);
+	norfat_fwrite(fs, &data[10], 1, 600, f);
+	res |= norfat_fflush(fs, f);
+	norfat_fwrite(fs, &data[610], 1, 10, f);
+	res |= norfat_fclose(fs, f);
+	if (res || readBack(fs, "flush.bin", data, 620)) {
+		printf("Flushed writes did not read back\r\n");
+		return 1;
+	}
+	free(data);
+	printf("Small write test passed\r\n");
+	return 0;
+}
+
+int seekTest(norFAT_FS* fs) {
+	int res;
+	uint32_t i, pos, len;
+	uint32_t fileLen = NORFAT_SECTOR_SIZE * 5 + 1234;
+	uint8_t* data = malloc(fileLen);
+	uint8_t* compare = malloc(fileLen);
+	norfat_FILE* f;
+	for (i = 0; i < fileLen; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	f = norfat_fopen(fs, "seek.bin", "w");
+	norfat_fwrite(fs, data, 1, fileLen, f);
+	res = norfat_fclose(fs, f);
+	f = norfat_fopen(fs, "seek.bin", "r");
+	if (res || f == NULL) {
+		return 1;
+	}
+	//Sector edges, then random spots
+	for (i = 0; i < 200; i++) {
+		if (i < 12) {
+			pos = ((i / 2) * NORFAT_SECTOR_SIZE) - fs->programSize + (i % 2);
+			pos = i < 2 ? i : pos;
+		}
+		else {
+			pos = getRand() % fileLen;
+		}
+		len = getRand() % 5000;
+		if (pos + len > fileLen) {
+			len = fileLen - pos;
+		}
+		res = norfat_fseek(fs, f, (int32_t)pos - (int32_t)fileLen, NORFAT_SEEK_END);
+		ReadBytes = 0;
+		if (res || norfat_ftell(fs, f) != pos ||
+			norfat_fread(fs, compare, 1, len, f) != len ||
+			memcmp(compare, &data[pos], len)) {
+			printf("Seek to %i failed\r\n", pos);
+			return 1;
+		}
+		if (len && len < 100 && ReadBytes > 2 * len) {
+			printf("Seek read %i bytes for %i\r\n", ReadBytes, len);
+			return 1;
+		}
+	}
+	res = norfat_fseek(fs, f, 0, NORFAT_SEEK_SET);
+	res |= norfat_fseek(fs, f, 100, NORFAT_SEEK_CUR);
+	res |= norfat_fseek(fs, f, -50, NORFAT_SEEK_CUR);
+	if (res || norfat_ftell(fs, f) != 50 || norfat_fread(fs, compare, 1, 10, f) != 10 ||
+		memcmp(compare, &data[50], 10)) {
+		printf("Relative seek failed\r\n");
+		return 1;
+	}
+	res = norfat_fseek(fs, f, 0, NORFAT_SEEK_END);
+	if (res || norfat_fread(fs, compare, 1, 10, f) != 0) {
+		printf("Read past end of file\r\n");
+		return 1;
+	}
+	if (norfat_fseek(fs, f, 1, NORFAT_SEEK_END) != NORFAT_ERR_SEEK ||
+		norfat_fseek(fs, f, -1, NORFAT_SEEK_SET) != NORFAT_ERR_SEEK) {
+		printf("Seek outside the file accepted\r\n");
+		return 1;
+	}
+	norfat_fclose(fs, f);
+	//Fresh volume, the chain is contiguous apart from a wrap at the end of flash
+	f = norfat_fopen(fs, "seek.bin", "r");
+	ReadCount = 0;
+	len = 2;
+#if NORFAT_STREAM_BUFFER && !NORFAT_DIRECT_READ
+	//Or as many as the stream's bounce buffer needs
+	len += fileLen / NORFAT_STREAM_BUFFER;
+#endif
+	if (norfat_fread(fs, compare, 1, fileLen, f) != fileLen || memcmp(compare, data, fileLen) ||
+		ReadCount > len) {
+		printf("Contiguous read took %i reads\r\n", ReadCount);
+		return 1;
+	}
+	norfat_fclose(fs, f);
+	free(data);
+	free(compare);
+	printf("Seek test passed\r\n");
+	return 0;
+}
+
+int zeroCopyTest(norFAT_FS* fs) {
+	int32_t res;
+	uint32_t i, pos;
+	uint32_t fileLen = NORFAT_SECTOR_SIZE * 3 + 100;
+	uint8_t* data = malloc(fileLen);
+	uint8_t* compare = malloc(fileLen);
+	norfat_span spans[8];
+	norfat_FILE* f;
+	for (i = 0; i < fileLen; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	f = norfat_fopen(fs, "config.bin", "w");
+	norfat_fwrite(fs, data, 1, fileLen, f);
+	res = norfat_fclose(fs, f);
+	f = norfat_fopen(fs, "config.bin", "rz");
+	if (res || f == NULL || norfat_fread(fs, compare, 1, fileLen, f) != fileLen ||
+		memcmp(compare, data, fileLen)) {
+		printf("Zero copy read failed\r\n");
+		return 1;
+	}
+	norfat_fclose(fs, f);
+	res = norfat_fmap(fs, "config.bin", NULL, 0);
+	if (fs->mapBase == NULL) {
+		if (res != NORFAT_ERR_UNSUPPORTED) {
+			return 1;
+		}
+	}
+	else {
+		//Asking again with room for all spans gives the same count
+		if (res < 1 || res > 8 || norfat_fmap(fs, "config.bin", spans, 8) != res) {
+			printf("fmap returned %i spans\r\n", res);
+			return 1;
+		}
+		for (i = pos = 0; i < (uint32_t)res; i++) {
+			if (pos + spans[i].length > fileLen || memcmp(spans[i].address, &data[pos], spans[i].length)) {
+				printf("fmap span %i wrong\r\n", i);
+				return 1;
+			}
+			pos += spans[i].length;
+		}
+		if (pos != fileLen || norfat_fmap(fs, "missing.bin", spans, 8) != NORFAT_ERR_FILE_NOT_FOUND) {
+			printf("fmap covered %i bytes\r\n", pos);
+			return 1;
+		}
+	}
+	free(data);
+	free(compare);
+	printf("Zero copy test passed\r\n");
+	return 0;
+}
+
+static int appendLine(norFAT_FS* fs, const char* name, uint8_t* data, uint32_t len) {
+	int res;
+	norfat_FILE* f = norfat_fopen(fs, name, "a");
+	if (f == NULL) {
+		return 1;
+	}
+	if (norfat_fwrite(fs, data, 1, len, f) != len) {
+		norfat_fclose(fs, f);
+		return 1;
+	}
+	res = norfat_fclose(fs, f);
+	return res;
+}
+
+int appendTest(norFAT_FS* fs) {
+	int res;
+	uint32_t i, len, total = 0;
+	uint32_t maxLen = NORFAT_SECTOR_SIZE * 8;
+	uint8_t* data = malloc(maxLen);
+	norfat_FILE* f;
+	for (i = 0; i < maxLen; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	//Creates the file, then appends lines and chunks that cross sectors,
+	//running out of header records along the way
+	for (i = 0; i < 40; i++) {
+		len = (i % 5 == 4) ? NORFAT_SECTOR_SIZE + 77 : 10 + i;
+		if (total + len > maxLen) {
+			break;
+		}
+		TableProgramBytes = 0;
+		if (appendLine(fs, "log.txt", &data[total], len)) {
+			printf("Append %i failed\r\n", i);
+			return 1;
+		}
+		total += len;
+		if (i % 3 == 0) {
+			res = norfat_mount(fs);
+		}
+		if (readBack(fs, "log.txt", data, total) || norfat_exists(fs, "log.txt") != (int)total) {
+			printf("Append %i did not read back\r\n", i);
+			return 1;
+		}
+	}
+	//A line that fits the tail costs the data plus a record, no commit.
+	//Starts too big to pack, packed files are rewritten instead
+	len = NORFAT_PACK_THRESHOLD + 10;
+	i = ProgramCount;
+	TableProgramBytes = 0;
+	if (appendLine(fs, "short.txt", data, len) || appendLine(fs, "short.txt", &data[len], 10)) {
+		return 1;
+	}
+	TableProgramBytes = 0;
+	i = ProgramCount;
+	if (appendLine(fs, "short.txt", &data[len + 10], 10) || TableProgramBytes || ProgramCount - i > 2) {
+		printf("Tail append took %i programs, %i table bytes\r\n", ProgramCount - i, TableProgramBytes);
+		return 1;
+	}
+	//Power lost before fclose, then the tail is dirty and the next append rewrites
+	f = norfat_fopen(fs, "short.txt", "a");
+	norfat_fwrite(fs, data, 1, NORFAT_SECTOR_SIZE * 2, f);
+	res = norfat_mount(fs);
+	if (readBack(fs, "short.txt", data, len + 20) || appendLine(fs, "short.txt", &data[len + 20], 10) ||
+		readBack(fs, "short.txt", data, len + 30)) {
+		printf("Append after power loss failed\r\n");
+		return 1;
+	}
+	free(data);
+	printf("Append test passed\r\n");
+	return 0;
+}
+
+static int rewrite(norFAT_FS* fs, const char* name, uint8_t* data, uint32_t len, uint32_t chunk) {
+	uint32_t i;
+	norfat_FILE* f = norfat_fopen(fs, name, "w");
+	if (f == NULL) {
+		return 1;
+	}
+	for (i = 0; i < len; i += chunk) {
+		norfat_fwrite(fs, &data[i], 1, (len - i) < chunk ? (len - i) : chunk, f);
+	}
+	return norfat_fclose(fs, f);
+}
+
+int elideTest(norFAT_FS* fs) {
+#if NORFAT_ELIDE_UNCHANGED
+	int res;
+	uint32_t i, elided, spills;
+	uint32_t len = NORFAT_SECTOR_SIZE * 2 + 100;
+	uint8_t* data = malloc(len);
+	for (i = 0; i < len; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	if (rewrite(fs, "config.bin", data, len, len)) {
+		return 1;
+	}
+	//Same bytes in small pieces, part of them still buffered at fclose
+	elided = fs->elidedWrites;
+	TableProgramBytes = 0;
+#if NORFAT_FAT_CACHE_PAGES
+	//Pages that overflow the cache may still spill
+	spills = fs->cacheSpills;
+	res = rewrite(fs, "config.bin", data, len, 7);
+	TableProgramBytes -= (fs->cacheSpills - spills) * fs->programSize;
+#else
+	res = rewrite(fs, "config.bin", data, len, 7);
+#endif
+	if (res || fs->elidedWrites != elided + 1 || TableProgramBytes) {
+		printf("Unchanged rewrite not elided, %i table bytes\r\n", TableProgramBytes);
+		return 1;
+	}
+	if (readBack(fs, "config.bin", data, len)) {
+		return 1;
+	}
+	//One byte different, or shorter, is a real write
+	data[len - 1] ^= 0x5A;
+	if (rewrite(fs, "config.bin", data, len, len) || fs->elidedWrites != elided + 1 ||
+		readBack(fs, "config.bin", data, len)) {
+		printf("Changed rewrite was elided\r\n");
+		return 1;
+	}
+	if (rewrite(fs, "config.bin", data, len - 1, len) || fs->elidedWrites != elided + 1 ||
+		readBack(fs, "config.bin", data, len - 1)) {
+		printf("Shorter rewrite was elided\r\n");
+		return 1;
+	}
+	//The crc comes from the header after a remount, and from the append record
+	res = norfat_mount(fs);
+	if (rewrite(fs, "config.bin", data, len - 1, 64) || fs->elidedWrites != elided + 2) {
+		printf("Unchanged rewrite after mount not elided\r\n");
+		return 1;
+	}
+	if (appendLine(fs, "config.bin", &data[len - 1], 1) ||
+		rewrite(fs, "config.bin", data, len, len) || fs->elidedWrites != elided + 3) {
+		printf("Unchanged rewrite after append not elided\r\n");
+		return 1;
+	}
+	res = norfat_mount(fs);
+	if (readBack(fs, "config.bin", data, len)) {
+		return 1;
+	}
+	free(data);
+	printf("Elide test passed\r\n");
+#endif
+	return 0;
+}
+
+#if NORFAT_TEST_HOOKS
+static uint32_t usedSectors(norFAT_FS* fs) {
+	uint32_t i, used = 0;
+	for (i = fs->tableCount * fs->tableSectors; i < fs->flashSectors; i++) {
+		_sector s = norfat_sector(fs, i);
+		used += !s.available && s.active && !s.write;
+	}
+	return used;
+}
+#else
+//Sector accounting reads table entries through norfat_sector, skip it
+#define usedSectors(fs) 0
+#endif
+
+static int packCheck(norFAT_FS* fs, uint8_t* contents, uint32_t* lengths, uint32_t count) {
+	uint32_t i;
+	uint8_t name[32];
+	for (i = 0; i < count; i++) {
+		sprintf(name, "cfg%i.txt", i);
+		if (lengths[i] == 0) {
+			if (norfat_exists(fs, name) != 0) {
+				printf("Removed %s still there\r\n", name);
+				return 1;
+			}
+		}
+		else if (norfat_exists(fs, name) != (int)lengths[i] ||
+			readBack(fs, name, &contents[i * NORFAT_PACK_THRESHOLD], lengths[i])) {
+			printf("Packed %s did not read back\r\n", name);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int packTest(norFAT_FS* fs) {
+#if NORFAT_PACK_THRESHOLD
+	int res;
+	uint32_t i, j, erases, count = 300;
+	uint8_t name[32];
+	uint8_t* contents = malloc(count * NORFAT_PACK_THRESHOLD);
+	uint32_t* lengths = malloc(count * sizeof(uint32_t));
+	uint8_t* big = malloc(NORFAT_SECTOR_SIZE);
+	norfat_span span;
+	norfat_FILE* f;
+	for (i = 0; i < count * NORFAT_PACK_THRESHOLD; i++) {
+		contents[i] = (uint8_t)getRand();
+	}
+	for (i = 0; i < NORFAT_SECTOR_SIZE; i++) {
+		big[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	//Small settings share sectors
+	erases = totalErases();
+	for (i = 0; i < count; i++) {
+		sprintf(name, "cfg%i.txt", i);
+		lengths[i] = 1 + (getRand() % NORFAT_PACK_THRESHOLD);
+		if (rewrite(fs, name, &contents[i * NORFAT_PACK_THRESHOLD], lengths[i], 5)) {
+			return 1;
+		}
+	}
+	if (usedSectors(fs) > count / 4 || totalErases() - erases > count / 4) {
+		printf("%i small files took %i sectors, %i erases\r\n", count, usedSectors(fs), totalErases() - erases);
+		return 1;
+	}
+	res = norfat_mount(fs);
+	if (packCheck(fs, contents, lengths, count)) {
+		return 1;
+	}
+	//Rewrites and removes, and going to and from a sector file
+	for (i = 0; i < count; i += 3) {
+		sprintf(name, "cfg%i.txt", i);
+		contents[i * NORFAT_PACK_THRESHOLD] ^= 0x55;
+		lengths[i] = 1 + (getRand() % NORFAT_PACK_THRESHOLD);
+		if (rewrite(fs, name, &contents[i * NORFAT_PACK_THRESHOLD], lengths[i], lengths[i])) {
+			return 1;
+		}
+		sprintf(name, "cfg%i.txt", i + 1);
+		if (norfat_remove(fs, name)) {
+			return 1;
+		}
+		lengths[i + 1] = 0;
+	}
+	if (rewrite(fs, "cfg2.txt", big, NORFAT_SECTOR_SIZE, 100) || readBack(fs, "cfg2.txt", big, NORFAT_SECTOR_SIZE)) {
+		printf("Packed file did not grow\r\n");
+		return 1;
+	}
+	if (rewrite(fs, "cfg2.txt", &contents[2 * NORFAT_PACK_THRESHOLD], lengths[2], 1)) {
+		return 1;
+	}
+	res = norfat_mount(fs);
+	if (packCheck(fs, contents, lengths, count)) {
+		return 1;
+	}
+	//Busy settings fill pack sectors, dead ones get dropped and compacted
+	erases = usedSectors(fs);
+	for (j = 0; j < 2000; j++) {
+		i = (getRand() % (count / 3)) * 3;
+		sprintf(name, "cfg%i.txt", i);
+		contents[(i * NORFAT_PACK_THRESHOLD) + (j % lengths[i])] = (uint8_t)j;
+		if (rewrite(fs, name, &contents[i * NORFAT_PACK_THRESHOLD], lengths[i], 64)) {
+			return 1;
+		}
+	}
+	if (usedSectors(fs) > erases + 4) {
+		printf("Pack sectors grew from %i to %i\r\n", erases, usedSectors(fs));
+		return 1;
+	}
+	res = norfat_mount(fs);
+	if (packCheck(fs, contents, lengths, count)) {
+		return 1;
+	}
+	//Seek and map work the same on a record
+	f = norfat_fopen(fs, "cfg0.txt", "r");
+	if (f == NULL || norfat_fseek(fs, f, -1, NORFAT_SEEK_END) || norfat_fread(fs, name, 1, 4, f) != 1 ||
+		name[0] != contents[lengths[0] - 1]) {
+		printf("Packed seek failed\r\n");
+		return 1;
+	}
+	norfat_fclose(fs, f);
+	if (fs->mapBase && (norfat_fmap(fs, "cfg0.txt", &span, 1) != 1 || span.length != lengths[0] ||
+		memcmp(span.address, contents, lengths[0]))) {
+		printf("Packed fmap failed\r\n");
+		return 1;
+	}
+	free(contents);
+	free(lengths);
+	free(big);
+	printf("Pack test passed, %i sectors\r\n", usedSectors(fs));
+#endif
+	return 0;
+}
+
+#define STREAM_COUNT		6
+#define STREAM_FILE_SIZE	20000
+
+/* Writes and reads several streams in interleaved random chunks, more of
+ * them than the stream buffer pool holds */
+int streamBufferTest(norFAT_FS* fs) {
+#if NORFAT_STREAM_BUFFER
+	static uint8_t own[NORFAT_STREAM_BUFFER];
+	norfat_FILE* f[STREAM_COUNT];
+	uint32_t pos[STREAM_COUNT];
+	uint8_t* data = malloc(STREAM_COUNT * STREAM_FILE_SIZE);
+	uint8_t* back = malloc(STREAM_FILE_SIZE);
+	char name[32];
+	uint32_t i, len, busy;
+	int res = 0;
+	for (i = 0; i < STREAM_COUNT * STREAM_FILE_SIZE; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	for (i = 0; i < STREAM_COUNT; i++) {
+		snprintf(name, sizeof(name), "stream%i.bin", i);
+		f[i] = norfat_fopen(fs, name, "w");
+		pos[i] = 0;
+		if (f[i] == NULL) {
+			res = 1;
+		}
+	}
+	for (busy = 1; busy && !res; ) {
+		busy = 0;
+		for (i = 0; i < STREAM_COUNT; i++) {
+			len = getRand() % 700 + 1;
+			if (len > STREAM_FILE_SIZE - pos[i]) {
+				len = STREAM_FILE_SIZE - pos[i];
+			}
+			if (len && norfat_fwrite(fs, &data[(i * STREAM_FILE_SIZE) + pos[i]], 1, len, f[i]) != len) {
+				res = 2;
+			}
+			pos[i] += len;
+			busy |= pos[i] < STREAM_FILE_SIZE;
+		}
+		//Swapped with a partial page held
+		if (pos[1] < 4000 && pos[1] % fs->programSize && norfat_setbuf(fs, f[1], own)) {
+			res = 3;
+		}
+	}
+	for (i = 0; i < STREAM_COUNT; i++) {
+		if (f[i] != NULL && norfat_fclose(fs, f[i])) {
+			res = 4;
+		}
+		f[i] = NULL;
+	}
+	if (!res && fs->streamPoolUsed) {
+		res = 5;
+	}
+	for (i = 0; i < STREAM_COUNT && !res; i++) {
+		snprintf(name, sizeof(name), "stream%i.bin", i);
+		f[i] = norfat_fopen(fs, name, "r");
+		pos[i] = 0;
+		if (f[i] == NULL) {
+			res = 6;
+		}
+	}
+	for (busy = 1; busy && !res; ) {
+		busy = 0;
+		for (i = 0; i < STREAM_COUNT; i++) {
+			len = getRand() % 3000 + 1;
+			len = norfat_fread(fs, back, 1, len, f[i]);
+			if (memcmp(back, &data[(i * STREAM_FILE_SIZE) + pos[i]], len)) {
+				res = 7;
+			}
+			pos[i] += len;
+			busy |= len != 0;
+		}
+	}
+	for (i = 0; i < STREAM_COUNT; i++) {
+		if (pos[i] != STREAM_FILE_SIZE && !res) {
+			res = 8;
+		}
+		if (f[i] != NULL) {
+			norfat_fclose(fs, f[i]);
+		}
+		snprintf(name, sizeof(name), "stream%i.bin", i);
+		norfat_remove(fs, name);
+	}
+	if (!res && fs->streamPoolUsed) {
+		res = 9;
+	}
+	free(data);
+	free(back);
+	if (res) {
+		return res;
+	}
+	printf("Stream buffer test passed\r\n");
+#endif
+	return 0;
+}
+
+#if NORFAT_ASYNC_PROGRAM
+static uint32_t asyncAddress, asyncLength, asyncPolls;
+static uint8_t* asyncData;
+//Completes programs through norfat_async_done instead of program_poll
+static norFAT_FS* asyncFs;
+
+uint32_t program_page_submit(uint32_t address, uint8_t* data, uint32_t length) {
+	NORFAT_ASSERT(asyncData == NULL);
+	asyncAddress = address;
+	asyncData = data;
+	asyncLength = length;
+	asyncPolls = 3;
+	return 0;
+}
+
+/* The data is only taken when the program ends, so a buffer reused while
+ * it runs shows up as corrupt contents */
+static uint32_t finishProgram(void) {
+	uint32_t res = program_block_page(asyncAddress, asyncData, asyncLength);
+	asyncData = NULL;
+	return res ? 2 : 0;
+}
+
+uint32_t program_poll(void) {
+	if (asyncPolls) {
+		asyncPolls--;
+		return 1;
+	}
+	return finishProgram();
+}
+
+/* Stands in for the DMA interrupt */
+void async_yield(void) {
+	if (asyncFs == NULL || asyncData == NULL) {
+		return;
+	}
+	if (asyncPolls) {
+		asyncPolls--;
+	}
+	else {
+		norfat_async_done(asyncFs, finishProgram());
+	}
+}
+
+static int asyncRound(norFAT_FS* fs) {
+	norfat_FILE* f[2];
+	uint32_t len[2], pos[2];
+	uint8_t* data = malloc(2 * 30000);
+	uint32_t i, chunk, inFlight = 0;
+	int res = 0;
+	for (i = 0; i < 2 * 30000; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	for (i = 0; i < 2; i++) {
+		len[i] = 5000 + getRand() % 25000;
+		pos[i] = 0;
+		f[i] = norfat_fopen(fs, i ? "async1.bin" : "async0.bin", "w");
+	}
+	if (f[0] == NULL || f[1] == NULL) {
+		res = 1;
+	}
+	while (!res && (pos[0] < len[0] || pos[1] < len[1])) {
+		for (i = 0; i < 2; i++) {
+			chunk = getRand() % 3000 + 1;
+			chunk = chunk > len[i] - pos[i] ? len[i] - pos[i] : chunk;
+			if (chunk && norfat_fwrite(fs, &data[(i * 30000) + pos[i]], 1, chunk, f[i]) != chunk) {
+				res = 2;
+			}
+			pos[i] += chunk;
+			//fwrite left its last program running
+			if (chunk && norfat_poll(fs) == 1) {
+				inFlight++;
+			}
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		if (f[i] != NULL && norfat_fclose(fs, f[i]) && !res) {
+			res = 3;
+		}
+	}
+	if (!res && (readBack(fs, "async0.bin", data, len[0]) || readBack(fs, "async1.bin", &data[30000], len[1]))) {
+		res = 4;
+	}
+	//Pipelining needs the wbuf page and two more in the stream buffer
+	if (NORFAT_STREAM_BUFFER < 3 * fs->programSize) {
+		inFlight = 1;
+	}
+	if (!res && (inFlight == 0 || asyncData != NULL || norfat_poll(fs) != 0)) {
+		res = 5;
+	}
+	free(data);
+	return res;
+}
+#endif
+
+int asyncTest(norFAT_FS* fs) {
+#if NORFAT_ASYNC_PROGRAM
+	uint32_t(*submit)(uint32_t, uint8_t*, uint32_t) = fs->program_page_submit;
+	uint32_t(*poll)(void) = fs->program_poll;
+	int res;
+	fs->program_page_submit = program_page_submit;
+	fs->program_poll = program_poll;
+	fs->async_yield = async_yield;
+	res = asyncRound(fs);
+	if (!res) {
+		fs->program_poll = NULL;
+		asyncFs = fs;
+		res = asyncRound(fs) ? 10 : 0;
+	}
+	fs->program_page_submit = submit;
+	fs->program_poll = poll;
+	fs->async_yield = NULL;
+	asyncFs = NULL;
+	norfat_remove(fs, "async0.bin");
+	norfat_remove(fs, "async1.bin");
+	if (res) {
+		return res;
+	}
+	printf("Async program test passed\r\n");
+#endif
+	return 0;
+}
+
+#if NORFAT_THREAD_SAFE && defined(__linux__)
+#define THREAD_FILES		8
+#define THREAD_FILE_SIZE	(64 * 1024)
+#define THREAD_MAX_READERS	8
+/* Flash command and address phase, paid by every read */
+#define THREAD_READ_MICROS	50
+
+/* Every reader keeps THREAD_FILES streams open next to the writer's,
+ * which a stream pool has to cover. The jig build sets 72 */
+#if NORFAT_MAX_OPEN_FILES && NORFAT_MAX_OPEN_FILES < (THREAD_MAX_READERS * THREAD_FILES) + 2
+#error The thread test needs NORFAT_MAX_OPEN_FILES of (THREAD_MAX_READERS * THREAD_FILES) + 2
+#endif
+
+static pthread_rwlock_t fsRwLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t fsMutex = PTHREAD_MUTEX_INITIALIZER;
+#if NORFAT_FAT_CACHE_PAGES
+static pthread_mutex_t cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static volatile uint32_t threadStop;
+static pthread_barrier_t threadOpened;
+
+static void rwLockShared(void* context) {
+	NORFAT_ASSERT(pthread_rwlock_rdlock(context) == 0);
+}
+
+static void rwLockExclusive(void* context) {
+	NORFAT_ASSERT(pthread_rwlock_wrlock(context) == 0);
+}
+
+static void rwUnlock(void* context) {
+	NORFAT_ASSERT(pthread_rwlock_unlock(context) == 0);
+}
+
+static void mutexLock(void* context) {
+	NORFAT_ASSERT(pthread_mutex_lock(context) == 0);
+}
+
+static void mutexUnlock(void* context) {
+	NORFAT_ASSERT(pthread_mutex_unlock(context) == 0);
+}
+
+static void useRwLock(norFAT_FS* fs) {
+	fs->lockContext = &fsRwLock;
+	fs->lock_shared = rwLockShared;
+	fs->unlock_shared = rwUnlock;
+	fs->lock_exclusive = rwLockExclusive;
+	fs->unlock_exclusive = rwUnlock;
+#if NORFAT_FAT_CACHE_PAGES
+	//Readers load table pages behind their own lock and keep sharing
+	fs->cacheLockContext = &cacheMutex;
+	fs->lock_cache = mutexLock;
+	fs->unlock_cache = mutexUnlock;
+#endif
+}
+
+static void useMutex(norFAT_FS* fs) {
+	fs->lockContext = &fsMutex;
+	fs->lock_shared = mutexLock;
+	fs->unlock_shared = mutexUnlock;
+	fs->lock_exclusive = mutexLock;
+	fs->unlock_exclusive = mutexUnlock;
+#if NORFAT_FAT_CACHE_PAGES
+	fs->lock_cache = NULL;
+	fs->unlock_cache = NULL;
+#endif
+}
+
+static uint32_t slowRead(uint32_t address, uint8_t* data, uint32_t len) {
+	struct timespec ts = { 0, THREAD_READ_MICROS * 1000 };
+	nanosleep(&ts, NULL);
+	return read_block_device(address, data, len);
+}
+
+static uint8_t threadByte(uint32_t file, uint32_t pos) {
+	return (uint8_t)((pos * 13) + (pos >> 8) + file);
+}
+
+typedef struct {
+	norFAT_FS* fs;
+	uint32_t id;
+	uint64_t bytes;
+	int res;
+} threadJob;
+
+/* Keeps a stream open on every shared file, and reads them over and
+ * over in 4KB chunks, checking every byte */
+static void* readerThread(void* arg) {
+	threadJob* job = arg;
+	norfat_FILE* f[THREAD_FILES];
+	uint8_t chunk[4096];
+	char name[32];
+	uint32_t i, n, pos, file;
+	for (file = 0; file < THREAD_FILES; file++) {
+		snprintf(name, sizeof(name), "thread%i.bin", file);
+		f[file] = norfat_fopen(job->fs, name, "r");
+		if (f[file] == NULL) {
+			job->res = 1;
+		}
+	}
+	pthread_barrier_wait(&threadOpened);
+	file = job->id;
+	while (!threadStop && !job->res) {
+		file = (file + 1) % THREAD_FILES;
+		if (norfat_fseek(job->fs, f[file], 0, NORFAT_SEEK_SET)) {
+			job->res = 2;
+			break;
+		}
+		pos = 0;
+		while ((n = norfat_fread(job->fs, chunk, 1, sizeof(chunk), f[file])) > 0) {
+			for (i = 0; i < n; i++) {
+				if (chunk[i] != threadByte(file, pos + i)) {
+					job->res = 3;
+				}
+			}
+			pos += n;
+		}
+		if (pos != THREAD_FILE_SIZE) {
+			job->res = 4;
+		}
+		job->bytes += pos;
+	}
+	for (file = 0; file < THREAD_FILES; file++) {
+		if (f[file] != NULL && norfat_fclose(job->fs, f[file])) {
+			job->res = 5;
+		}
+	}
+	return NULL;
+}
+
+/* Keeps rewriting a file of its own, so commits, table swaps and
+ * collections land in between the reads */
+static void* writerThread(void* arg) {
+	threadJob* job = arg;
+	uint8_t data[1024];
+	uint32_t i;
+	struct timespec ts = { 0, 20000000 };
+	while (!threadStop && !job->res) {
+		for (i = 0; i < sizeof(data); i++) {
+			data[i] = (uint8_t)(i + job->bytes);
+		}
+		if (rewrite(job->fs, "threadw.bin", data, sizeof(data), 100) ||
+			readBack(job->fs, "threadw.bin", data, sizeof(data))) {
+			job->res = 6;
+		}
+		job->bytes++;
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+static double threadNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MB/s of readers run against one writer for 250ms, once their
+ * streams are open */
+static int threadRun(norFAT_FS* fs, uint32_t readers, double* rate) {
+	pthread_t threads[THREAD_MAX_READERS + 1];
+	threadJob jobs[THREAD_MAX_READERS + 1];
+	uint64_t bytes = 0;
+	double start;
+	uint32_t i;
+	int res = 0;
+	threadStop = 0;
+	pthread_barrier_init(&threadOpened, NULL, readers + 1);
+	for (i = 0; i <= readers; i++) {
+		jobs[i].fs = fs;
+		jobs[i].id = i;
+		jobs[i].bytes = 0;
+		jobs[i].res = 0;
+		pthread_create(&threads[i], NULL, i == readers ? writerThread : readerThread, &jobs[i]);
+	}
+	//Opening is not timed
+	pthread_barrier_wait(&threadOpened);
+	start = threadNow();
+	while (threadNow() - start < 0.25) {
+		struct timespec ts = { 0, 10000000 };
+		nanosleep(&ts, NULL);
+	}
+	threadStop = 1;
+	for (i = 0; i <= readers; i++) {
+		pthread_join(threads[i], NULL);
+		if (jobs[i].res) {
+			res = jobs[i].res;
+		}
+		if (i < readers) {
+			bytes += jobs[i].bytes;
+		}
+	}
+	*rate = bytes / ((threadNow() - start) * 1000000);
+	pthread_barrier_destroy(&threadOpened);
+	return res;
+}
+
+int threadTest(norFAT_FS* fs) {
+	uint8_t* data = malloc(THREAD_FILE_SIZE);
+	char* trace = traceBuffer;
+	char name[32];
+	double rwRate, mutexRate;
+	uint32_t i, j, readers;
+	int res = 0;
+	for (i = 0; i < THREAD_FILES && !res; i++) {
+		for (j = 0; j < THREAD_FILE_SIZE; j++) {
+			data[j] = threadByte(i, j);
+		}
+		snprintf(name, sizeof(name), "thread%i.bin", i);
+		res = rewrite(fs, name, data, THREAD_FILE_SIZE, 4096);
+	}
+	free(data);
+	if (res) {
+		return res;
+	}
+	//The trace handler is not thread safe
+	traceBuffer = NULL;
+	fs->read_block_device = slowRead;
+	for (readers = 1; readers <= THREAD_MAX_READERS && !res; readers *= 2) {
+		useRwLock(fs);
+		res = threadRun(fs, readers, &rwRate);
+		if (res) {
+			break;
+		}
+		useMutex(fs);
+		res = threadRun(fs, readers, &mutexRate);
+		printf("Readers %i: rwlock %6.1f MB/s, mutex %6.1f MB/s\r\n", readers, rwRate, mutexRate);
+	}
+	useRwLock(fs);
+	fs->read_block_device = read_block_device;
+	traceBuffer = trace;
+	for (i = 0; i < THREAD_FILES; i++) {
+		snprintf(name, sizeof(name), "thread%i.bin", i);
+		norfat_remove(fs, name);
+	}
+	norfat_remove(fs, "threadw.bin");
+	return res;
+}
+#else
+int threadTest(norFAT_FS* fs) {
+	return 0;
+}
+#endif
+
+/* Opens the stream pool dry, lookups must still work without one, and
+ * every slot has to be back once the streams are closed */
+int filePoolTest(norFAT_FS* fs) {
+#if NORFAT_MAX_OPEN_FILES
+	static norfat_FILE* f[NORFAT_MAX_OPEN_FILES];
+	uint8_t data[300];
+	uint8_t back[300];
+	uint32_t i;
+	int res = 0;
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	if (rewrite(fs, "pool.bin", data, sizeof(data), 100)) {
+		return 1;
+	}
+	for (i = 0; i < NORFAT_MAX_OPEN_FILES && !res; i++) {
+		f[i] = norfat_fopen(fs, "pool.bin", "r");
+		if (f[i] == NULL) {
+			res = 2;
+		}
+	}
+	if (!res && (norfat_fopen(fs, "pool.bin", "r") != NULL || fs->lastError != NORFAT_ERR_MALLOC)) {
+		res = 3;
+	}
+	if (!res && norfat_exists(fs, "pool.bin") != sizeof(data)) {
+		res = 4;
+	}
+	//Each stream has a header and position of its own
+	for (i = 0; i < NORFAT_MAX_OPEN_FILES && !res; i += 7) {
+		if (norfat_fseek(fs, f[i], i, NORFAT_SEEK_SET) ||
+			norfat_fread(fs, back, 1, sizeof(back), f[i]) != sizeof(data) - i ||
+			memcmp(back, &data[i], sizeof(data) - i) ||
+			strcmp(f[i]->fh->fileName, "pool.bin")) {
+			res = 5;
+		}
+	}
+	if (!res) {
+		norfat_fclose(fs, f[0]);
+		f[0] = norfat_fopen(fs, "pool.bin", "w");
+		if (f[0] == NULL || norfat_fwrite(fs, data, 1, 10, f[0]) != 10) {
+			res = 6;
+		}
+	}
+	//The readers go before the writer replaces their file
+	for (i = NORFAT_MAX_OPEN_FILES; i-- > 0; ) {
+		if (f[i] != NULL && norfat_fclose(fs, f[i]) && !res) {
+			res = 7;
+		}
+		f[i] = NULL;
+	}
+	if (!res && fs->fileFreeCount != NORFAT_MAX_OPEN_FILES) {
+		res = 8;
+	}
+	if (!res && norfat_exists(fs, "pool.bin") != 10) {
+		res = 9;
+	}
+	norfat_remove(fs, "pool.bin");
+	if (res) {
+		return res;
+	}
+	printf("File pool test passed\r\n");
+#endif
+	return 0;
+}
+
+int fatCacheTest(norFAT_FS* fs) {
+#if NORFAT_FAT_CACHE_PAGES
+	int res;
+	uint32_t i, hits, misses;
+	uint8_t name[32];
+	uint8_t data[NORFAT_PACK_THRESHOLD + 40];
+	uint8_t back[sizeof(data)];
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	//A batch dirties more pages than the cache holds, the overflow
+	//spills to flash and must not survive a power loss
+	norfat_begin(fs);
+	for (i = 0; i < 40; i++) {
+		sprintf(name, "page%i.bin", i);
+		memset(data, i, sizeof(data));
+		if (rewrite(fs, name, data, sizeof(data), sizeof(data))) {
+			return 1;
+		}
+	}
+	res = norfat_mount(fs);
+	if (res) {
+		return 2;
+	}
+	for (i = 0; i < 40; i++) {
+		sprintf(name, "page%i.bin", i);
+		if (norfat_exists(fs, name)) {
+			printf("File %s exists without commit\r\n", name);
+			return 3;
+		}
+	}
+	norfat_begin(fs);
+	for (i = 0; i < 40; i++) {
+		sprintf(name, "page%i.bin", i);
+		memset(data, i, sizeof(data));
+		if (rewrite(fs, name, data, sizeof(data), sizeof(data))) {
+			return 4;
+		}
+	}
+	//Half the entry pages of the jig table
+	if (NORFAT_FAT_CACHE_PAGES < NORFAT_SECTORS * sizeof(_sector) / 256 / 2 && fs->cacheSpills == 0) {
+		printf("Batch never spilled\r\n");
+		return 5;
+	}
+	res = norfat_commit(fs);
+	if (res) {
+		return res;
+	}
+	//Reads after a remount come through the cache
+	res = norfat_mount(fs);
+	hits = fs->cacheHits;
+	misses = fs->cacheMisses;
+	for (i = 0; i < 40 && !res; i++) {
+		norfat_FILE* f;
+		sprintf(name, "page%i.bin", i);
+		memset(data, i, sizeof(data));
+		f = norfat_fopen(fs, name, "r");
+		if (f == NULL || norfat_fread(fs, back, 1, sizeof(back), f) != sizeof(back) ||
+			memcmp(data, back, sizeof(data))) {
+			printf("File %s lost after commit\r\n", name);
+			res = 6;
+		}
+		norfat_fclose(fs, f);
+	}
+	if (res) {
+		return res;
+	}
+	hits = fs->cacheHits - hits;
+	misses = fs->cacheMisses - misses;
+	if (misses == 0) {
+		return 7;
+	}
+	for (i = 0; i < 40; i++) {
+		sprintf(name, "page%i.bin", i);
+		norfat_remove(fs, name);
+	}
+	printf("FAT cache test passed, %i of %i bytes in RAM, hit rate %i%%\r\n",
+		(int)NORFAT_FAT_CACHE_BYTES(fs->programSize), NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS,
+		(int)(hits * 100 / (hits + misses)));
+#endif
+	return 0;
+}
+
+/* norfat_get_stats against what the flash model saw */
+int statsTest(norFAT_FS* fs) {
+#if NORFAT_STATS
+	int res;
+	int32_t ret;
+	uint32_t i, len, erases, programs, reads;
+	uint8_t data[1000];
+	norfat_stats before, after;
+	norfat_FILE* f;
+	res = norfat_mount(fs);
+	if (res) {
+		return res;
+	}
+	for (i = 0, erases = 0; i < NORFAT_SECTORS; i++) {
+		erases += EraseCounts[i];
+	}
+	programs = ProgramCount;
+	reads = ReadCount;
+	norfat_get_stats(fs, &before);
+	f = norfat_fopen(fs, "stats.bin", "w");
+	if (f == NULL) {
+		return 1;
+	}
+	for (len = 0; len < 3 * NORFAT_SECTOR_SIZE; len += sizeof(data)) {
+		memset(data, len, sizeof(data));
+		if (norfat_fwrite(fs, data, 1, sizeof(data), f) != sizeof(data)) {
+			norfat_fclose(fs, f);
+			return 2;
+		}
+	}
+	if (norfat_fclose(fs, f) || norfat_exists(fs, "stats.bin") != len || norfat_remove(fs, "stats.bin")) {
+		return 3;
+	}
+	norfat_get_stats(fs, &after);
+	for (erases = -erases, i = 0; i < NORFAT_SECTORS; i++) {
+		erases += EraseCounts[i];
+	}
+	if (after.total.programs - before.total.programs != ProgramCount - programs ||
+		after.total.reads - before.total.reads != ReadCount - reads ||
+		after.total.erases - before.total.erases != erases) {
+		printf("Stats %i programs %i reads %i erases, flash saw %i %i %i\r\n",
+			after.total.programs - before.total.programs, after.total.reads - before.total.reads,
+			after.total.erases - before.total.erases, ProgramCount - programs, ReadCount - reads, erases);
+		return 4;
+	}
+	//The data reaches flash from fwrite, or fclose for the last page
+	if (after.userBytes - before.userBytes != len ||
+		after.api[NORFAT_API_FWRITE].programBytes + after.api[NORFAT_API_FCLOSE].programBytes -
+		before.api[NORFAT_API_FWRITE].programBytes - before.api[NORFAT_API_FCLOSE].programBytes < len) {
+		return 5;
+	}
+	//Removing commits the table
+	if (after.api[NORFAT_API_REMOVE].programs == before.api[NORFAT_API_REMOVE].programs ||
+		after.commits == before.commits || after.headerReads == before.headerReads ||
+		after.writeAmplification < 100) {
+		return 6;
+	}
+	printf("Stats: write amplification %i%%, %i commits, %i swaps, %i collections freed %i sectors, %i header reads\r\n",
+		after.writeAmplification, after.commits, after.swaps,
+		after.gcRuns, after.sectorsCollected, after.headerReads);
+	//fwrite returns bytes whatever the item size, and the write that finds the volume full adds none
+	norfat_get_stats(fs, &before);
+	f = norfat_fopen(fs, "stats.bin", "w");
+	if (f == NULL) {
+		return 7;
+	}
+	for (len = 0; (ret = (int32_t)norfat_fwrite(fs, data, 4, sizeof(data) / 4, f)) == sizeof(data); len += ret) {
+	}
+	norfat_fclose(fs, f);
+	norfat_get_stats(fs, &after);
+	if (ret != NORFAT_ERR_FULL || len < NORFAT_SECTOR_SIZE || after.userBytes - before.userBytes != len) {
+		printf("Stats full write returned %i, %i bytes written, userBytes %i\r\n",
+			ret, len, (int)(after.userBytes - before.userBytes));
+		return 7;
+	}
+#endif
+	return 0;
+}
+
+/* CPU cycles per byte of norfat_fwrite and norfat_fread in small and
+ * sector sized chunks, flash driver included. Build with and without the
+ * NORFAT_STATIC_ geometry to compare */
+static uint64_t cycleCount(void) {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return (uint64_t)clock() * (1000000000ULL / CLOCKS_PER_SEC);//ns
+#endif
+}
+
+int benchmarkTest(norFAT_FS* fs) {
+	static const uint32_t chunks[] = { 64, NORFAT_SECTOR_SIZE };
+	uint32_t len = 64 * NORFAT_SECTOR_SIZE;
+	uint32_t i, c, pos;
+	uint64_t start, writeCycles, readCycles;
+	uint8_t* data = malloc(len);
+	uint8_t* back = malloc(len);
+	norfat_FILE* f;
+	int res = 0;
+	assert(data);
+	assert(back);
+	for (i = 0; i < len; i++) {
+		data[i] = (uint8_t)getRand();
+	}
+	res = norfat_format(fs);
+	res = norfat_mount(fs);
+	for (c = 0; c < sizeof(chunks) / sizeof(chunks[0]) && !res; c++) {
+		f = norfat_fopen(fs, "bench.bin", "w");
+		if (f == NULL) {
+			res = 1;
+			break;
+		}
+		start = cycleCount();
+		for (pos = 0; pos < len; pos += chunks[c]) {
+			norfat_fwrite(fs, &data[pos], 1, chunks[c], f);
+		}
+		writeCycles = cycleCount() - start;
+		if (norfat_fclose(fs, f)) {
+			res = 2;
+			break;
+		}
+		f = norfat_fopen(fs, "bench.bin", "r");
+		if (f == NULL) {
+			res = 3;
+			break;
+		}
+		start = cycleCount();
+		for (pos = 0; pos < len; pos += chunks[c]) {
+			if (norfat_fread(fs, &back[pos], 1, chunks[c], f) != chunks[c]) {
+				res = 4;
+			}
+		}
+		readCycles = cycleCount() - start;
+		norfat_fclose(fs, f);
+		if (!res && memcmp(data, back, len)) {
+			res = 5;
+		}
+		printf("Benchmark %4i byte chunks: fwrite %6.2f, fread %6.2f cycles/byte\r\n", chunks[c],
+			(double)writeCycles / len, (double)readCycles / len);
+	}
+	norfat_remove(fs, "bench.bin");
+	free(data);
+	free(back);
+	if (res) {
+		return res;
+	}
+	printf("Benchmark test passed, %s geometry\r\n", NORFAT_STATIC_SECTOR_SIZE ? "static" : "runtime");
+	return 0;
+}
+
+int runTestSuite(norFAT_FS* fs) {
+	int res = 0;
+	res = PowerStressTest(fs);
+	if (res) {
+		printf("Power cycle stress test failed err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	res = deleteTest(fs);
+	if (res) {
+		printf("Delete test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	res = deltaCommitTest(fs);
+	if (res) {
+		printf("Delta commit test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	res = batchCommitTest(fs);
+	if (res) {
+		printf("Batch commit test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	res = unmountTest(fs);
+	if (res) {
+		printf("Unmount test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = indexTest(fs);
+	if (res) {
+		printf("Index test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = preEraseTest(fs);
+	if (res) {
+		printf("Pre-erase test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = gcTest(fs);
+	if (res) {
+		printf("GC test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = smallWriteTest(fs);
+	if (res) {
+		printf("Small write test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = seekTest(fs);
+	if (res) {
+		printf("Seek test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = zeroCopyTest(fs);
+	if (res) {
+		printf("Zero copy test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = appendTest(fs);
+	if (res) {
+		printf("Append test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = elideTest(fs);
+	if (res) {
+		printf("Elide test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = packTest(fs);
+	if (res) {
+		printf("Pack test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = streamBufferTest(fs);
+	if (res) {
+		printf("Stream buffer test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = asyncTest(fs);
+	if (res) {
+		printf("Async program test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = threadTest(fs);
+	if (res) {
+		printf("Thread test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = filePoolTest(fs);
+	if (res) {
+		printf("File pool test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = benchmarkTest(fs);
+	if (res) {
+		printf("Benchmark test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = fatCacheTest(fs);
+	if (res) {
+		printf("FAT cache test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = statsTest(fs);
+	if (res) {
+		printf("Stats test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = fillupTest(fs);
+	if (res) {
+		printf("Fill up test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	res = randomWriteLengths(fs);
+	if (res) {
+		printf("Random write length test err %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	res = wearLeveling(fs);
+	if (res) {
+		printf("Wear leveling test failed %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+
+	res = PowerFailOnWriteTest(fs);
+	if (res) {
+		printf("Half write test failed %i\r\n", res);
+		writeTraceToFile();
+		return res;
+	}
+	printf("Passed all tests\r\n");
+	return res;
+}
+
+int main(int argv, char** argc) {
+
+	norFAT_FS fs1 = {
+		.addressStart = 0,
+		.tableCount = NORFAT_TABLE_COUNT + 4,//FAT tables carved out of flash sectors
+		.tableSectors = NORFAT_TABLE_SECTORS,
+		.flashSectors = NORFAT_SECTORS,
+		.sectorSize = NORFAT_SECTOR_SIZE,
+		.programSize = 256,
+		.erase_block_sector = erase_block_sector,
+		.program_block_page = program_block_page,
+		.read_block_device = read_block_device,
+		.mapBase = block
+	};
+
+	norFAT_FS fs2 = {
+	.addressStart = 0,
+	.tableCount = NORFAT_TABLE_COUNT,//FAT tables carved out of flash sectors
+	.tableSectors = NORFAT_TABLE_SECTORS,
+	.flashSectors = NORFAT_SECTORS,
+	.sectorSize = NORFAT_SECTOR_SIZE,
+	.programSize = 256,
+	.erase_block_sector = erase_block_sector,
+	.program_block_page = program_block_page,
+	.read_block_device = read_block_device
+	};
+
+	printf("norFAT test jig 1.00, norFAT Version %s\r\n", NORFAT_VERSION);
+	if (argv > 1) {
+		POWER_CYCLE_COUNT = strtol(argc[1], NULL, 10);
+		printf("Testing cycles set to %i\r\n", POWER_CYCLE_COUNT);
+	}
+	if (crcBenchmark()) {
+		return 1;
+	}
+	if (kernelBenchmark()) {
+		return 1;
+	}
+#if NORFAT_STREAM_BUFFER
+	//fs2 takes every stream buffer from the heap
+	fs1.streamPool = malloc(4 * NORFAT_STREAM_BUFFER);
+	fs1.streamBuffers = 4;
+#endif
+#if NORFAT_ASYNC_PROGRAM
+	//fs2 runs every test with programs from norfat_fwrite in flight
+	fs2.program_page_submit = program_page_submit;
+	fs2.program_poll = program_poll;
+#endif
+#if NORFAT_THREAD_SAFE && defined(__linux__)
+	useRwLock(&fs1);
+	useRwLock(&fs2);
+#endif
+	memset(block, 0xFF, BLOCK_SIZE);
+	fs1.buff = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
+	fs2.buff = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
+#if NORFAT_FAT_CACHE_PAGES
+	fs1.fat = malloc(NORFAT_FAT_CACHE_BYTES(256));
+	fs2.fat = malloc(NORFAT_FAT_CACHE_BYTES(256));
+#else
+	fs1.fat = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
+	fs2.fat = malloc(NORFAT_SECTOR_SIZE * NORFAT_TABLE_SECTORS);
+#endif
 	traceBuffer = malloc(TRACE_BUFFER_SIZE);
 	//traceFile = fopen("norfat_trace.txt", "wb");
 	int32_t res = norfat_mount(&fs1);
@@ -1,9 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <time.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include "norFAT.h"
+#include "norFATkernel.h"
 
 #define NORFAT_FILE_NOT_FOUND (-1)
 #define NORFAT_INVALID_SECTOR (0xFFFFFFFF)
@@ -11,13 +16,32 @@
 #define NORFAT_FLAG_READ		1
 #define NORFAT_FLAG_WRITE		2
 #define NORFAT_FLAG_ZERO_COPY	4 //Not implemented for writes
+#define NORFAT_FLAG_APPEND		8
+
+#if NORFAT_ENTRY_BITS == 16
+#define NORFAT_SOF_MSK      (0xF000)
+#define NORFAT_SOF_MATCH    (0x3000)
+#define NORFAT_EOF			(0x0FFF)
+/* Allocated, erased and unlinked, same as a file start before its first write */
+#define NORFAT_PREERASED    (0xBFFF)
 
-#define NORFAT_SOF_MSK      (0x70000000)
+#define NORFAT_EMPTY_MASK   (0xFFFF)
+#define NORFAT_GARBAGE_MASK (0x0000)
+#else
+#define NORFAT_SOF_MSK      (0xF0000000)
 #define NORFAT_SOF_MATCH    (0x30000000)
 #define NORFAT_EOF			(0x0FFFFFFF)
+/* Allocated, erased and unlinked, same as a file start before its first write */
+#define NORFAT_PREERASED    (0xBFFFFFFF)
 
 #define NORFAT_EMPTY_MASK   (0xFFFFFFFF)
 #define NORFAT_GARBAGE_MASK (0x00000000)
+#endif
+
+/* State bits of an entry, above next */
+#define NORFAT_ENTRY_ACTIVE    (NORFAT_EOF + 1)
+#define NORFAT_ENTRY_AVAILABLE (NORFAT_ENTRY_ACTIVE << 2)
+#define NORFAT_ENTRY_WRITE     (NORFAT_ENTRY_ACTIVE << 3)
 
 #define NORFAT_TABLE_GOOD	0
 #define NORFAT_TABLE_OLD	1
@@ -26,25 +50,117 @@
 
 #define NORFAT_TABLE_BYTES(sectors) (sizeof(_FAT) + (sizeof(_sector) * sectors))
 
+/* Geometry, as constants when a NORFAT_STATIC_ profile is set so the
+ * compiler turns the divisions into shifts and masks */
+#if NORFAT_STATIC_SECTOR_SIZE
+#define SECTOR_SIZE(fs) ((uint32_t)NORFAT_STATIC_SECTOR_SIZE)
+#else
+#define SECTOR_SIZE(fs) ((fs)->sectorSize)
+#endif
+#if NORFAT_STATIC_PROGRAM_SIZE
+#define PROGRAM_SIZE(fs) ((uint32_t)NORFAT_STATIC_PROGRAM_SIZE)
+#else
+#define PROGRAM_SIZE(fs) ((fs)->programSize)
+#endif
+#if NORFAT_STATIC_TABLE_SECTORS
+#define TABLE_SECTORS(fs) ((uint32_t)NORFAT_STATIC_TABLE_SECTORS)
+#else
+#define TABLE_SECTORS(fs) ((fs)->tableSectors)
+#endif
+#if NORFAT_STATIC_TABLE_COUNT
+#define TABLE_COUNT(fs) ((uint32_t)NORFAT_STATIC_TABLE_COUNT)
+#else
+#define TABLE_COUNT(fs) ((fs)->tableCount)
+#endif
+
 static int32_t commitChanges(norFAT_FS* fs, uint32_t forceSwap);
+static int32_t beginSwap(norFAT_FS* fs);
+static int32_t finishSwap(norFAT_FS* fs);
+static int fcloseUnlocked(norFAT_FS* fs, norfat_FILE* stream);
+static size_t fwriteUnlocked(norFAT_FS* fs, const void* ptr, size_t size, size_t count, norfat_FILE* stream);
+static size_t freadUnlocked(norFAT_FS* fs, void* ptr, size_t size, size_t count, norfat_FILE* stream);
+
+/* Driver calls, counted against the public call in progress with NORFAT_STATS */
+#if NORFAT_STATS
+#define STATS_ADD(fs, field, n) ((fs)->stats.field += (n))
+#define STATS_API(fs, id) ((fs)->statsApi = (id))
+
+static uint32_t readBlock(norFAT_FS* fs, uint32_t address, uint8_t* data, uint32_t len) {
+	fs->stats.api[fs->statsApi].reads++;
+	fs->stats.api[fs->statsApi].readBytes += len;
+	return fs->read_block_device(address, data, len);
+}
+
+static uint32_t programBlock(norFAT_FS* fs, uint32_t address, uint8_t* data, uint32_t length) {
+	fs->stats.api[fs->statsApi].programs++;
+	fs->stats.api[fs->statsApi].programBytes += length;
+	return fs->program_block_page(address, data, length);
+}
+
+static uint32_t eraseBlock(norFAT_FS* fs, uint32_t address) {
+	fs->stats.api[fs->statsApi].erases++;
+	return fs->erase_block_sector(address);
+}
+
+#if NORFAT_ASYNC_PROGRAM
+static uint32_t submitBlock(norFAT_FS* fs, uint32_t address, uint8_t* data, uint32_t length) {
+	fs->stats.api[fs->statsApi].programs++;
+	fs->stats.api[fs->statsApi].programBytes += length;
+	return fs->program_page_submit(address, data, length);
+}
+#endif
+#else
+#define STATS_ADD(fs, field, n)
+#define STATS_API(fs, id)
+#define readBlock(fs, address, data, len) (fs)->read_block_device(address, data, len)
+#define programBlock(fs, address, data, length) (fs)->program_block_page(address, data, length)
+#define eraseBlock(fs, address) (fs)->erase_block_sector(address)
+#define submitBlock(fs, address, data, length) (fs)->program_page_submit(address, data, length)
+#endif
+
+#define CRC32_POLY 0x04c11db7     /* AUTODIN II, Ethernet, & FDDI 0x04C11DB7 */
 
 #ifndef NORFAT_CRC
-/* crc routines written by unknown public source */
-static uint32_t crc32_table[256];
+/* crc routines written by unknown public source, extended to slice-by-N
+ * tables (N bytes per step), still the same polynomial and seed */
+#ifndef NORFAT_CRC_SLICES
+#define NORFAT_CRC_SLICES 1
+#endif
+#if NORFAT_CRC_SLICES != 1 && NORFAT_CRC_SLICES != 4 && NORFAT_CRC_SLICES != 8 && NORFAT_CRC_SLICES != 16
+#error NORFAT_CRC_SLICES must be 1, 4, 8 or 16
+#endif
+static uint32_t crc32_table[NORFAT_CRC_SLICES][256];
 void init_crc32(void);
 static uint32_t crc32(void* buf, int len, uint32_t Seed);
 
-#define CRC32_POLY 0x04c11db7     /* AUTODIN II, Ethernet, & FDDI 0x04C11DB7 */
 #define NORFAT_CRC crc32
 
 uint32_t crc32(void* buf, int len, uint32_t Seed) {
-	NORFAT_TRACE(("CRC:0x%X|%i|0x%X\r\n", (uint32_t)buf, len, Seed));
-	unsigned char* p;
+	unsigned char* p = buf;
 	uint32_t crc = Seed;
-	if (!crc32_table[1]) /* if not already done, */
+	if (!crc32_table[0][1]) /* if not already done, */
 		init_crc32(); /* build table */
-	for (p = buf; len > 0; ++p, --len)
-		crc = (crc << 8) ^ crc32_table[(crc >> 24) ^ *p];
+#if NORFAT_CRC_SLICES > 1
+	/* Fold the crc into the first word, then look up every byte of the
+	 * block in the table that already accounts for the bytes behind it */
+	for (; len >= NORFAT_CRC_SLICES; p += NORFAT_CRC_SLICES, len -= NORFAT_CRC_SLICES) {
+		uint32_t k, w, r = 0;
+		for (k = 0; k < NORFAT_CRC_SLICES; k += 4) {
+			w = ((uint32_t)p[k] << 24) | ((uint32_t)p[k + 1] << 16) |
+				((uint32_t)p[k + 2] << 8) | p[k + 3];
+			if (k == 0) {
+				w ^= crc;
+			}
+			r ^= crc32_table[NORFAT_CRC_SLICES - 1 - k][w >> 24] ^
+				crc32_table[NORFAT_CRC_SLICES - 2 - k][(w >> 16) & 0xFF] ^
+				crc32_table[NORFAT_CRC_SLICES - 3 - k][(w >> 8) & 0xFF] ^
+				crc32_table[NORFAT_CRC_SLICES - 4 - k][w & 0xFF];
+		}
+		crc = r;
+	}
+#endif
+	for (; len > 0; ++p, --len)
+		crc = (crc << 8) ^ crc32_table[0][(crc >> 24) ^ *p];
 	return crc; /* transmit complement, per CRC-32 spec */
 }
 
@@ -54,11 +170,420 @@ void init_crc32(void) {
 	for (i = 0; i < 256; ++i) {
 		for (c = i << 24, j = 8; j > 0; --j)
 			c = c & 0x80000000 ? (c << 1) ^ CRC32_POLY : (c << 1);
-		crc32_table[i] = c;
+		crc32_table[0][i] = c;
+	}
+	/* table[k] is table[0] followed by k zero bytes */
+	for (j = 1; j < NORFAT_CRC_SLICES; j++) {
+		for (i = 0; i < 256; ++i) {
+			c = crc32_table[j - 1][i];
+			crc32_table[j][i] = (c << 8) ^ crc32_table[0][c >> 24];
+		}
+	}
+}
+
+#endif
+
+static void markPage(norFAT_FS* fs, uint32_t page) {
+	fs->dirtyPages[page / 32] |= (1UL << (page % 32));
+#if NORFAT_INCREMENTAL_CRC
+	fs->crcStale[page / 32] |= (1UL << (page % 32));
+#endif
+}
+
+static void markDirty(norFAT_FS* fs, const void* ptr, uint32_t len) {
+	uint32_t offset = (uint32_t)((const uint8_t*)ptr - (const uint8_t*)fs->fat);
+	uint32_t page = offset / PROGRAM_SIZE(fs);
+	uint32_t last = (offset + len - 1) / PROGRAM_SIZE(fs);
+	for (; page <= last; page++) {
+		markPage(fs, page);
+	}
+}
+
+static uint32_t isDirty(norFAT_FS* fs, uint32_t page) {
+	return (fs->dirtyPages[page / 32] >> (page % 32)) & 1;
+}
+
+static void clearDirty(norFAT_FS* fs) {
+	memset(fs->dirtyPages, 0, sizeof(fs->dirtyPages));
+#if NORFAT_FAT_CACHE_PAGES
+	//Whatever was programmed ahead is part of the table now
+	memset(fs->spilled, 0, sizeof(fs->spilled));
+#endif
+}
+
+static uint32_t anyDirty(norFAT_FS* fs) {
+	uint32_t i;
+	for (i = 0; i < (NORFAT_MAX_TABLE_PAGES + 31) / 32; i++) {
+		if (fs->dirtyPages[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Programmed pages of a table, the rest of it stays blank */
+static uint32_t tablePages(norFAT_FS* fs) {
+	return (NORFAT_TABLE_BYTES(fs->flashSectors) + PROGRAM_SIZE(fs) - 1) / PROGRAM_SIZE(fs);
+}
+
+#if NORFAT_FAT_CACHE_PAGES
+#define NORFAT_INVALID_PAGE (0xFFFFFFFF)
+
+static int32_t finishSwapInPlace(norFAT_FS* fs);
+
+/* Pages holding the table header, these stay in fs->fat */
+static uint32_t headerPages(norFAT_FS* fs) {
+	return (sizeof(_FAT) + PROGRAM_SIZE(fs) - 1) / PROGRAM_SIZE(fs);
+}
+
+static uint8_t* cacheSlot(norFAT_FS* fs, uint32_t slot) {
+	return (uint8_t*)fs->fat + ((headerPages(fs) + slot) * PROGRAM_SIZE(fs));
+}
+
+static uint32_t isSpilled(norFAT_FS* fs, uint32_t page) {
+	return (fs->spilled[page / 32] >> (page % 32)) & 1;
+}
+
+static void invalidateCache(norFAT_FS* fs) {
+	uint32_t i;
+	for (i = 0; i < NORFAT_FAT_CACHE_PAGES; i++) {
+		fs->cachePage[i] = NORFAT_INVALID_PAGE;
+		fs->cacheUsed[i] = 0;
+	}
+	memset(fs->spilled, 0, sizeof(fs->spilled));
+	fs->sweepPending = 0;
+	fs->cacheFault = 0;
+}
+
+static int32_t readTablePage(norFAT_FS* fs, uint32_t tableIndex, uint32_t page, uint8_t* data) {
+	if (readBlock(fs, fs->addressStart +
+		((tableIndex % TABLE_COUNT(fs)) * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))) + (page * PROGRAM_SIZE(fs)),
+		data, PROGRAM_SIZE(fs))) {
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+
+static int32_t programTablePage(norFAT_FS* fs, uint32_t tableIndex, uint32_t page, uint8_t* data) {
+	if (programBlock(fs, fs->addressStart +
+		((tableIndex % TABLE_COUNT(fs)) * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))) + (page * PROGRAM_SIZE(fs)),
+		data, PROGRAM_SIZE(fs))) {
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+
+/* Frees the deleted sectors of one page, what sweepGarbage does to the
+ * whole table. Returns the number freed */
+static uint32_t sweepPage(norFAT_FS* fs, uint32_t page, uint8_t* data) {
+	uint32_t i, offset, sector;
+	uint32_t collected = 0;
+	_sector* entry = (_sector*)data;
+	for (i = 0; i < PROGRAM_SIZE(fs) / sizeof(_sector); i++) {
+		offset = (page * PROGRAM_SIZE(fs)) + (i * sizeof(_sector));
+		if (offset < sizeof(_FAT)) {
+			continue;
+		}
+		sector = (offset - sizeof(_FAT)) / sizeof(_sector);
+		if (sector >= (TABLE_COUNT(fs) * TABLE_SECTORS(fs)) && sector < fs->flashSectors &&
+			!entry[i].active) {
+			entry[i].base |= NORFAT_EMPTY_MASK;
+			collected++;
+		}
+	}
+	return collected;
+}
+
+/* The page in RAM if it is there, without loading it */
+static uint8_t* cachedPage(norFAT_FS* fs, uint32_t page) {
+	uint32_t i;
+	if (page < headerPages(fs)) {
+		return (uint8_t*)fs->fat + (page * PROGRAM_SIZE(fs));
+	}
+	for (i = 0; i < NORFAT_FAT_CACHE_PAGES; i++) {
+		if (fs->cachePage[i] == page) {
+			return cacheSlot(fs, i);
+		}
+	}
+	return NULL;
+}
+
+/* A table page in RAM. Clean pages make room least recently used first.
+ * Dirty ones wait for the commit, or when every slot is dirty the oldest
+ * is programmed to spillTable ahead of it: the first table of the active
+ * pair, or the new first table while a swap has yet to program it. Only
+ * 1 -> 0 changes reach a table that way, sweeps and repairs start a swap
+ * first, and power loss before the commit leaves a table mount recovers
+ * from like one lost in the middle of a commit. When that program fails
+ * the dirty page stays and the page is read into the spare slot past the
+ * cache, where lookups still see flash but changes are lost. lastError
+ * holds off commits from then on, and cacheFault has broken chains read
+ * as NORFAT_ERR_IO until the next mount.
+ */
+static uint8_t* tablePage(norFAT_FS* fs, uint32_t page) {
+	uint32_t i, clean;
+	uint32_t victim = NORFAT_INVALID_PAGE;
+	uint32_t spill = NORFAT_INVALID_PAGE;
+	uint8_t* data;
+	if (page < headerPages(fs)) {
+		return (uint8_t*)fs->fat + (page * PROGRAM_SIZE(fs));
+	}
+	for (i = 0; i < NORFAT_FAT_CACHE_PAGES; i++) {
+		if (fs->cachePage[i] == page) {
+			fs->cacheUsed[i] = ++fs->cacheTick;
+			fs->cacheHits++;
+			return cacheSlot(fs, i);
+		}
+		clean = fs->cachePage[i] == NORFAT_INVALID_PAGE || !isDirty(fs, fs->cachePage[i]);
+		if (clean && (victim == NORFAT_INVALID_PAGE || fs->cacheUsed[i] < fs->cacheUsed[victim])) {
+			victim = i;
+		}
+		if (!clean && (spill == NORFAT_INVALID_PAGE || fs->cacheUsed[i] < fs->cacheUsed[spill])) {
+			spill = i;
+		}
+	}
+	fs->cacheMisses++;
+	if (victim == NORFAT_INVALID_PAGE) {
+		victim = spill;
+		//The new pair has to match before its first table changes again
+		if (fs->swapPending && fs->swapStep > TABLE_SECTORS(fs) && finishSwapInPlace(fs)) {
+			victim = NORFAT_FAT_CACHE_PAGES;
+		}
+		else {
+			NORFAT_TRACE(("tablePage:spill %i -> %i\r\n", fs->cachePage[victim], fs->spillTable));
+			if (programTablePage(fs, fs->spillTable, fs->cachePage[victim], cacheSlot(fs, victim))) {
+				victim = NORFAT_FAT_CACHE_PAGES;
+			}
+			else {
+				fs->spilled[fs->cachePage[victim] / 32] |= 1UL << (fs->cachePage[victim] % 32);
+				fs->cacheSpills++;
+			}
+		}
+	}
+	if (victim < NORFAT_FAT_CACHE_PAGES) {
+		fs->cachePage[victim] = NORFAT_INVALID_PAGE;
+	}
+	data = cacheSlot(fs, victim);
+	if (readTablePage(fs, isSpilled(fs, page) ? fs->spillTable : fs->cacheTable, page, data)) {
+		memset(data, 0, PROGRAM_SIZE(fs));
+		victim = NORFAT_FAT_CACHE_PAGES;
+	}
+	//Pages programmed ahead were swept before they left
+	else if (fs->sweepPending && !isSpilled(fs, page)) {
+		sweepPage(fs, page, data);
+	}
+	if (victim < NORFAT_FAT_CACHE_PAGES) {
+		fs->cachePage[victim] = page;
+		fs->cacheUsed[victim] = ++fs->cacheTick;
+	}
+	else {
+		fs->cacheFault = 1;
+	}
+	return data;
+}
+#endif
+
+#if NORFAT_FAT_CACHE_PAGES && NORFAT_THREAD_SAFE
+/* Readers sharing the fs lock load pages too, the cache lock keeps them
+ * apart. entryRun and writeSector run under the exclusive side only */
+static void lockCache(norFAT_FS* fs) {
+	if (fs->lock_cache) {
+		fs->lock_cache(fs->cacheLockContext);
+	}
+}
+
+static void unlockCache(norFAT_FS* fs) {
+	if (fs->unlock_cache) {
+		fs->unlock_cache(fs->cacheLockContext);
+	}
+}
+#else
+#define lockCache(fs)
+#define unlockCache(fs)
+#endif
+
+/* Table entry of sector i, by value since a cached page may move on the next lookup */
+static _sector readSector(norFAT_FS* fs, uint32_t i) {
+#if NORFAT_FAT_CACHE_PAGES
+	uint32_t offset = sizeof(_FAT) + (i * sizeof(_sector));
+	_sector entry;
+	lockCache(fs);
+	entry = *(_sector*)(tablePage(fs, offset / PROGRAM_SIZE(fs)) + (offset % PROGRAM_SIZE(fs)));
+	unlockCache(fs);
+	return entry;
+#else
+	return fs->fat->sector[i];
+#endif
+}
+
+/* All changes to the working table go through here so commits know what to program */
+static _sector* writeSector(norFAT_FS* fs, uint32_t i) {
+#if NORFAT_FAT_CACHE_PAGES
+	uint32_t offset = sizeof(_FAT) + (i * sizeof(_sector));
+	_sector* entry = (_sector*)(tablePage(fs, offset / PROGRAM_SIZE(fs)) + (offset % PROGRAM_SIZE(fs)));
+	markPage(fs, offset / PROGRAM_SIZE(fs));
+	return entry;
+#else
+	markDirty(fs, &fs->fat->sector[i], sizeof(_sector));
+	return &fs->fat->sector[i];
+#endif
+}
+
+/* Entries from sector i on that sit together in RAM, at most to - i.
+ * A cached page is only good until the next lookup */
+static const _sector* entryRun(norFAT_FS* fs, uint32_t i, uint32_t to, uint32_t* count) {
+#if NORFAT_FAT_CACHE_PAGES
+	uint32_t offset = sizeof(_FAT) + (i * sizeof(_sector));
+	*count = (PROGRAM_SIZE(fs) - (offset % PROGRAM_SIZE(fs))) / sizeof(_sector);
+	if (*count > to - i) {
+		*count = to - i;
+	}
+	return (const _sector*)(tablePage(fs, offset / PROGRAM_SIZE(fs)) + (offset % PROGRAM_SIZE(fs)));
+#else
+	*count = to - i;
+	return &fs->fat->sector[i];
+#endif
+}
+
+/* First sector in [from, to) with (base & mask) == match, to if none */
+static uint32_t findEntry(norFAT_FS* fs, uint32_t from, uint32_t to, uint32_t mask, uint32_t match) {
+	uint32_t count, k;
+	const _sector* run;
+	while (from < to) {
+		run = entryRun(fs, from, to, &count);
+		k = norfat_k_find(run, count, mask, match);
+		if (k < count) {
+			return from + k;
+		}
+		from += count;
+	}
+	return to;
+}
+
+/* Number of sectors in [from, to) with (base & mask) == match, setting
+ * their bits in map when it is given */
+static uint32_t countEntries(norFAT_FS* fs, uint32_t from, uint32_t to, uint32_t mask, uint32_t match,
+	uint32_t* map) {
+	uint32_t count;
+	uint32_t n = 0;
+	const _sector* run;
+	while (from < to) {
+		run = entryRun(fs, from, to, &count);
+		n += norfat_k_match(run, count, mask, match, map, from);
+		from += count;
+	}
+	return n;
+}
+
+/* A broken chain is corruption, unless a failed spill lost table changes first */
+static int32_t chainError(norFAT_FS* fs) {
+#if NORFAT_FAT_CACHE_PAGES
+	if (fs->cacheFault) {
+		return NORFAT_ERR_IO;
+	}
+#endif
+	return NORFAT_ERR_CORRUPT;
+}
+
+#if NORFAT_INCREMENTAL_CRC
+/* The table crc is linear, crc(seed, M) = seed * x^8len + M * x^32 (mod P).
+ * So each programSize page keeps its own seedless crc, and the table crc is
+ * rebuilt by shifting every page crc past the bytes behind it. A commit only
+ * rehashes the pages it touched, plus the partial page where the crc starts.
+ * Same result as hashing the whole range, so the on flash format is unchanged.
+ */
+static uint32_t crcMulMod(uint32_t a, uint32_t b) {
+	uint32_t i;
+	uint32_t r = 0;
+	for (i = 0x80000000; i; i >>= 1) {
+		r = r & 0x80000000 ? (r << 1) ^ CRC32_POLY : (r << 1);
+		if (a & i) {
+			r ^= b;
+		}
+	}
+	return r;
+}
+
+/* x^bits mod P */
+static uint32_t crcShift(uint32_t bits) {
+	uint32_t r = 1;
+	uint32_t x = 2;
+	for (; bits; bits >>= 1) {
+		if (bits & 1) {
+			r = crcMulMod(r, x);
+		}
+		x = crcMulMod(x, x);
 	}
+	return r;
 }
 
+static void refreshPageCrc(norFAT_FS* fs, uint32_t page) {
+	uint32_t end = NORFAT_TABLE_BYTES(fs->flashSectors);
+	uint32_t start = page * PROGRAM_SIZE(fs);
+	uint32_t len = end - start > PROGRAM_SIZE(fs) ? PROGRAM_SIZE(fs) : end - start;
+#if NORFAT_FAT_CACHE_PAGES
+	uint32_t crc = NORFAT_CRC(tablePage(fs, page), len, 0);
+#else
+	uint32_t crc = NORFAT_CRC((uint8_t*)fs->fat + start, len, 0);
 #endif
+	fs->tableCrcSum ^= crcMulMod(crc ^ fs->pageCrc[page], fs->pageShift[page]);
+	fs->pageCrc[page] = crc;
+}
+
+static void rebuildTableCrc(norFAT_FS* fs) {
+	uint32_t i;
+	uint32_t end = NORFAT_TABLE_BYTES(fs->flashSectors);
+	uint32_t pages = (end + PROGRAM_SIZE(fs) - 1) / PROGRAM_SIZE(fs);
+	uint32_t step = crcShift(8 * PROGRAM_SIZE(fs));
+	NORFAT_TRACE(("rebuildTableCrc(%i)\r\n", pages));
+	//Each page is shifted past the pages behind it, only the last one can be short
+	fs->pageShift[pages - 1] = 1;
+	for (i = pages - 1; i > 0; i--) {
+		fs->pageShift[i - 1] = (i == pages - 1) ?
+			crcShift(8 * (end - (i * PROGRAM_SIZE(fs)))) :
+			crcMulMod(fs->pageShift[i], step);
+	}
+	memset(fs->pageCrc, 0, sizeof(fs->pageCrc));
+	memset(fs->crcStale, 0, sizeof(fs->crcStale));
+	fs->tableCrcSum = 0;
+	for (i = 0; i < pages; i++) {
+		refreshPageCrc(fs, i);
+	}
+}
+
+static uint32_t calcTableCrc(norFAT_FS* fs, uint32_t index) {
+	uint32_t i, crcRes;
+	uint32_t end = NORFAT_TABLE_BYTES(fs->flashSectors);
+	uint32_t pages = (end + PROGRAM_SIZE(fs) - 1) / PROGRAM_SIZE(fs);
+	uint32_t start = sizeof(_commit) * (index + 1);
+	uint32_t first = start / PROGRAM_SIZE(fs);
+	uint32_t shift = crcShift(8 * (end - start));
+	for (i = 0; i < pages; i++) {
+		if ((fs->crcStale[i / 32] >> (i % 32)) & 1) {
+			refreshPageCrc(fs, i);
+		}
+	}
+	memset(fs->crcStale, 0, sizeof(fs->crcStale));
+	//Take out everything in front of the crc range
+	crcRes = fs->tableCrcSum;
+	for (i = 0; i < first; i++) {
+		crcRes ^= crcMulMod(fs->pageCrc[i], fs->pageShift[i]);
+	}
+	if (start % PROGRAM_SIZE(fs)) {
+		crcRes ^= crcMulMod(NORFAT_CRC((uint8_t*)fs->fat + (first * PROGRAM_SIZE(fs)),
+			start % PROGRAM_SIZE(fs), 0), shift);
+	}
+	crcRes ^= crcMulMod(0xFFFFFFFF, shift);
+	NORFAT_TRACE(("calcTableCrc[%i](%i) 0x%X\r\n", index, end - start, crcRes));
+	return crcRes;
+}
+#else
+static void rebuildTableCrc(norFAT_FS* fs) {
+}
 
 static uint32_t calcTableCrc(norFAT_FS* fs, uint32_t index) {
 	uint32_t crcRes;
@@ -69,6 +594,7 @@ static uint32_t calcTableCrc(norFAT_FS* fs, uint32_t index) {
 	NORFAT_TRACE(("calcTableCrc[%i](%i) 0x%X\r\n", index, crclen, crcRes));
 	return crcRes;
 }
+#endif
 
 static void updateTableCrc(norFAT_FS* fs, uint32_t index) {
 	uint8_t cr[9];
@@ -76,6 +602,7 @@ static void updateTableCrc(norFAT_FS* fs, uint32_t index) {
 	uint32_t crcRes = calcTableCrc(fs, index);
 	snprintf(cr, 9, "%08X", crcRes);
 	memcpy(&fs->fat->commit[index], cr, 8);
+	markDirty(fs, &fs->fat->commit[index], sizeof(_commit));
 }
 
 static uint32_t findCrcIndex(_FAT* fat) {
@@ -88,35 +615,186 @@ static uint32_t findCrcIndex(_FAT* fat) {
 	return i;
 }
 
-static int32_t scanTable(norFAT_FS* fs, _FAT* fat) {
+#if NORFAT_PREERASE_POOL
+static uint32_t inPool(norFAT_FS* fs, uint32_t sector) {
+	uint32_t i;
+	for (i = 0; i < fs->poolCount; i++) {
+		if (fs->pool[i] == sector) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Pre-erased sectors are committed to the table as unlinked file starts.
+ * One that got data after the last commit fails the blank check of its
+ * first two pages (a file start keeps page 0 blank until fclose), and is
+ * left to scanTable to recover like any other unclosed sector.
+ */
+static int32_t loadPool(norFAT_FS* fs) {
+	uint32_t i;
+	uint32_t checkLen = PROGRAM_SIZE(fs) * 2;
+	fs->poolCount = 0;
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs));
+		i < fs->flashSectors && fs->poolCount < NORFAT_PREERASE_POOL; i++) {
+		i = findEntry(fs, i, fs->flashSectors, NORFAT_EMPTY_MASK, NORFAT_PREERASED);
+		if (i == fs->flashSectors) {
+			break;
+		}
+		if (readBlock(fs, fs->addressStart + (i * SECTOR_SIZE(fs)), fs->buff, checkLen)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+		if (norfat_k_blank(fs->buff, checkLen)) {
+			fs->pool[fs->poolCount++] = i;
+		}
+	}
+	NORFAT_TRACE(("loadPool:%i\r\n", fs->poolCount));
+	return NORFAT_OK;
+}
+#else
+#define inPool(fs, sector) 0
+#endif
+
+static int32_t scanTable(norFAT_FS* fs) {
 	uint32_t i;
 	uint32_t wasRepaired = 0;
 	NORFAT_TRACE(("scanTable()\r\n"));
-	for (i = (fs->tableCount * fs->tableSectors); i < fs->flashSectors; i++) {
-		if (fat->sector[i].write && !fat->sector[i].available) {
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+		//Unclosed: still write, no longer available
+		i = findEntry(fs, i, fs->flashSectors,
+			NORFAT_ENTRY_WRITE | NORFAT_ENTRY_AVAILABLE, NORFAT_ENTRY_WRITE);
+		if (i < fs->flashSectors && !inPool(fs, i)) {
 			NORFAT_DEBUG(("Sector %i recovered\r\n", i));
 			NORFAT_TRACE(("SECTOR:recover %i\r\n", i));
-			fat->sector[i].base |= NORFAT_EMPTY_MASK;
+			//0 -> 1 changes only reach flash with a swap
+			if (!wasRepaired && !fs->swapPending) {
+				beginSwap(fs);
+			}
+			writeSector(fs, i)->base |= NORFAT_EMPTY_MASK;
 			wasRepaired = 1;
 		}
 	}
 	return wasRepaired;
 }
 
-static int32_t copyTable(norFAT_FS* fs, uint32_t toIndex, uint32_t fromIndex) {
-	toIndex %= fs->tableCount;
-	fromIndex %= fs->tableCount;
+/* Copies a table through via, viaSize bytes at a time */
+static int32_t copyTableVia(norFAT_FS* fs, uint32_t toIndex, uint32_t fromIndex, uint8_t* via, uint32_t viaSize) {
+	uint32_t done, len;
+	uint32_t size = SECTOR_SIZE(fs) * TABLE_SECTORS(fs);
+	toIndex %= TABLE_COUNT(fs);
+	fromIndex %= TABLE_COUNT(fs);
 	NORFAT_TRACE(("copyTable(%i -> %i)\r\n", fromIndex, toIndex));
-	if (fs->read_block_device(
-		fs->addressStart + ((fs->sectorSize * fs->tableSectors) * fromIndex),
-		(uint8_t*)fs->buff, (fs->sectorSize * fs->tableSectors))) {
-		fs->lastError = NORFAT_ERR_IO;
-		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-		return NORFAT_ERR_IO;
+	for (done = 0; done < size; done += len) {
+		len = size - done > viaSize ? viaSize : size - done;
+		if (readBlock(fs,
+			fs->addressStart + (size * fromIndex) + done, via, len)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+		if (programBlock(fs,
+			fs->addressStart + (size * toIndex) + done, via, len)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+	}
+	return NORFAT_OK;
+}
+
+static int32_t copyTable(norFAT_FS* fs, uint32_t toIndex, uint32_t fromIndex) {
+	return copyTableVia(fs, toIndex, fromIndex, fs->buff, SECTOR_SIZE(fs));
+}
+
+/* Program only the pages of the working table that changed since the last commit,
+ * contiguous dirty pages are merged into a single program call */
+static int32_t programDirtyPages(norFAT_FS* fs, uint32_t tableIndex) {
+#if NORFAT_FAT_CACHE_PAGES
+	uint32_t page;
+	uint8_t* data;
+	tableIndex %= TABLE_COUNT(fs);
+	for (page = 0; page < tablePages(fs); page++) {
+		if (!isDirty(fs, page)) {
+			continue;
+		}
+		data = cachedPage(fs, page);
+		if (!data) {
+			//Programmed to the first table when it left the cache
+			if (tableIndex == fs->spillTable) {
+				continue;
+			}
+			if (readTablePage(fs, fs->spillTable, page, fs->buff)) {
+				return NORFAT_ERR_IO;
+			}
+			data = fs->buff;
+		}
+		NORFAT_TRACE(("programDirtyPages[%i]:%i\r\n", tableIndex, page));
+		if (programTablePage(fs, tableIndex, page, data)) {
+			return NORFAT_ERR_IO;
+		}
+	}
+	return NORFAT_OK;
+#else
+	uint32_t page, run;
+	uint32_t pages = (SECTOR_SIZE(fs) * TABLE_SECTORS(fs)) / PROGRAM_SIZE(fs);
+	uint8_t* fat = (uint8_t*)fs->fat;
+	tableIndex %= TABLE_COUNT(fs);
+	for (page = 0; page < pages; page += run) {
+		if (!isDirty(fs, page)) {
+			run = 1;
+			continue;
+		}
+		for (run = 1; page + run < pages && isDirty(fs, page + run); run++);
+		NORFAT_TRACE(("programDirtyPages[%i]:%i+%i\r\n", tableIndex, page, run));
+		if (programBlock(fs, fs->addressStart +
+			(tableIndex * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))) + (page * PROGRAM_SIZE(fs)),
+			&fat[page * PROGRAM_SIZE(fs)], run * PROGRAM_SIZE(fs))) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+	}
+	return NORFAT_OK;
+#endif
+}
+
+#if NORFAT_FAT_CACHE_PAGES
+/* Programs the whole working table a page at a time, from RAM, from the
+ * table clean pages load from, or already there when it was spilled */
+static int32_t programTable(norFAT_FS* fs, uint32_t tableIndex) {
+	uint32_t page;
+	uint8_t* data;
+	tableIndex %= TABLE_COUNT(fs);
+	NORFAT_TRACE(("programTable[%i]\r\n", tableIndex));
+	for (page = 0; page < tablePages(fs); page++) {
+		data = cachedPage(fs, page);
+		if (!data) {
+			if (isSpilled(fs, page)) {
+				NORFAT_ASSERT(tableIndex == fs->spillTable);
+				continue;
+			}
+			if (readTablePage(fs, fs->cacheTable, page, fs->buff)) {
+				return NORFAT_ERR_IO;
+			}
+			if (fs->sweepPending) {
+				sweepPage(fs, page, fs->buff);
+			}
+			data = fs->buff;
+		}
+		if (programTablePage(fs, tableIndex, page, data)) {
+			return NORFAT_ERR_IO;
+		}
 	}
-	if (fs->program_block_page(
-		fs->addressStart + ((fs->sectorSize * fs->tableSectors) * toIndex),
-		(uint8_t*)fs->buff, (fs->sectorSize * fs->tableSectors))) {
+	return NORFAT_OK;
+}
+#endif
+
+static int32_t eraseTableSector(norFAT_FS* fs, uint32_t tableIndex, uint32_t sector) {
+	if (eraseBlock(fs, fs->addressStart +
+		(tableIndex * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))) +
+		(sector * SECTOR_SIZE(fs)))) {
 		fs->lastError = NORFAT_ERR_IO;
 		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 		return NORFAT_ERR_IO;
@@ -126,14 +804,10 @@ static int32_t copyTable(norFAT_FS* fs, uint32_t toIndex, uint32_t fromIndex) {
 
 static int32_t eraseTable(norFAT_FS* fs, uint32_t tableIndex) {
 	uint32_t i;
-	tableIndex %= fs->tableCount;
+	tableIndex %= TABLE_COUNT(fs);
 	NORFAT_TRACE(("eraseTable(%i)\r\n", tableIndex));
-	for (i = 0; i < fs->tableSectors; i++) {
-		if (fs->erase_block_sector(fs->addressStart +
-			(tableIndex * (fs->sectorSize * fs->tableSectors)) +
-			(i * fs->sectorSize))) {
-			fs->lastError = NORFAT_ERR_IO;
-			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+	for (i = 0; i < TABLE_SECTORS(fs); i++) {
+		if (eraseTableSector(fs, tableIndex, i)) {
 			return NORFAT_ERR_IO;
 		}
 	}
@@ -143,21 +817,37 @@ static int32_t eraseTable(norFAT_FS* fs, uint32_t tableIndex) {
 static uint32_t loadTable(norFAT_FS* fs, uint32_t tableIndex) {
 	uint32_t crcRes, j;
 	uint8_t cr[9];
-	tableIndex %= fs->tableCount;
+	tableIndex %= TABLE_COUNT(fs);
 	NORFAT_TRACE(("loadTable(%i)\r\n", tableIndex));
-	if (fs->read_block_device(
-		fs->addressStart + ((fs->sectorSize * fs->tableSectors) * tableIndex),
-		(uint8_t*)fs->fat, (fs->sectorSize * fs->tableSectors))) {
+#if NORFAT_FAT_CACHE_PAGES
+	//Only the header stays, the rest loads page by page
+	invalidateCache(fs);
+	fs->cacheTable = tableIndex;
+	fs->spillTable = tableIndex;
+	if (readBlock(fs,
+		fs->addressStart + ((SECTOR_SIZE(fs) * TABLE_SECTORS(fs)) * tableIndex),
+		(uint8_t*)fs->fat, headerPages(fs) * PROGRAM_SIZE(fs))) {
+#else
+	if (readBlock(fs,
+		fs->addressStart + ((SECTOR_SIZE(fs) * TABLE_SECTORS(fs)) * tableIndex),
+		(uint8_t*)fs->fat, (SECTOR_SIZE(fs) * TABLE_SECTORS(fs)))) {
+#endif
 		fs->lastError = NORFAT_ERR_IO;
 		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 		return NORFAT_ERR_IO;
 	}
+	clearDirty(fs);
+	rebuildTableCrc(fs);
+#if NORFAT_FAT_CACHE_PAGES
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+#endif
 	j = findCrcIndex(fs->fat);
 	NORFAT_TRACE(("loadTable:crc[%i]\r\n", j));
 	memcpy(cr, &fs->fat->commit[j], 8);
 	cr[8] = 0;
-	uint32_t crclen = NORFAT_TABLE_BYTES(fs->flashSectors) - (sizeof(_commit) * (j + 1ULL));
-	crcRes = NORFAT_CRC(&fs->fat->commit[j + 1], crclen, 0xFFFFFFFF);
+	crcRes = calcTableCrc(fs, j);
 	if (crcRes != strtoul(cr, NULL, 0x10)) {
 		NORFAT_TRACE(("loadTable:failure 0x%X != 0x%s\r\n", crcRes, cr));
 		NORFAT_ERROR(("Table %i crc failure\r\n", tableIndex));
@@ -168,36 +858,48 @@ static uint32_t loadTable(norFAT_FS* fs, uint32_t tableIndex) {
 	return NORFAT_OK;
 }
 
+/* Reads the table a sector at a time, so fs->buff only has to hold one */
 static int32_t validateTable(norFAT_FS* fs, uint32_t tableIndex, uint32_t* crc) {
-	uint32_t crcRes, j;
+	uint32_t crcRes = 0xFFFFFFFF;
+	uint32_t i, j = 0, start, end;
+	uint32_t empty = 1;
+	uint32_t bytes = NORFAT_TABLE_BYTES(fs->flashSectors);
 	int32_t res = NORFAT_TABLE_GOOD;
 	uint8_t cr[9];
-	tableIndex %= fs->tableCount;
+	tableIndex %= TABLE_COUNT(fs);
 	NORFAT_TRACE(("validateTable(%i)\r\n", tableIndex));
 	_FAT* fat = (_FAT*)fs->buff;
-	if (fs->read_block_device(
-		fs->addressStart + ((fs->sectorSize * fs->tableSectors) * tableIndex),
-		(uint8_t*)fat, (fs->sectorSize * fs->tableSectors))) {
-		fs->lastError = NORFAT_ERR_IO;
-		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-		return NORFAT_ERR_IO;
-	}
-	//See if table is completely empty
-	for (j = 0; j < (fs->sectorSize * fs->tableSectors); j++) {
-		if (fs->buff[j] != 0xFF) {
-			break;
+	NORFAT_ASSERT(sizeof(_FAT) <= SECTOR_SIZE(fs));
+	for (i = 0; i < TABLE_SECTORS(fs); i++) {
+		if (readBlock(fs,
+			fs->addressStart + ((SECTOR_SIZE(fs) * TABLE_SECTORS(fs)) * tableIndex) + (i * SECTOR_SIZE(fs)),
+			fs->buff, SECTOR_SIZE(fs))) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+		//See if table is completely empty
+		if (empty && !norfat_k_blank(fs->buff, SECTOR_SIZE(fs))) {
+			empty = 0;
+		}
+		//The crc runs from the entry after the last commit to the end of the entries
+		if (i == 0) {
+			j = findCrcIndex(fat);
+			memcpy(cr, &fat->commit[j], 8);
+			cr[8] = 0;
+		}
+		start = i == 0 ? sizeof(_commit) * (j + 1) : 0;
+		end = bytes - (i * SECTOR_SIZE(fs)) > SECTOR_SIZE(fs) ? SECTOR_SIZE(fs) : bytes - (i * SECTOR_SIZE(fs));
+		if (i * SECTOR_SIZE(fs) < bytes) {
+			crcRes = NORFAT_CRC(&fs->buff[start], end - start, crcRes);
 		}
 	}
-	if (j == (fs->sectorSize * fs->tableSectors)) {
+	if (empty) {
 		NORFAT_TRACE(("validateTable(%i):empty\r\n", tableIndex));
 		return NORFAT_TABLE_EMPTY;
 	}
-	j = findCrcIndex(fat);
 	NORFAT_TRACE(("validateTable:crc[%i]\r\n", j));
-	memcpy(cr, &fat->commit[j], 8);
-	cr[8] = 0;
-	uint32_t crclen = NORFAT_TABLE_BYTES(fs->flashSectors) - (sizeof(_commit) * (j + 1ULL));
-	crcRes = NORFAT_CRC(&fat->commit[j + 1], crclen, 0xFFFFFFFF);
+	uint32_t crclen = bytes - (sizeof(_commit) * (j + 1));
 	if (crcRes != strtoul(cr, NULL, 0x10)) {
 		NORFAT_TRACE(("validateTable:failure 0x%X != 0x%s (%i)\r\n", crcRes, cr, crclen));
 		return NORFAT_TABLE_CRC;
@@ -210,20 +912,69 @@ static int32_t validateTable(norFAT_FS* fs, uint32_t tableIndex, uint32_t* crc)
 	return res;
 }
 
-static int32_t garbageCollect(norFAT_FS* fs) {
+#if NORFAT_FREE_MAP_SECTORS
+static void buildFreeMap(norFAT_FS* fs);
+#endif
+
+/* Frees every deleted sector in RAM. The table then holds 0 -> 1 changes,
+ * so it can only reach flash by a table swap */
+static uint32_t sweepGarbage(norFAT_FS* fs) {
 	uint32_t i;
 	uint32_t collected = 0;
-	NORFAT_TRACE(("garbageCollect():"));
-	for (i = (fs->tableCount * fs->tableSectors); i < fs->flashSectors; i++) {
-		if (!fs->fat->sector[i].active) {
-			fs->fat->sector[i].base |= NORFAT_EMPTY_MASK;
+	NORFAT_TRACE(("sweepGarbage():"));
+#if NORFAT_FAT_CACHE_PAGES
+	collected = countEntries(fs, (TABLE_COUNT(fs) * TABLE_SECTORS(fs)), fs->flashSectors,
+		NORFAT_ENTRY_ACTIVE, 0, NULL);
+	NORFAT_TRACE(("%i\r\n", collected));
+	if (collected) {
+		//Pages in RAM are swept now, the others as they load until the swap
+		fs->sweepPending = 1;
+		for (i = 0; i < headerPages(fs); i++) {
+			if (sweepPage(fs, i, tablePage(fs, i))) {
+				markPage(fs, i);
+			}
+		}
+		for (i = 0; i < NORFAT_FAT_CACHE_PAGES; i++) {
+			if (fs->cachePage[i] != NORFAT_INVALID_PAGE) {
+				sweepPage(fs, fs->cachePage[i], cacheSlot(fs, i));
+			}
+		}
+		memset(fs->crcStale, 0xFF, sizeof(fs->crcStale));
+	}
+#else
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+		i = findEntry(fs, i, fs->flashSectors, NORFAT_ENTRY_ACTIVE, 0);
+		if (i < fs->flashSectors) {
+			writeSector(fs, i)->base |= NORFAT_EMPTY_MASK;
 			NORFAT_TRACE(("[%i]", i));
-			collected = 1;
+			collected++;
 		}
 	}
 	NORFAT_TRACE(("\r\n"));
+#endif
+	STATS_ADD(fs, gcRuns, 1);
+	STATS_ADD(fs, sectorsCollected, collected);
 	if (collected) {
 		fs->fat->garbageCount++;
+		beginSwap(fs);
+#if NORFAT_FREE_MAP_SECTORS
+		buildFreeMap(fs);
+#endif
+	}
+	return collected;
+}
+
+static int32_t garbageCollect(norFAT_FS* fs) {
+	int32_t res;
+	NORFAT_TRACE(("garbageCollect()\r\n"));
+	//The swap in progress was started from the table before this sweep
+	if (fs->swapPending) {
+		res = finishSwap(fs);
+		if (res) {
+			return res;
+		}
+	}
+	if (sweepGarbage(fs)) {
 		return commitChanges(fs, 1);
 	}
 	else {
@@ -233,281 +984,1306 @@ static int32_t garbageCollect(norFAT_FS* fs) {
 	}
 }
 
-static int32_t findEmptySector(norFAT_FS* fs) {
+#if NORFAT_FREE_MAP_SECTORS
+/* One bit per sector with the available bit set, so allocation tests 32
+ * sectors at a time. Bits only clear on allocation, so the map is rebuilt
+ * wherever the table hands sectors back, mount and garbage collection.
+ */
+static uint32_t lowestBit(uint32_t v) {
+#if defined(__GNUC__)
+	return __builtin_ctz(v);
+#elif defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return i;
+#else
+	uint32_t i = 0;
+	while (!(v & 1)) {
+		v >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+static void buildFreeMap(norFAT_FS* fs) {
+	memset(fs->freeMap, 0, sizeof(fs->freeMap));
+	fs->freeCount = countEntries(fs, (TABLE_COUNT(fs) * TABLE_SECTORS(fs)), fs->flashSectors,
+		NORFAT_ENTRY_AVAILABLE, NORFAT_ENTRY_AVAILABLE, fs->freeMap);
+}
 
+/* First free sector at or after sp, wrapping */
+static int32_t takeFreeSector(norFAT_FS* fs, uint32_t sp) {
 	uint32_t i;
-	int32_t res;
-	uint32_t sp = NORFAT_RAND() % fs->flashSectors;
-	NORFAT_TRACE(("findEmptySector().."));
-	if (sp < (fs->tableCount * fs->tableSectors)) {
-		sp = fs->flashSectors / 2;
+	uint32_t words = (fs->flashSectors + 31) / 32;
+	uint32_t w = sp / 32;
+	uint32_t bits = fs->freeMap[w] & (0xFFFFFFFF << (sp % 32));
+	if (fs->freeCount == 0) {
+		return NORFAT_ERR_FULL;
 	}
-	for (i = sp; i < fs->flashSectors; i++) {
-		if (fs->fat->sector[i].available) {
-			fs->fat->sector[i].available = 0;
-			NORFAT_TRACE(("[%i]\r\n", i));
-			return i;
-		}
+	//Goes around once, plus the low bits of the starting word
+	for (i = 0; !bits && i < words; i++) {
+		w = (w + 1) % words;
+		bits = fs->freeMap[w];
+	}
+	NORFAT_ASSERT(bits);
+	i = (w * 32) + lowestBit(bits);
+#if NORFAT_FAT_CACHE_PAGES
+	//A change lost with a failed spill can leave the map ahead of the table
+	if (!readSector(fs, i).available && fs->cacheFault) {
+		return NORFAT_ERR_IO;
 	}
-	for (i = (fs->tableCount * fs->tableSectors); i < sp; i++) {
-		if (fs->fat->sector[i].available) {
-			fs->fat->sector[i].available = 0;
-			NORFAT_TRACE(("[%i]\r\n", i));
-			return i;
+#endif
+	NORFAT_ASSERT(readSector(fs, i).available);
+	fs->freeMap[w] &= ~(1u << (i % 32));
+	fs->freeCount--;
+	writeSector(fs, i)->available = 0;
+	NORFAT_TRACE(("[%i]\r\n", i));
+	return i;
+}
+#endif
+
+/* Takes an available sector without collecting garbage */
+static int32_t pickSector(norFAT_FS* fs, uint32_t sp) {
+#if NORFAT_FREE_MAP_SECTORS
+	return takeFreeSector(fs, sp);
+#else
+	uint32_t i = findEntry(fs, sp, fs->flashSectors, NORFAT_ENTRY_AVAILABLE, NORFAT_ENTRY_AVAILABLE);
+	if (i == fs->flashSectors) {
+		i = findEntry(fs, (TABLE_COUNT(fs) * TABLE_SECTORS(fs)), sp, NORFAT_ENTRY_AVAILABLE, NORFAT_ENTRY_AVAILABLE);
+		if (i == sp) {
+			return NORFAT_ERR_FULL;
 		}
 	}
+	writeSector(fs, i)->available = 0;
+	NORFAT_TRACE(("[%i]\r\n", i));
+	return i;
+#endif
+}
+
+static uint32_t randomSector(norFAT_FS* fs) {
+	uint32_t sp = NORFAT_RAND() % fs->flashSectors;
+	if (sp < (TABLE_COUNT(fs) * TABLE_SECTORS(fs))) {
+		sp = fs->flashSectors / 2;
+	}
+	return sp;
+}
 
+static int32_t findEmptySector(norFAT_FS* fs) {
+	int32_t res;
+	NORFAT_TRACE(("findEmptySector().."));
+	res = pickSector(fs, randomSector(fs));
+	if (res != NORFAT_ERR_FULL) {
+		return res;
+	}
 	res = garbageCollect(fs);
 	if (res) {
 		return res;
 	}
-	for (i = (fs->tableCount * fs->tableSectors); i < fs->flashSectors; i++) {
-		if (fs->fat->sector[i].available) {
-			fs->fat->sector[i].available = 0;
-			NORFAT_TRACE(("[%i]\r\n", i));
-			return i;
-		}
+	res = pickSector(fs, (TABLE_COUNT(fs) * TABLE_SECTORS(fs)));
+	if (res == NORFAT_ERR_FULL) {
+		NORFAT_TRACE(("FULL\r\n"));
 	}
-	NORFAT_TRACE(("FULL\r\n"));
-	return NORFAT_ERR_FULL;
+	return res;
 }
 
-static norFAT_fileHeader* fileSearch(norFAT_FS* fs, const char* filename, uint32_t* sector) {
-	uint32_t i;
-	norFAT_fileHeader* f = NULL;
-	*sector = NORFAT_INVALID_SECTOR;
-	NORFAT_TRACE(("fileSearch(%s)..", filename));
-	for (i = (fs->tableCount * fs->tableSectors); i < fs->flashSectors; i++) {
-		if ((fs->fat->sector[i].base & NORFAT_SOF_MSK) == NORFAT_SOF_MATCH) {
-			if (fs->read_block_device(fs->addressStart + (i * fs->sectorSize),
-				fs->buff, sizeof(norFAT_fileHeader))) {
-				fs->lastError = NORFAT_ERR_IO;
-				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-				return NULL;
-			}
-			NORFAT_TRACE(("[%s]", fs->buff));
-			//Somewhat wasteful, but we need to allow read function to call
-			//cache routines on a safe buffer
-			if (strcmp(fs->buff, filename) == 0) {
-				*sector = i;
-				NORFAT_TRACE(("sector[%i]\r\n", i));
-				NORFAT_DEBUG(("File %s found at sector %i\r\n", filename, i));
-				f = NORFAT_MALLOC(sizeof(norFAT_fileHeader));
-				if (f) {
-					memcpy(f, fs->buff, sizeof(norFAT_fileHeader));
-				}
-				break;
-			}
-		}
-	}
-	if (!f) {
-		NORFAT_TRACE(("\r\n", i));
+/* Takes sector i if it is available */
+static int32_t takeSector(norFAT_FS* fs, uint32_t i) {
+	if (i < (TABLE_COUNT(fs) * TABLE_SECTORS(fs)) || i >= fs->flashSectors ||
+		!readSector(fs, i).available) {
+		return NORFAT_ERR_FULL;
 	}
-	return f;
+#if NORFAT_FREE_MAP_SECTORS
+	fs->freeMap[i / 32] &= ~(1u << (i % 32));
+	fs->freeCount--;
+#endif
+	writeSector(fs, i)->available = 0;
+	return i;
 }
 
-static int commitChanges(norFAT_FS* fs, uint32_t forceSwap) {
+/* A sector ready to program, from the pre-erase pool when it has one.
+ * hint is the sector physically after the current one, taking it keeps
+ * the chain contiguous so fread can merge the sectors into one read. */
+static int32_t takeErasedSector(norFAT_FS* fs, uint32_t hint) {
+	int32_t sector;
+#if NORFAT_PREERASE_POOL
 	uint32_t i;
-	uint32_t index = findCrcIndex(fs->fat);
-	NORFAT_TRACE(("commitChanges(%s)..\r\n", forceSwap ? "force" : ".."));
-	/* Protect fs state */
-	if (fs->lastError == NORFAT_ERR_IO) {
+	if (fs->poolCount) {
+		for (i = 0; i < fs->poolCount - 1 && fs->pool[i] != hint; i++);
+		sector = fs->pool[i];
+		fs->pool[i] = fs->pool[--fs->poolCount];
+		NORFAT_TRACE(("takeErasedSector:pool[%i]\r\n", sector));
+		return sector;
+	}
+#endif
+	sector = takeSector(fs, hint);
+	if (sector == NORFAT_ERR_FULL) {
+		sector = findEmptySector(fs);
+	}
+	if (sector < 0) {
+		return sector;
+	}
+	if (eraseBlock(fs, fs->addressStart + (SECTOR_SIZE(fs) * sector))) {
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		fs->lastError = NORFAT_ERR_IO;
 		return NORFAT_ERR_IO;
 	}
-	//Is current table set full?
-	if (index == NORFAT_CRC_COUNT - 1 || forceSwap) {
-		NORFAT_TRACE(("commitChanges:Increment _FAT tables %i\r\n", fs->firstFAT));
-		uint32_t swap1old = fs->firstFAT;
-		uint32_t swap2old = (fs->firstFAT + 1) % fs->tableCount;
-		uint32_t swap1new = (fs->firstFAT + 2) % fs->tableCount;
-		uint32_t swap2new = (fs->firstFAT + 3) % fs->tableCount;
-		fs->fat->swapCount++;
-		// Refresh the FAT table and calculate crc
-		memset(fs->fat->commit, 0xFF, sizeof(_commit) * NORFAT_CRC_COUNT);
-		updateTableCrc(fs, 0);
+	return sector;
+}
 
-		//Erase #1 old block
-		NORFAT_TRACE(("commitChanges:Erase[%i]\r\n", swap1old));
-		for (i = 0; i < fs->tableSectors; i++) {
-			if (fs->erase_block_sector(fs->addressStart +
-				(swap1old * (fs->sectorSize * fs->tableSectors)) +
-				(i * fs->sectorSize))) {
-				fs->lastError = NORFAT_ERR_IO;
-				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-				return NORFAT_ERR_IO;
-			}
-		}
+/* Names on flash are uint8_t, the ones callers hand in char */
+static uint32_t sameName(const uint8_t* name, const char* filename) {
+	return strcmp((const char*)name, filename) == 0;
+}
 
-		//Program #1 new block
-		NORFAT_TRACE(("commitChanges:Program[%i]\r\n", swap1new));
-		if (fs->program_block_page(fs->addressStart +
-			(swap1new * (fs->sectorSize * fs->tableSectors)),
-			(uint8_t*)fs->fat, (fs->sectorSize * fs->tableSectors))) {
-			fs->lastError = NORFAT_ERR_IO;
-			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-			return NORFAT_ERR_IO;
-		}
-		//Erase #2 old block
-		NORFAT_TRACE(("commitChanges:Erase[%i]\r\n", swap2old));
-		for (i = 0; i < fs->tableSectors; i++) {
-			if (fs->erase_block_sector(fs->addressStart +
-				(swap2old * (fs->sectorSize * fs->tableSectors))+
-				(i * fs->sectorSize))) {
-				fs->lastError = NORFAT_ERR_IO;
-				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-				return NORFAT_ERR_IO;
-			}
-		}
-		//Program #2 new block
-		NORFAT_TRACE(("commitChanges:Program[%i]\r\n", swap2new));
-		if (fs->program_block_page(fs->addressStart +
-			(swap2new * (fs->sectorSize * fs->tableSectors)), 
-			(uint8_t*)fs->fat, (fs->sectorSize * fs->tableSectors))) {
-			fs->lastError = NORFAT_ERR_IO;
-			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-			return NORFAT_ERR_IO;
-		}
-		validateTable(fs, swap1new, &i);
-		NORFAT_TRACE(("TESTCRC: 0x%X\r\n", calcTableCrc(fs, 0)));
-
-		fs->firstFAT += 2;
-		fs->firstFAT %= fs->tableCount;
-		NORFAT_TRACE(("commitChanges:firstFat = %i\r\n", 
-			fs->firstFAT));
-		NORFAT_DEBUG(("_FAT tables now at %i %i\n",
-			fs->firstFAT, ((fs->firstFAT + 1) % fs->tableCount)));
-		return NORFAT_OK;
+/* Reads the header of the file starting at sector into fs->buff,
+ * returns 1 if it is filename */
+static int32_t matchHeader(norFAT_FS* fs, uint32_t sector, const char* filename) {
+	STATS_ADD(fs, headerReads, 1);
+	if (readBlock(fs, fs->addressStart + (sector * SECTOR_SIZE(fs)),
+		fs->buff, sizeof(norFAT_fileHeader))) {
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
 	}
-	NORFAT_DEBUG(("Committing _FAT tables %i %i\r\n", 
-		fs->firstFAT, ((fs->firstFAT + 1) % fs->tableCount)));
-	//Prep for write
-	//CRC
-	NORFAT_ASSERT(index < NORFAT_CRC_COUNT - 1);
-	memset(&fs->fat->commit[index], 0, sizeof(_commit));
-	updateTableCrc(fs, index + 1);
+	NORFAT_TRACE(("[%s]", fs->buff));
+	return sameName(fs->buff, filename);
+}
 
-	memset(fs->buff, 0xFF, (fs->sectorSize * fs->tableSectors));
-	uint8_t* fat = (uint8_t*)fs->fat;
-	for (i = 0; i < (fs->sectorSize * fs->tableSectors); i++) {
-		fs->buff[i] &= fat[i];
-	}
-	NORFAT_TRACE(("commitChanges:Program[%i]\r\n", fs->firstFAT));
-	if (fs->program_block_page(fs->addressStart +
-		(fs->firstFAT * (fs->sectorSize * fs->tableSectors)), fs->buff, (fs->sectorSize * fs->tableSectors))) {
+/* Where the copies of a file are. Only rewrites interrupted by power loss
+ * leave more than one, see pack sectors */
+typedef struct {
+	uint32_t sector;//Start of the sector file
+	uint32_t pack;//Packed record, the live one if there is one
+	uint32_t live;
+	uint32_t stale;//Shadowed record that lost to another copy
+} _versions;
+
+#if NORFAT_PACK_THRESHOLD
+/* Small files are records in pack sectors, which the table sees as files
+ * named NORFAT_PACK_NAME. Records are only added, and their state word is
+ * programmed down after: a rewrite shadows the old record, programs the
+ * new one and then deletes the old one. Between a record and a sector
+ * file of the same name, a live record wins over the sector file and the
+ * sector file over a shadowed record, so power loss at any point leaves
+ * either the old or the new contents.
+ * Outside the pack sector a record goes by its location, NORFAT_PACKED
+ * plus the number of its first page.
+ */
+#define NORFAT_PACK_NAME		"\x01pack"
+#define NORFAT_PACK_LIVE		0xFFFFFFFF
+#define NORFAT_PACK_SHADOWED	0x0000FFFF
+#define NORFAT_PACK_DELETED		0x00000000
+#define NORFAT_PACKED			0x80000000
+
+#define isPacked(loc) ((loc) != NORFAT_INVALID_SECTOR && ((loc) & NORFAT_PACKED))
+
+static uint32_t packLoc(norFAT_FS* fs, uint32_t sector, uint32_t record) {
+	return NORFAT_PACKED | ((sector * (SECTOR_SIZE(fs) / PROGRAM_SIZE(fs))) + (record / PROGRAM_SIZE(fs)));
+}
+
+static uint32_t locSector(norFAT_FS* fs, uint32_t loc) {
+	return (loc & ~NORFAT_PACKED) / (SECTOR_SIZE(fs) / PROGRAM_SIZE(fs));
+}
+
+static uint32_t locRecord(norFAT_FS* fs, uint32_t loc) {
+	return ((loc & ~NORFAT_PACKED) % (SECTOR_SIZE(fs) / PROGRAM_SIZE(fs))) * PROGRAM_SIZE(fs);
+}
+
+static uint32_t packRecordCrc(_packRecord* r) {
+	return NORFAT_CRC(&r->fh, sizeof(norFAT_fileHeader), 0xFFFFFFFF);
+}
+
+static uint32_t packRecordSize(norFAT_FS* fs, uint32_t len) {
+	len += sizeof(_packRecord);
+	return ((len + PROGRAM_SIZE(fs) - 1) / PROGRAM_SIZE(fs)) * PROGRAM_SIZE(fs);
+}
+
+static int32_t readPackSector(norFAT_FS* fs, uint32_t sector) {
+	if (readBlock(fs, fs->addressStart + (sector * SECTOR_SIZE(fs)), fs->buff, SECTOR_SIZE(fs))) {
 		fs->lastError = NORFAT_ERR_IO;
 		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 		return NORFAT_ERR_IO;
 	}
-	NORFAT_TRACE(("commitChanges:Program[%i]\r\n", fs->firstFAT + 1));
-	if (fs->program_block_page(fs->addressStart +
-		(((fs->firstFAT + 1) % fs->tableCount) * (fs->sectorSize * fs->tableSectors)),
-		fs->buff, (fs->sectorSize * fs->tableSectors))) {
+	return NORFAT_OK;
+}
+
+/* Record at *offset of the pack sector in fs->buff, NULL past the last one.
+ * *offset is then where the next record goes, or sectorSize when a record
+ * torn by power loss leaves the rest of the sector unusable */
+static _packRecord* packWalk(norFAT_FS* fs, uint32_t* offset) {
+	uint32_t i;
+	_packRecord* r;
+	if (*offset + sizeof(_packRecord) > SECTOR_SIZE(fs)) {
+		*offset = SECTOR_SIZE(fs);
+		return NULL;
+	}
+	r = (_packRecord*)&fs->buff[*offset];
+	if (r->check == packRecordCrc(r) && r->fh.fileLen <= NORFAT_PACK_THRESHOLD &&
+		*offset + packRecordSize(fs, r->fh.fileLen) <= SECTOR_SIZE(fs) &&
+		NORFAT_CRC((uint8_t*)&r[1], r->fh.fileLen, 0xFFFFFFFF) == r->fh.crc) {
+		return r;
+	}
+	for (i = 0; i < sizeof(_packRecord) && fs->buff[*offset + i] == 0xFF; i++);
+	if (i < sizeof(_packRecord)) {
+		NORFAT_TRACE(("packWalk:torn record at %i\r\n", *offset));
+		*offset = SECTOR_SIZE(fs);
+	}
+	return NULL;
+}
+
+/* Reads the record at loc into r, returns 1 if it is a copy of filename */
+static int32_t matchRecord(norFAT_FS* fs, uint32_t loc, const char* filename, _packRecord* r) {
+	if ((readSector(fs, locSector(fs, loc)).base & NORFAT_SOF_MSK) != NORFAT_SOF_MATCH) {
+		return 0;
+	}
+	if (readBlock(fs, fs->addressStart + (locSector(fs, loc) * SECTOR_SIZE(fs)) + locRecord(fs, loc),
+		(uint8_t*)r, sizeof(_packRecord))) {
 		fs->lastError = NORFAT_ERR_IO;
 		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 		return NORFAT_ERR_IO;
 	}
-	NORFAT_TRACE(("commitChanges:firstFat = %i\r\n", fs->firstFAT, index + 1));
+	return r->state != NORFAT_PACK_DELETED && r->check == packRecordCrc(r) &&
+		sameName(r->fh.fileName, filename);
+}
+
+static void packVersion(_versions* v, uint32_t loc, uint32_t state) {
+	if (v->pack == NORFAT_INVALID_SECTOR) {
+		v->pack = loc;
+		v->live = state == NORFAT_PACK_LIVE;
+	}
+	else if (state == NORFAT_PACK_LIVE && !v->live) {
+		v->stale = v->pack;
+		v->pack = loc;
+		v->live = 1;
+	}
+	else {
+		v->stale = loc;
+	}
+}
+
+/* Adds the records of filename in pack sector to v */
+static int32_t packScan(norFAT_FS* fs, uint32_t sector, const char* filename, _versions* v) {
+	uint32_t offset = PROGRAM_SIZE(fs);
+	_packRecord* r;
+	if (readPackSector(fs, sector)) {
+		return NORFAT_ERR_IO;
+	}
+	while ((r = packWalk(fs, &offset)) != NULL) {
+		if (r->state != NORFAT_PACK_DELETED && sameName(r->fh.fileName, filename)) {
+			packVersion(v, packLoc(fs, sector, offset), r->state);
+		}
+		offset += packRecordSize(fs, r->fh.fileLen);
+	}
 	return NORFAT_OK;
 }
+#else
+#define isPacked(loc) 0
+#endif
 
-uint32_t scenarioList[64];
+#if NORFAT_HASH_INDEX_SIZE
+/* Open addressed filename hash -> start sector index, linear probing with
+ * backward shift deletion. Built on first lookup after mount, and kept up to
+ * date by fclose and remove. If it ever fills past 3/4 it stops being
+ * complete, and lookups that miss fall back to the sector scan.
+ */
+#define NORFAT_INDEX_NONE		0
+#define NORFAT_INDEX_COMPLETE	1
+#define NORFAT_INDEX_PARTIAL	2
+#define NORFAT_INDEX_MASK		(NORFAT_HASH_INDEX_SIZE - 1)
 
-int norfat_mount(norFAT_FS* fs) {
-	int32_t i;
-	uint32_t ui;
-	int32_t empty = 1;
-	uint32_t scenario;
-	NORFAT_TRACE(("norfat_mount()..\r\n"));
-	NORFAT_ASSERT(fs->erase_block_sector);
-	NORFAT_ASSERT(fs->program_block_page);
-	NORFAT_ASSERT(fs->read_block_device);
-	NORFAT_ASSERT(fs->fat);
-	NORFAT_ASSERT(fs->buff);
-	//Configuration tests
-	NORFAT_ASSERT(fs->programSize);
-	NORFAT_ASSERT(sizeof(norFAT_fileHeader) < fs->programSize);
-	NORFAT_ASSERT(fs->tableCount % 2 == 0);//Must be multiple of 2
-	NORFAT_ASSERT(fs->tableCount <= NORFAT_MAX_TABLES);//We don't want to dynamically allocate
-	NORFAT_TRACE(("Table Bytes = 0x%X\r\n", NORFAT_TABLE_BYTES(fs->flashSectors)));
-	NORFAT_ASSERT(//Assure that the total sectors fits in the configured sectors
-		NORFAT_TABLE_BYTES(fs->flashSectors) < fs->tableSectors * fs->sectorSize);
+#if NORFAT_HASH_INDEX_SIZE & NORFAT_INDEX_MASK
+#error NORFAT_HASH_INDEX_SIZE must be a power of 2
+#endif
 
-	fs->lastError = NORFAT_OK;
-	uint32_t sectorState[NORFAT_MAX_TABLES];
-	uint32_t sectorCRC[NORFAT_MAX_TABLES];
-	/* Scan tables for valid records */
-	for (i = 0; i < (int32_t)fs->tableCount; i++) {
-		sectorState[i] = validateTable(fs, i, &sectorCRC[i]);
-		if (sectorState[i] == NORFAT_TABLE_GOOD) {
-			empty = 0;
-		}
-		else if (sectorState[i] == NORFAT_ERR_IO) {
-			return NORFAT_ERR_IO;
-		}
-		//Check old state
-		//If Both sectors are good but crc's don't match, the odd number 
-		//was programmed prior to the current operation, and is the older.
-		if (i % 2 == 1) {
-			if (sectorState[i] == NORFAT_TABLE_GOOD &&
-				sectorState[i - 1] == NORFAT_TABLE_GOOD &&
-				sectorCRC[i] != sectorCRC[i - 1]) {
-				sectorState[i] = NORFAT_TABLE_OLD;
-			}
-		}
+static uint32_t nameHash(const char* filename) {
+	uint32_t hash = 0x811C9DC5;//FNV-1a
+	while (*filename) {
+		hash ^= (uint8_t)*filename++;
+		hash *= 0x01000193;
 	}
-	if (empty) {
-		NORFAT_TRACE(("norfat_mount:Volume empty\r\n"));
-		NORFAT_DEBUG(("Mounted volume is empty\r\n"));
-		fs->lastError = NORFAT_ERR_EMPTY;
-		return NORFAT_ERR_EMPTY;
+	return hash;
+}
+
+static void indexInsert(norFAT_FS* fs, const uint8_t* name, uint32_t sector) {
+	uint32_t hash = nameHash((const char*)name);
+	uint32_t i = hash & NORFAT_INDEX_MASK;
+	if (fs->indexCount >= (NORFAT_HASH_INDEX_SIZE / 4) * 3) {
+		NORFAT_TRACE(("indexInsert:partial\r\n"));
+		fs->indexState = NORFAT_INDEX_PARTIAL;
+		return;
+	}
+	while (fs->index[i].sector != NORFAT_INVALID_SECTOR) {
+		i = (i + 1) & NORFAT_INDEX_MASK;
 	}
+	fs->index[i].hash = hash;
+	fs->index[i].sector = sector;
+	fs->indexCount++;
+}
 
-	/* There are 4 states, Good, old, empty, and bad 
-	 * Tables are kept in mirrored copies in even pairs
-	 * Like 0-1, 2-3, etc. We never attempt to do any
-	 * repairs to a presently valid table.
-	 */
-	uint32_t res;
-	uint32_t tablesValid = 0;
-	memset(fs->fat, 0, fs->tableSectors * fs->sectorSize);
+static void indexRemove(norFAT_FS* fs, uint32_t sector) {
+	uint32_t i, j, home;
+	if (sector == NORFAT_INVALID_SECTOR) {
+		return;
+	}
+	for (i = 0; i < NORFAT_HASH_INDEX_SIZE; i++) {
+		if (fs->index[i].sector == sector) {
+			break;
+		}
+	}
+	if (i == NORFAT_HASH_INDEX_SIZE) {
+		return;
+	}
+	//Pull back entries that probed past the hole
+	for (j = (i + 1) & NORFAT_INDEX_MASK;
+		fs->index[j].sector != NORFAT_INVALID_SECTOR; j = (j + 1) & NORFAT_INDEX_MASK) {
+		home = fs->index[j].hash & NORFAT_INDEX_MASK;
+		if (((j - home) & NORFAT_INDEX_MASK) >= ((j - i) & NORFAT_INDEX_MASK)) {
+			fs->index[i] = fs->index[j];
+			i = j;
+		}
+	}
+	fs->index[i].sector = NORFAT_INVALID_SECTOR;
+	fs->indexCount--;
+}
 
-	for (ui = 0; ui < fs->tableCount; ui += 2) {
-		//Build a scenario
-		// |N|N|N|N|
-		scenario = sectorState[ui] << 12;
-		scenario += sectorState[(ui + 1) % fs->tableCount] << 8;
-		scenario += sectorState[(ui + 2) % fs->tableCount] << 4;
-		scenario += sectorState[(ui + 3) % fs->tableCount] << 0;
-		for (i = 0; i < 64; i++) {
-			if (scenarioList[i] == scenario || scenarioList[i] == 0) {
-				break;
+static int32_t indexBuild(norFAT_FS* fs) {
+	uint32_t i;
+	NORFAT_TRACE(("indexBuild()\r\n"));
+	memset(fs->index, 0xFF, sizeof(fs->index));
+	fs->indexCount = 0;
+	fs->indexState = NORFAT_INDEX_COMPLETE;
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+		if ((readSector(fs, i).base & NORFAT_SOF_MSK) == NORFAT_SOF_MATCH) {
+			if (matchHeader(fs, i, "") < 0) {
+				fs->indexState = NORFAT_INDEX_NONE;
+				return NORFAT_ERR_IO;
 			}
+#if NORFAT_PACK_THRESHOLD
+			if (sameName(fs->buff, NORFAT_PACK_NAME)) {
+				uint32_t offset = PROGRAM_SIZE(fs);
+				_packRecord* r;
+				if (readPackSector(fs, i)) {
+					fs->indexState = NORFAT_INDEX_NONE;
+					return NORFAT_ERR_IO;
+				}
+				while ((r = packWalk(fs, &offset)) != NULL) {
+					if (r->state != NORFAT_PACK_DELETED) {
+						indexInsert(fs, r->fh.fileName, packLoc(fs, i, offset));
+					}
+					offset += packRecordSize(fs, r->fh.fileLen);
+				}
+				continue;
+			}
+#endif
+			indexInsert(fs, ((norFAT_fileHeader*)fs->buff)->fileName, i);
 		}
-		if (i != 64) {
-			scenarioList[i] = scenario;
+	}
+	NORFAT_DEBUG(("Index built, %i files\r\n", fs->indexCount));
+	return NORFAT_OK;
+}
+
+/* Returns 1 with the copies of the file in v, 0 when the file does not
+ * exist, and NORFAT_ERR_FILE_NOT_FOUND when the index can't tell */
+static int32_t indexSearch(norFAT_FS* fs, const char* filename, _versions* v) {
+	int32_t res;
+	int32_t found = 0;
+	uint32_t hash = nameHash(filename);
+	uint32_t i = hash & NORFAT_INDEX_MASK;
+	if (fs->indexState == NORFAT_INDEX_NONE && indexBuild(fs)) {
+		return NORFAT_ERR_IO;
+	}
+	for (; fs->index[i].sector != NORFAT_INVALID_SECTOR; i = (i + 1) & NORFAT_INDEX_MASK) {
+		if (fs->index[i].hash != hash) {
+			continue;
 		}
-		res = 0;
-		switch (scenario) {
-		case 0x0032:/* |EMPTY|EMPTY| BAD |GOOD | */
-			res = eraseTable(fs, (ui + 2) % fs->tableCount);
-			if (res) {
+#if NORFAT_PACK_THRESHOLD
+		if (isPacked(fs->index[i].sector)) {
+			_packRecord r;
+			res = matchRecord(fs, fs->index[i].sector, filename, &r);
+			if (res < 0) {
 				return res;
 			}
-			res = loadTable(fs, ui);
 			if (res) {
-				return res;
+				packVersion(v, fs->index[i].sector, r.state);
+				found = 1;
 			}
-			fs->firstFAT = ui;
-			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % fs->tableCount));
+			continue;
+		}
+#endif
+		if ((readSector(fs, fs->index[i].sector).base & NORFAT_SOF_MSK) != NORFAT_SOF_MATCH) {
+			continue;
+		}
+		res = matchHeader(fs, fs->index[i].sector, filename);
+		if (res < 0) {
+			return res;
+		}
+		if (res) {
+			v->sector = fs->index[i].sector;
+			found = 1;
+#if !NORFAT_PACK_THRESHOLD
+			return 1;
+#endif
+		}
+	}
+	if (fs->indexState == NORFAT_INDEX_COMPLETE) {
+		return found;
+	}
+	//Other copies could be missing from a partial index
+	return NORFAT_ERR_FILE_NOT_FOUND;
+}
+#endif
+
+#if NORFAT_PACK_THRESHOLD
+/* Programs the state word of the record at loc down */
+static int32_t packSetState(norFAT_FS* fs, uint32_t loc, uint32_t state) {
+	memset(fs->buff, 0xFF, PROGRAM_SIZE(fs));
+	*(uint32_t*)fs->buff = state;
+	NORFAT_TRACE(("packSetState(%i.%i,0x%X)\r\n", locSector(fs, loc), locRecord(fs, loc), state));
+	if (programBlock(fs, fs->addressStart + (locSector(fs, loc) * SECTOR_SIZE(fs)) + locRecord(fs, loc),
+		fs->buff, PROGRAM_SIZE(fs))) {
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+#if NORFAT_HASH_INDEX_SIZE
+	if (state == NORFAT_PACK_DELETED && fs->indexState != NORFAT_INDEX_NONE) {
+		indexRemove(fs, loc);
+	}
+#endif
+	return NORFAT_OK;
+}
+
+/* Deletes the shadowed copy of filename a lookup found at loc, unless
+ * compaction took it away or reused its space since */
+static int32_t dropStaleRecord(norFAT_FS* fs, uint32_t loc, const char* filename) {
+	_packRecord r;
+	int32_t res;
+	if (loc == NORFAT_INVALID_SECTOR) {
+		return NORFAT_OK;
+	}
+	res = matchRecord(fs, loc, filename, &r);
+	if (res != 1) {
+		return res < 0 ? res : NORFAT_OK;
+	}
+	if (r.state != NORFAT_PACK_SHADOWED) {
+		return NORFAT_OK;
+	}
+	NORFAT_DEBUG(("File %s stale record removed\r\n", filename));
+	return packSetState(fs, loc, NORFAT_PACK_DELETED);
+}
+#endif
+
+/* Appends leave the header alone and add a record after it in the header
+ * page instead. The last record that checks out and fits the committed
+ * chain holds the file length, so a record programmed before a power loss
+ * that also lost the commit linking its new sectors is ignored.
+ */
+static uint32_t appendRecordCrc(_appendRecord* r) {
+	return NORFAT_CRC(r, sizeof(_appendRecord) - sizeof(uint32_t), 0xFFFFFFFF);
+}
+
+static uint32_t appendSlots(norFAT_FS* fs) {
+	return (PROGRAM_SIZE(fs) - sizeof(norFAT_fileHeader)) / sizeof(_appendRecord);
+}
+
+/* Data bytes the chain starting at sector can hold, and its last sector */
+static uint32_t chainCapacity(norFAT_FS* fs, uint32_t sector, uint32_t* last) {
+	uint32_t count = 1;
+	while (readSector(fs, sector).next != NORFAT_EOF && count < fs->flashSectors) {
+		sector = readSector(fs, sector).next;
+		if (sector < (TABLE_COUNT(fs) * TABLE_SECTORS(fs)) || sector >= fs->flashSectors) {
+			NORFAT_TRACE(("chainCapacity:corrupt next %i\r\n", sector));
+			break;
+		}
+		count++;
+	}
+	if (last) {
+		*last = sector;
+	}
+	return (count * SECTOR_SIZE(fs)) - PROGRAM_SIZE(fs);
+}
+
+/* Applies the append records of the file at sector to fh, slot returns the
+ * first unused record, appendSlots() when they are all used */
+static int32_t readAppendRecords(norFAT_FS* fs, uint32_t sector, norFAT_fileHeader* fh, uint32_t* slot) {
+	uint32_t i, j;
+	uint32_t slots = appendSlots(fs);
+	uint32_t capacity = chainCapacity(fs, sector, NULL);
+	_appendRecord* r;
+	if (readBlock(fs, fs->addressStart + (sector * SECTOR_SIZE(fs)) + sizeof(norFAT_fileHeader),
+		fs->buff, slots * sizeof(_appendRecord))) {
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	for (i = 0; i < slots; i++) {
+		r = (_appendRecord*)&fs->buff[i * sizeof(_appendRecord)];
+		for (j = 0; j < sizeof(_appendRecord) && fs->buff[(i * sizeof(_appendRecord)) + j] == 0xFF; j++);
+		if (j == sizeof(_appendRecord)) {
+			break;
+		}
+		if (r->check == appendRecordCrc(r) && r->fileLen <= capacity) {
+			fh->fileLen = r->fileLen;
+			fh->timeStamp = r->timeStamp;
+			fh->crc = r->crc;
+		}
+	}
+	if (slot) {
+		*slot = i;
+	}
+	return NORFAT_OK;
+}
+
+/* Fills f with the header of filename and returns 1, and its location in
+ * sector, a packed record location or the start sector. stale (optional)
+ * is a sector file that a live packed record shadows, staleRecord
+ * (optional) a shadowed record that lost to another copy, both left by an
+ * interrupted rewrite. Lookups leave them on flash, fclose of a rewrite
+ * and remove take them away. 0 when not found or on error (fs->lastError). */
+static uint32_t fileSearch(norFAT_FS* fs, const char* filename, norFAT_fileHeader* f, uint32_t* sector, uint32_t* stale, uint32_t* staleRecord) {
+	uint32_t i;
+	int32_t res = NORFAT_ERR_FILE_NOT_FOUND;
+	_versions v;
+	memset(&v, 0xFF, sizeof(v));
+	v.live = 0;
+	*sector = NORFAT_INVALID_SECTOR;
+	if (stale) {
+		*stale = NORFAT_INVALID_SECTOR;
+	}
+	if (staleRecord) {
+		*staleRecord = NORFAT_INVALID_SECTOR;
+	}
+	NORFAT_TRACE(("fileSearch(%s)..", filename));
+#if NORFAT_HASH_INDEX_SIZE
+	res = indexSearch(fs, filename, &v);
+	if (res == NORFAT_ERR_FILE_NOT_FOUND) {
+		memset(&v, 0xFF, sizeof(v));
+		v.live = 0;
+	}
+#endif
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs));
+		res == NORFAT_ERR_FILE_NOT_FOUND && i < fs->flashSectors; i++) {
+		if ((readSector(fs, i).base & NORFAT_SOF_MSK) == NORFAT_SOF_MATCH) {
+			//Somewhat wasteful, but we need to allow read function to call
+			//cache routines on a safe buffer
+			res = matchHeader(fs, i, filename);
+			if (res == 1) {
+				v.sector = i;
+			}
+#if NORFAT_PACK_THRESHOLD
+			else if (res == 0 && sameName(fs->buff, NORFAT_PACK_NAME)) {
+				res = packScan(fs, i, filename, &v);
+			}
+			if (res >= 0) {
+				//Copies can be in any sector, look at all of them
+				res = NORFAT_ERR_FILE_NOT_FOUND;
+			}
+#else
+			else if (res == 0) {
+				res = NORFAT_ERR_FILE_NOT_FOUND;
+			}
+#endif
+		}
+	}
+	if (res == NORFAT_ERR_IO) {
+		return 0;
+	}
+#if NORFAT_PACK_THRESHOLD
+	if (!v.live && v.pack != NORFAT_INVALID_SECTOR && v.sector != NORFAT_INVALID_SECTOR) {
+		v.stale = v.pack;
+		v.pack = NORFAT_INVALID_SECTOR;
+	}
+	if (staleRecord) {
+		*staleRecord = v.stale;
+	}
+	if (v.live) {
+		if (stale) {
+			*stale = v.sector;
+		}
+		v.sector = v.pack;
+	}
+	else if (v.sector == NORFAT_INVALID_SECTOR) {
+		v.sector = v.pack;
+	}
+	if (isPacked(v.sector)) {
+		_packRecord r;
+		*sector = v.sector;
+		NORFAT_TRACE(("record[%i.%i]\r\n", locSector(fs, v.sector), locRecord(fs, v.sector)));
+		if (matchRecord(fs, v.sector, filename, &r) != 1) {
+			return 0;
+		}
+		memcpy(f, &r.fh, sizeof(norFAT_fileHeader));
+		return 1;
+	}
+	//Other copies may have used fs->buff since
+	if (v.sector != NORFAT_INVALID_SECTOR && matchHeader(fs, v.sector, filename) != 1) {
+		return 0;
+	}
+#endif
+	if (v.sector != NORFAT_INVALID_SECTOR) {
+		*sector = v.sector;
+		NORFAT_TRACE(("sector[%i]\r\n", *sector));
+		NORFAT_DEBUG(("File %s found at sector %i\r\n", filename, *sector));
+		memcpy(f, fs->buff, sizeof(norFAT_fileHeader));
+		if (readAppendRecords(fs, *sector, f, NULL)) {
+			return 0;
+		}
+		return 1;
+	}
+	NORFAT_TRACE(("\r\n"));
+	return 0;
+}
+
+/* fclose/remove commit through here, inside norfat_begin/norfat_commit
+ * the commit is held back until the batch ends */
+static int32_t requestCommit(norFAT_FS* fs) {
+	if (fs->batchDepth) {
+		NORFAT_TRACE(("requestCommit:deferred\r\n"));
+		fs->batchPending = 1;
+		return NORFAT_OK;
+	}
+	return commitChanges(fs, 0);
+}
+
+#if NORFAT_PACK_THRESHOLD
+/* Starts a pack sector. It is committed before any record goes in, records
+ * don't need a commit of their own after that */
+static int32_t packNewSector(norFAT_FS* fs) {
+	norFAT_fileHeader* fh = (norFAT_fileHeader*)fs->buff;
+	int32_t sector = takeErasedSector(fs, NORFAT_INVALID_SECTOR);
+	if (sector < 0) {
+		return sector;
+	}
+	memset(fs->buff, 0xFF, PROGRAM_SIZE(fs));
+	memset(fh, 0, sizeof(norFAT_fileHeader));
+	strcpy((char*)fh->fileName, NORFAT_PACK_NAME);
+	fh->timeStamp = (uint32_t)time(NULL);
+	fh->crc = 0xFFFFFFFF;
+	NORFAT_TRACE(("packNewSector(%i)\r\n", sector));
+	if (programBlock(fs, fs->addressStart + (sector * SECTOR_SIZE(fs)), fs->buff, PROGRAM_SIZE(fs))) {
+		writeSector(fs, sector)->base &= NORFAT_GARBAGE_MASK;
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	writeSector(fs, sector)->write = 0;
+	fs->packSector = sector;
+	fs->packFree = PROGRAM_SIZE(fs);
+	return requestCommit(fs);
+}
+
+/* Moves the records left in pack sector victim to the current pack sector,
+ * each the way a rewrite would, then drops victim. keep is a record about to
+ * be replaced, it stays and victim goes once it is deleted. */
+static int32_t packCompact(norFAT_FS* fs, uint32_t victim, uint32_t keep) {
+	int32_t ret;
+	uint32_t from, to, size, best;
+	uint32_t kept = 0;
+	uint32_t offset = PROGRAM_SIZE(fs);
+	norFAT_fileHeader fh;
+	_packRecord r;
+	_packRecord* p;
+	NORFAT_TRACE(("packCompact(%i)\r\n", victim));
+	while (1) {
+		if (readPackSector(fs, victim)) {
+			return NORFAT_ERR_IO;
+		}
+		p = packWalk(fs, &offset);
+		if (p == NULL) {
+			break;
+		}
+		memcpy(&r, p, sizeof(_packRecord));
+		from = packLoc(fs, victim, offset);
+		size = packRecordSize(fs, r.fh.fileLen);
+		offset += size;
+		if (r.state == NORFAT_PACK_DELETED) {
+			continue;
+		}
+		if (from == keep) {
+			kept = 1;
+			continue;
+		}
+		if (r.state == NORFAT_PACK_SHADOWED) {
+			//Only the file if nothing replaced it
+			if (!fileSearch(fs, (const char*)r.fh.fileName, &fh, &best, NULL, NULL) && fs->lastError == NORFAT_ERR_IO) {
+				return NORFAT_ERR_IO;
+			}
+			if (best != from) {
+				if (best != NORFAT_INVALID_SECTOR && packSetState(fs, from, NORFAT_PACK_DELETED)) {
+					return NORFAT_ERR_IO;
+				}
+				continue;
+			}
+		}
+		else if (packSetState(fs, from, NORFAT_PACK_SHADOWED)) {
+			return NORFAT_ERR_IO;
+		}
+		to = packLoc(fs, fs->packSector, fs->packFree);
+		if (readBlock(fs, fs->addressStart + (victim * SECTOR_SIZE(fs)) + locRecord(fs, from), fs->buff, size)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+		((_packRecord*)fs->buff)->state = NORFAT_PACK_LIVE;
+		if (programBlock(fs, fs->addressStart + (fs->packSector * SECTOR_SIZE(fs)) + fs->packFree,
+			fs->buff, size)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+		fs->packFree += size;
+		if (packSetState(fs, from, NORFAT_PACK_DELETED)) {
+			return NORFAT_ERR_IO;
+		}
+#if NORFAT_HASH_INDEX_SIZE
+		if (fs->indexState != NORFAT_INDEX_NONE) {
+			indexInsert(fs, r.fh.fileName, to);
+		}
+#endif
+	}
+	if (kept) {
+		return NORFAT_OK;
+	}
+	writeSector(fs, victim)->base &= NORFAT_GARBAGE_MASK;
+	ret = requestCommit(fs);
+	NORFAT_DEBUG(("Pack sector %i compacted\r\n", victim));
+	return ret;
+}
+
+/* Finds size bytes for a record in the current pack sector, another pack
+ * sector with room, or a new one. Pack sectors with nothing live are
+ * dropped on the way, and the one with the least live data is compacted
+ * into a new one when at most half of it is live. keep is the record
+ * about to be replaced. */
+static int32_t packPlace(norFAT_FS* fs, uint32_t size, uint32_t keep, uint32_t* loc) {
+	int32_t res;
+	uint32_t i, offset, live;
+	uint32_t dropped = 0;
+	uint32_t best = NORFAT_INVALID_SECTOR;
+	uint32_t bestFree = 0;
+	uint32_t victim = NORFAT_INVALID_SECTOR;
+	uint32_t victimLive = SECTOR_SIZE(fs);
+	_packRecord* r;
+	if (fs->packSector == NORFAT_INVALID_SECTOR || fs->packFree + size > SECTOR_SIZE(fs)) {
+		NORFAT_TRACE(("packPlace(%i):scan\r\n", size));
+		fs->packSector = NORFAT_INVALID_SECTOR;
+		for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+			if ((readSector(fs, i).base & NORFAT_SOF_MSK) != NORFAT_SOF_MATCH) {
+				continue;
+			}
+			res = matchHeader(fs, i, NORFAT_PACK_NAME);
+			if (res < 0) {
+				return res;
+			}
+			if (res == 0) {
+				continue;
+			}
+			if (readPackSector(fs, i)) {
+				return NORFAT_ERR_IO;
+			}
+			offset = PROGRAM_SIZE(fs);
+			live = 0;
+			while ((r = packWalk(fs, &offset)) != NULL) {
+				if (r->state != NORFAT_PACK_DELETED) {
+					live += packRecordSize(fs, r->fh.fileLen);
+				}
+				offset += packRecordSize(fs, r->fh.fileLen);
+			}
+			if (live == 0) {
+				NORFAT_TRACE(("packPlace:drop %i\r\n", i));
+				writeSector(fs, i)->base &= NORFAT_GARBAGE_MASK;
+				dropped = 1;
+			}
+			else if (offset + size <= SECTOR_SIZE(fs)) {
+				//Fill up the fullest one first
+				if (best == NORFAT_INVALID_SECTOR || offset > bestFree) {
+					best = i;
+					bestFree = offset;
+				}
+			}
+			else if (live < victimLive) {
+				victim = i;
+				victimLive = live;
+			}
+		}
+		if (dropped && (res = requestCommit(fs))) {
+			return res;
+		}
+		if (best != NORFAT_INVALID_SECTOR) {
+			fs->packSector = best;
+			fs->packFree = bestFree;
+		}
+		else {
+			res = packNewSector(fs);
+			if (res) {
+				return res;
+			}
+			//Moving more than half a sector costs more than it frees
+			if (victim != NORFAT_INVALID_SECTOR && victimLive * 2 <= SECTOR_SIZE(fs) - PROGRAM_SIZE(fs) &&
+				PROGRAM_SIZE(fs) + victimLive + size <= SECTOR_SIZE(fs)) {
+				res = packCompact(fs, victim, keep);
+				if (res) {
+					return res;
+				}
+			}
+		}
+	}
+	*loc = packLoc(fs, fs->packSector, fs->packFree);
+	fs->packFree += size;
+	return NORFAT_OK;
+}
+#endif
+
+/* Table swap, one flash operation per step: erase the old first copy a
+ * sector at a time, program the new first copy, erase the old second copy,
+ * then program the new second copy. Power loss between steps leaves the same
+ * flash states as one during a synchronous swap. Commits never run while a
+ * swap is pending, they finish it first.
+ */
+static int32_t beginSwap(norFAT_FS* fs) {
+#if NORFAT_FAT_CACHE_PAGES
+	uint32_t page;
+	uint32_t swap1new = (fs->firstFAT + 2) % TABLE_COUNT(fs);
+	uint8_t* data;
+	NORFAT_ASSERT(!fs->swapPending);
+	//The first table is erased first, pages spilled to it move to the new one
+	for (page = 0; page < tablePages(fs); page++) {
+		if (!isSpilled(fs, page)) {
+			continue;
+		}
+		data = cachedPage(fs, page);
+		if (!data) {
+			if (readTablePage(fs, fs->spillTable, page, fs->buff)) {
+				return NORFAT_ERR_IO;
+			}
+			if (fs->sweepPending) {
+				sweepPage(fs, page, fs->buff);
+			}
+			data = fs->buff;
+		}
+		if (programTablePage(fs, swap1new, page, data)) {
+			return NORFAT_ERR_IO;
+		}
+	}
+	fs->spillTable = swap1new;
+	fs->cacheTable = (fs->firstFAT + 1) % TABLE_COUNT(fs);
+#endif
+	fs->swapPending = 1;
+	return NORFAT_OK;
+}
+
+/* The new pair is programmed, the old one erased */
+static void endSwap(norFAT_FS* fs) {
+	fs->firstFAT += 2;
+	fs->firstFAT %= TABLE_COUNT(fs);
+	fs->swapPending = 0;
+	fs->swapStep = 0;
+	STATS_ADD(fs, swaps, 1);
+	NORFAT_TRACE(("swapStep:firstFat = %i\r\n", fs->firstFAT));
+	NORFAT_DEBUG(("_FAT tables now at %i %i\n",
+		fs->firstFAT, ((fs->firstFAT + 1) % TABLE_COUNT(fs))));
+}
+
+static int32_t swapStep(norFAT_FS* fs) {
+	uint32_t i;
+	uint32_t step = fs->swapStep;
+	uint32_t swap1old = fs->firstFAT;
+	uint32_t swap2old = (fs->firstFAT + 1) % TABLE_COUNT(fs);
+	uint32_t swap1new = (fs->firstFAT + 2) % TABLE_COUNT(fs);
+	uint32_t swap2new = (fs->firstFAT + 3) % TABLE_COUNT(fs);
+	NORFAT_ASSERT(fs->swapPending);
+	fs->cleanMarked = 0;
+	if (step < TABLE_SECTORS(fs)) {
+		//Erase #1 old block
+		NORFAT_TRACE(("swapStep:Erase[%i.%i]\r\n", swap1old, step));
+		if (eraseTableSector(fs, swap1old, step)) {
+			return NORFAT_ERR_IO;
+		}
+	}
+	else if (step == TABLE_SECTORS(fs)) {
+		//Program #1 new block, the table as it is now
+		fs->fat->swapCount++;
+		memset(fs->fat->commit, 0xFF, sizeof(_commit) * NORFAT_CRC_COUNT);
+		markDirty(fs, fs->fat, sizeof(_FAT));
+		updateTableCrc(fs, 0);
+		NORFAT_TRACE(("swapStep:Program[%i]\r\n", swap1new));
+#if NORFAT_FAT_CACHE_PAGES
+		if (programTable(fs, swap1new)) {
+			return NORFAT_ERR_IO;
+		}
+		//RAM matches the new table from here on
+		fs->sweepPending = 0;
+		fs->cacheTable = swap1new;
+#else
+		if (programBlock(fs, fs->addressStart +
+			(swap1new * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))),
+			(uint8_t*)fs->fat, (SECTOR_SIZE(fs) * TABLE_SECTORS(fs)))) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+#endif
+		clearDirty(fs);
+	}
+	else if (step <= TABLE_SECTORS(fs) * 2) {
+		//Erase #2 old block
+		NORFAT_TRACE(("swapStep:Erase[%i.%i]\r\n", swap2old, step - TABLE_SECTORS(fs) - 1));
+		if (eraseTableSector(fs, swap2old, step - TABLE_SECTORS(fs) - 1)) {
+			return NORFAT_ERR_IO;
+		}
+	}
+	else {
+		//Program #2 new block, from the first copy if RAM moved on since
+		NORFAT_TRACE(("swapStep:Program[%i]\r\n", swap2new));
+#if NORFAT_FAT_CACHE_PAGES
+		//RAM only holds part of the table
+		if (copyTable(fs, swap2new, swap1new)) {
+			return NORFAT_ERR_IO;
+		}
+#else
+		if (anyDirty(fs)) {
+			if (copyTable(fs, swap2new, swap1new)) {
+				return NORFAT_ERR_IO;
+			}
+		}
+		else if (programBlock(fs, fs->addressStart +
+			(swap2new * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))),
+			(uint8_t*)fs->fat, (SECTOR_SIZE(fs) * TABLE_SECTORS(fs)))) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+#endif
+		validateTable(fs, swap1new, &i);
+		endSwap(fs);
+		return NORFAT_OK;
+	}
+	fs->swapStep++;
+	return NORFAT_OK;
+}
+
+static int32_t finishSwap(norFAT_FS* fs) {
+	int32_t res;
+	while (fs->swapPending) {
+		res = swapStep(fs);
+		if (res) {
+			return res;
+		}
+	}
+	return NORFAT_OK;
+}
+
+#if NORFAT_FAT_CACHE_PAGES
+/* finishSwap for a table page lookup, once the new first table is
+ * programmed. The caller may be using fs->buff, so the second copy goes
+ * through the stack */
+static int32_t finishSwapInPlace(norFAT_FS* fs) {
+	uint8_t via[64];
+	NORFAT_ASSERT(fs->swapStep > TABLE_SECTORS(fs));
+	while (fs->swapStep <= TABLE_SECTORS(fs) * 2) {
+		if (swapStep(fs)) {
+			return NORFAT_ERR_IO;
+		}
+	}
+	if (copyTableVia(fs, fs->firstFAT + 3, fs->firstFAT + 2, via, sizeof(via))) {
+		return NORFAT_ERR_IO;
+	}
+	endSwap(fs);
+	return NORFAT_OK;
+}
+#endif
+
+static int commitChanges(norFAT_FS* fs, uint32_t forceSwap) {
+	uint32_t index = findCrcIndex(fs->fat);
+	NORFAT_TRACE(("commitChanges(%s)..\r\n", forceSwap ? "force" : ".."));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+	//Whatever a batch held back goes out with this commit
+	fs->batchPending = 0;
+	fs->cleanMarked = 0;
+	//Is current table set full?
+	if ((index == NORFAT_CRC_COUNT - 1 || forceSwap) && !fs->swapPending) {
+		if (beginSwap(fs)) {
+			return NORFAT_ERR_IO;
+		}
+	}
+	if (fs->swapPending) {
+		if (finishSwap(fs)) {
+			return NORFAT_ERR_IO;
+		}
+		//Changes made after the new table was programmed still need a commit
+		if (!anyDirty(fs)) {
+			STATS_ADD(fs, commits, 1);
+			return NORFAT_OK;
+		}
+		index = findCrcIndex(fs->fat);
+	}
+	NORFAT_DEBUG(("Committing _FAT tables %i %i\r\n", 
+		fs->firstFAT, ((fs->firstFAT + 1) % TABLE_COUNT(fs))));
+	//Prep for write
+	//CRC
+	NORFAT_ASSERT(index < NORFAT_CRC_COUNT - 1);
+	memset(&fs->fat->commit[index], 0, sizeof(_commit));
+	markDirty(fs, &fs->fat->commit[index], sizeof(_commit));
+	updateTableCrc(fs, index + 1);
+
+	//Bits only ever go 1 -> 0 between swaps, so the unchanged pages already match flash
+	NORFAT_TRACE(("commitChanges:Program[%i]\r\n", fs->firstFAT));
+	if (programDirtyPages(fs, fs->firstFAT)) {
+		return NORFAT_ERR_IO;
+	}
+	NORFAT_TRACE(("commitChanges:Program[%i]\r\n", fs->firstFAT + 1));
+	if (programDirtyPages(fs, fs->firstFAT + 1)) {
+		return NORFAT_ERR_IO;
+	}
+	clearDirty(fs);
+	STATS_ADD(fs, commits, 1);
+	NORFAT_TRACE(("commitChanges:firstFat = %i\r\n", fs->firstFAT, index + 1));
+	return NORFAT_OK;
+}
+
+/* Clean unmount marker: norfat_unmount writes the next commit entry without
+ * zeroing the previous one. Any later commit zeroes its predecessor or swaps
+ * tables, so two hex entries at the top of the commit list only survive
+ * while nothing has been committed since the unmount.
+ */
+static uint32_t isCleanMarked(_FAT* fat) {
+	uint32_t i;
+	uint32_t j = findCrcIndex(fat);
+	if (j == 0 || fat->commit[j].crc[0] == 0xFF) {
+		return 0;
+	}
+	for (i = 0; i < sizeof(_commit); i++) {
+		if (!isxdigit(fat->commit[j - 1].crc[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Header first mount, only valid after norfat_unmount. Reads the commit
+ * list of every table, and fully validates just the marked pair. Returns
+ * NORFAT_ERR_CORRUPT when the full mount has to run.
+ */
+static int32_t fastMount(norFAT_FS* fs) {
+	uint32_t i, pair = NORFAT_INVALID_SECTOR;
+	uint32_t crc;
+	int32_t res;
+	_FAT* fat = (_FAT*)fs->buff;
+	uint8_t clean[NORFAT_MAX_TABLES];
+	uint8_t marks[NORFAT_MAX_TABLES][sizeof(_commit)];
+	NORFAT_TRACE(("fastMount()\r\n"));
+	for (i = 0; i < TABLE_COUNT(fs); i++) {
+		if (readBlock(fs,
+			fs->addressStart + ((SECTOR_SIZE(fs) * TABLE_SECTORS(fs)) * i),
+			(uint8_t*)fat, sizeof(_commit) * NORFAT_CRC_COUNT)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+		clean[i] = isCleanMarked(fat);
+		memcpy(marks[i], &fat->commit[findCrcIndex(fat)], sizeof(_commit));
+	}
+	for (i = 0; i < TABLE_COUNT(fs); i++) {
+		if (clean[i] && clean[(i + 1) % TABLE_COUNT(fs)] &&
+			memcmp(marks[i], marks[(i + 1) % TABLE_COUNT(fs)], sizeof(_commit)) == 0) {
+			if (pair != NORFAT_INVALID_SECTOR) {
+				NORFAT_TRACE(("fastMount:ambiguous %i %i\r\n", pair, i));
+				return NORFAT_ERR_CORRUPT;
+			}
+			pair = i;
+		}
+	}
+	if (pair == NORFAT_INVALID_SECTOR) {
+		NORFAT_TRACE(("fastMount:not clean\r\n"));
+		return NORFAT_ERR_CORRUPT;
+	}
+	res = validateTable(fs, pair + 1, &crc);
+	if (res != NORFAT_TABLE_GOOD) {
+		return res == NORFAT_ERR_IO ? NORFAT_ERR_IO : NORFAT_ERR_CORRUPT;
+	}
+	res = loadTable(fs, pair);
+	if (res) {
+		return res == NORFAT_ERR_IO ? NORFAT_ERR_IO : NORFAT_ERR_CORRUPT;
+	}
+	fs->firstFAT = pair;
+	fs->cleanMarked = 1;
+	NORFAT_DEBUG(("FAT tables %i %i loaded from clean unmount\r\n", pair, (pair + 1) % TABLE_COUNT(fs)));
+	NORFAT_TRACE(("fastMount:pair %i\r\n", pair));
+	return NORFAT_OK;
+}
+
+uint32_t scenarioList[64];
+
+static int mountUnlocked(norFAT_FS* fs) {
+	int32_t i;
+	uint32_t ui;
+	int32_t empty = 1;
+	uint32_t scenario;
+	NORFAT_TRACE(("norfat_mount()..\r\n"));
+	NORFAT_ASSERT(fs->erase_block_sector);
+	NORFAT_ASSERT(fs->program_block_page);
+	NORFAT_ASSERT(fs->read_block_device);
+	NORFAT_ASSERT(fs->fat);
+	NORFAT_ASSERT(fs->buff);
+	//Configuration tests
+	NORFAT_ASSERT(SECTOR_SIZE(fs) == fs->sectorSize);//Static geometry must match
+	NORFAT_ASSERT(PROGRAM_SIZE(fs) == fs->programSize);
+	NORFAT_ASSERT(TABLE_SECTORS(fs) == fs->tableSectors);
+	NORFAT_ASSERT(TABLE_COUNT(fs) == fs->tableCount);
+	NORFAT_ASSERT(PROGRAM_SIZE(fs));
+	NORFAT_ASSERT(sizeof(norFAT_fileHeader) < PROGRAM_SIZE(fs));
+	NORFAT_ASSERT(TABLE_COUNT(fs) % 2 == 0);//Must be multiple of 2
+	NORFAT_ASSERT(TABLE_COUNT(fs) <= NORFAT_MAX_TABLES);//We don't want to dynamically allocate
+	NORFAT_TRACE(("Table Bytes = 0x%X\r\n", NORFAT_TABLE_BYTES(fs->flashSectors)));
+	NORFAT_ASSERT(//Assure that the total sectors fits in the configured sectors
+		NORFAT_TABLE_BYTES(fs->flashSectors) < TABLE_SECTORS(fs) * SECTOR_SIZE(fs));
+	NORFAT_ASSERT(fs->flashSectors <= NORFAT_EOF);//next must reach every sector, NORFAT_ENTRY_BITS
+	NORFAT_ASSERT(//Dirty page tracking is statically sized
+		(TABLE_SECTORS(fs) * SECTOR_SIZE(fs)) / PROGRAM_SIZE(fs) <= NORFAT_MAX_TABLE_PAGES);
+#if NORFAT_FAT_CACHE_PAGES
+	NORFAT_ASSERT(PROGRAM_SIZE(fs) % sizeof(_sector) == 0);//Entries never straddle a page
+#endif
+#if NORFAT_FREE_MAP_SECTORS
+	NORFAT_ASSERT(fs->flashSectors <= NORFAT_FREE_MAP_SECTORS);//Free map is statically sized
+#endif
+
+	fs->lastError = NORFAT_OK;
+	fs->batchDepth = 0;
+	fs->batchPending = 0;
+	fs->cleanMarked = 0;
+#if NORFAT_HASH_INDEX_SIZE
+	fs->indexState = NORFAT_INDEX_NONE;
+#endif
+#if NORFAT_PREERASE_POOL
+	fs->poolCount = 0;
+#endif
+#if NORFAT_PACK_THRESHOLD
+	fs->packSector = NORFAT_INVALID_SECTOR;
+#endif
+#if NORFAT_STREAM_BUFFER
+	//Streams left open are gone with the old mount
+	fs->streamPoolUsed = 0;
+#endif
+#if NORFAT_MAX_OPEN_FILES
+	for (i = 0; i < NORFAT_MAX_OPEN_FILES; i++) {
+		fs->fileFree[i] = (uint8_t)(NORFAT_MAX_OPEN_FILES - 1 - i);
+	}
+	fs->fileFreeCount = NORFAT_MAX_OPEN_FILES;
+#endif
+	fs->swapPending = 0;
+	fs->swapStep = 0;
+	/* Nothing was committed since a clean unmount, so there are
+	 * no repairs to make and no unclosed files to scan for */
+	int32_t fast = fastMount(fs);
+	if (fast == NORFAT_OK) {
+#if NORFAT_PREERASE_POOL
+		if (loadPool(fs)) {
+			return NORFAT_ERR_IO;
+		}
+		/* Pool sectors written since the last commit. The commit also
+		 * retires the clean marker, so mount fails with it */
+		if (scanTable(fs)) {
+			fast = commitChanges(fs, 1);
+			if (fast) {
+				return fast;
+			}
+		}
+#endif
+#if NORFAT_FREE_MAP_SECTORS
+		buildFreeMap(fs);
+#endif
+		fs->volumeMounted = 1;
+		NORFAT_TRACE(("norfat_mount:mounted clean\r\n"));
+		NORFAT_DEBUG(("Volume is mounted\r\n"));
+		return 0;
+	}
+	else if (fast == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+	uint32_t sectorState[NORFAT_MAX_TABLES];
+	uint32_t sectorCRC[NORFAT_MAX_TABLES];
+	/* Scan tables for valid records */
+	for (i = 0; i < (int32_t)TABLE_COUNT(fs); i++) {
+		sectorState[i] = validateTable(fs, i, &sectorCRC[i]);
+		if (sectorState[i] == NORFAT_TABLE_GOOD) {
+			empty = 0;
+		}
+		else if (sectorState[i] == NORFAT_ERR_IO) {
+			return NORFAT_ERR_IO;
+		}
+		//Check old state
+		//If Both sectors are good but crc's don't match, the odd number 
+		//was programmed prior to the current operation, and is the older.
+		if (i % 2 == 1) {
+			if (sectorState[i] == NORFAT_TABLE_GOOD &&
+				sectorState[i - 1] == NORFAT_TABLE_GOOD &&
+				sectorCRC[i] != sectorCRC[i - 1]) {
+				sectorState[i] = NORFAT_TABLE_OLD;
+			}
+		}
+	}
+	if (empty) {
+		NORFAT_TRACE(("norfat_mount:Volume empty\r\n"));
+		NORFAT_DEBUG(("Mounted volume is empty\r\n"));
+		fs->lastError = NORFAT_ERR_EMPTY;
+		return NORFAT_ERR_EMPTY;
+	}
+
+	/* There are 4 states, Good, old, empty, and bad 
+	 * Tables are kept in mirrored copies in even pairs
+	 * Like 0-1, 2-3, etc. We never attempt to do any
+	 * repairs to a presently valid table.
+	 */
+	uint32_t res;
+	uint32_t tablesValid = 0;
+#if NORFAT_FAT_CACHE_PAGES
+	memset(fs->fat, 0, headerPages(fs) * PROGRAM_SIZE(fs));
+	invalidateCache(fs);
+#else
+	memset(fs->fat, 0, TABLE_SECTORS(fs) * SECTOR_SIZE(fs));
+#endif
+
+	for (ui = 0; ui < TABLE_COUNT(fs); ui += 2) {
+		//Build a scenario
+		// |N|N|N|N|
+		scenario = sectorState[ui] << 12;
+		scenario += sectorState[(ui + 1) % TABLE_COUNT(fs)] << 8;
+		scenario += sectorState[(ui + 2) % TABLE_COUNT(fs)] << 4;
+		scenario += sectorState[(ui + 3) % TABLE_COUNT(fs)] << 0;
+		for (i = 0; i < 64; i++) {
+			if (scenarioList[i] == scenario || scenarioList[i] == 0) {
+				break;
+			}
+		}
+		if (i != 64) {
+			scenarioList[i] = scenario;
+		}
+		res = 0;
+		switch (scenario) {
+		case 0x0032:/* |EMPTY|EMPTY| BAD |GOOD | */
+			res = eraseTable(fs, (ui + 2) % TABLE_COUNT(fs));
+			if (res) {
+				return res;
+			}
+			res = loadTable(fs, ui);
+			if (res) {
+				return res;
+			}
+			fs->firstFAT = ui;
+			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
 		case 0x0033:/* |EMPTY|EMPTY| BAD | BAD | */
-			res = eraseTable(fs, (ui + 2) % fs->tableCount);
+			res = eraseTable(fs, (ui + 2) % TABLE_COUNT(fs));
 			if (res) {
 				return res;
 			}
-			res = eraseTable(fs, (ui + 3) % fs->tableCount);
+			res = eraseTable(fs, (ui + 3) % TABLE_COUNT(fs));
 			if (res) {
 				return res;
 			}
@@ -516,12 +2292,12 @@ int norfat_mount(norFAT_FS* fs) {
 				return res;
 			}
 			fs->firstFAT = ui;
-			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % fs->tableCount));
+			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
 		case 0x0023:/* |EMPTY|EMPTY|GOOD | BAD | */
-			res = eraseTable(fs, (ui + 3) % fs->tableCount);
+			res = eraseTable(fs, (ui + 3) % TABLE_COUNT(fs));
 			if (res) {
 				return res;
 			}
@@ -530,7 +2306,7 @@ int norfat_mount(norFAT_FS* fs) {
 				return res;
 			}
 			fs->firstFAT = ui;
-			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % fs->tableCount));
+			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
@@ -540,10 +2316,16 @@ int norfat_mount(norFAT_FS* fs) {
 				return res;
 			}
 			fs->firstFAT = ui;
-			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % fs->tableCount));
+			NORFAT_DEBUG(("FAT tables %i %i loaded\r\n", ui, (ui + 1) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
+		case 0x3032:/* | BAD |GOOD | BAD |EMPTY| (FAT cache spilled ahead of the swap) */
+			res = eraseTable(fs, (ui + 2) % TABLE_COUNT(fs));
+			if (res) {
+				return res;
+			}
+			/* fallthrough to finish up */
 		case 0x3022:/* | BAD |GOOD |EMPTY|EMPTY| (Re write table) */
 			res = loadTable(fs, ui + 1);
 			if (res) {
@@ -559,7 +2341,7 @@ int norfat_mount(norFAT_FS* fs) {
 				return res;
 			}
 			//NORFAT_ASSERT(validateTable(fs, ui, NULL) == NORFAT_OK);//TODO: TEST and remove
-			NORFAT_DEBUG(("FAT table %i rebuilt from %i\r\n", ui, (ui + 1) % fs->tableCount));
+			NORFAT_DEBUG(("FAT table %i rebuilt from %i\r\n", ui, (ui + 1) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
@@ -580,7 +2362,7 @@ int norfat_mount(norFAT_FS* fs) {
 				return res;
 			}
 			//NORFAT_ASSERT(validateTable(fs, ui, NULL) == NORFAT_OK);//TODO: TEST and remove
-			NORFAT_DEBUG(("FAT table %i rebuilt from %i\r\n", ui, (ui + 1) % fs->tableCount));
+			NORFAT_DEBUG(("FAT table %i rebuilt from %i\r\n", ui, (ui + 1) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
@@ -599,13 +2381,13 @@ int norfat_mount(norFAT_FS* fs) {
 			if (res) {
 				return res;
 			}
-			fs->firstFAT = (ui + 2) % fs->tableCount;
+			fs->firstFAT = (ui + 2) % TABLE_COUNT(fs);
 			res = copyTable(fs, ui + 3, ui + 2);
 			if (res) {
 				return res;
 			}
 			NORFAT_DEBUG(("FAT table %i updated from %i\r\n", 
-				(ui + 3) % fs->tableCount, (ui + 2) % fs->tableCount));
+				(ui + 3) % TABLE_COUNT(fs), (ui + 2) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
@@ -620,13 +2402,13 @@ int norfat_mount(norFAT_FS* fs) {
 			if (res) {
 				return res;
 			}
-			fs->firstFAT = (ui + 2) % fs->tableCount;
+			fs->firstFAT = (ui + 2) % TABLE_COUNT(fs);
 			res = copyTable(fs, ui + 3, ui + 2);
 			if (res) {
 				return res;
 			}
 			NORFAT_DEBUG(("FAT table %i updated from %i\r\n", 
-				(ui + 3) % fs->tableCount, (ui + 2) % fs->tableCount));
+				(ui + 3) % TABLE_COUNT(fs), (ui + 2) % TABLE_COUNT(fs)));
 			NORFAT_TRACE(("norfat_mount:0x%04X|ui %i\r\n", scenario, ui));
 			tablesValid = 1;
 			break;
@@ -635,6 +2417,7 @@ int norfat_mount(norFAT_FS* fs) {
 		case 0x2220:
 		case 0x2230:
 		case 0x3220:
+		case 0x3230:
 		case 0x0220:
 		case 0x0221:
 		case 0x0223:
@@ -671,7 +2454,7 @@ int norfat_mount(norFAT_FS* fs) {
 	/* If there are any valid tables left, use them */
 	/* Fallback, last ditch recovery effort */
 	if (!tablesValid) {
-		for (ui = 0; ui < fs->tableCount; ui += 2) {
+		for (ui = 0; ui < TABLE_COUNT(fs); ui += 2) {
 			if (sectorState[ui] == NORFAT_TABLE_GOOD) {
 				res = loadTable(fs, ui);
 				if (res) {
@@ -687,7 +2470,7 @@ int norfat_mount(norFAT_FS* fs) {
 					return res;
 				}
 				NORFAT_DEBUG(("FAT table %i updated from %i\r\n",
-					(ui + 1) % fs->tableCount, ui));
+					(ui + 1) % TABLE_COUNT(fs), ui));
 				NORFAT_TRACE(("norfat_mount:reco ui %i\r\n", ui));
 				tablesValid = 1;
 			}
@@ -717,7 +2500,7 @@ int norfat_mount(norFAT_FS* fs) {
 	}
 
 	if (!tablesValid) {
-		for (ui = 0; ui < fs->tableCount; ui += 2) {
+		for (ui = 0; ui < TABLE_COUNT(fs); ui += 2) {
 			if (sectorState[ui] == NORFAT_TABLE_OLD) {
 				res = loadTable(fs, ui);
 				if (res) {
@@ -733,7 +2516,7 @@ int norfat_mount(norFAT_FS* fs) {
 					return res;
 				}
 				NORFAT_DEBUG(("FAT table %i updated from %i\r\n",
-					(ui + 1) % fs->tableCount, ui));
+					(ui + 1) % TABLE_COUNT(fs), ui));
 				NORFAT_TRACE(("norfat_mount:recold ui %i\r\n", ui));
 				tablesValid = 1;
 			}
@@ -767,37 +2550,94 @@ int norfat_mount(norFAT_FS* fs) {
 		fs->lastError = NORFAT_ERR_CORRUPT;
 		return NORFAT_ERR_CORRUPT;
 	}
+#if NORFAT_FAT_CACHE_PAGES
+	//The pair matches whichever table it was loaded from
+	fs->cacheTable = fs->firstFAT;
+	fs->spillTable = fs->firstFAT;
+#endif
+#if NORFAT_PREERASE_POOL
+	if (loadPool(fs)) {
+		return NORFAT_ERR_IO;
+	}
+#endif
 	/* scan for unclosed files */
-	if (scanTable(fs, fs->fat)) {
+	if (scanTable(fs)) {
 		commitChanges(fs, 1);
 		NORFAT_DEBUG(("Tables repaired\r\n"));
 		NORFAT_TRACE(("norfat_mount:tables repaired\r\n"));
 	}
+#if NORFAT_FREE_MAP_SECTORS
+	buildFreeMap(fs);
+#endif
 	fs->volumeMounted = 1;
 	NORFAT_TRACE(("norfat_mount:mounted\r\n"));
 	NORFAT_DEBUG(("Volume is mounted\r\n"));
 	return 0;
 }
 
-int norfat_format(norFAT_FS* fs) {
-	uint32_t i, j;
+static int unmountUnlocked(norFAT_FS* fs) {
+	uint32_t i;
+	uint32_t index;
+	int32_t res = NORFAT_OK;
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_TRACE(("norfat_unmount()\r\n"));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		res = NORFAT_ERR_IO;
+		goto finalize;
+	}
+	if (fs->batchPending || fs->swapPending) {
+		res = commitChanges(fs, 0);
+		if (res) {
+			goto finalize;
+		}
+	}
+	index = findCrcIndex(fs->fat);
+	if (fs->cleanMarked || index >= NORFAT_CRC_COUNT - 1) {
+		goto finalize;
+	}
+	//Files still open for writing must be recovered on the next mount
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+		if (readSector(fs, i).write && !readSector(fs, i).available && !inPool(fs, i)) {
+			NORFAT_TRACE(("norfat_unmount:sector %i open\r\n", i));
+			goto finalize;
+		}
+	}
+	updateTableCrc(fs, index + 1);
+	if (programDirtyPages(fs, fs->firstFAT) || programDirtyPages(fs, fs->firstFAT + 1)) {
+		res = NORFAT_ERR_IO;
+		goto finalize;
+	}
+	clearDirty(fs);
+	fs->cleanMarked = 1;
+	NORFAT_DEBUG(("Volume unmounted clean\r\n"));
+finalize:
+	fs->batchDepth = 0;
+	fs->volumeMounted = 0;
+	NORFAT_TRACE(("norfat_unmount:%i\r\n", res));
+	return res;
+}
+
+static int formatUnlocked(norFAT_FS* fs) {
+	uint32_t i, j, size;
 	//uint8_t cr[9];
 	//uint32_t crcRes;
 	int32_t res;
 	NORFAT_ASSERT(fs);
 	NORFAT_TRACE(("norfat_format()\r\n"));
-	for (i = 0; i < fs->tableCount; i++) {
-		if (fs->read_block_device(
-			fs->addressStart + (i * (fs->sectorSize * fs->tableSectors)),
-			fs->buff, (fs->sectorSize * fs->tableSectors))) {
-			return NORFAT_ERR_IO;
-		}
-		for (j = 0; j < (fs->sectorSize * fs->tableSectors); j++) {
-			if (fs->buff[j] != 0xFF) {
+	for (i = 0; i < TABLE_COUNT(fs); i++) {
+		for (j = 0; j < TABLE_SECTORS(fs); j++) {
+			if (readBlock(fs,
+				fs->addressStart + (i * (SECTOR_SIZE(fs) * TABLE_SECTORS(fs))) + (j * SECTOR_SIZE(fs)),
+				fs->buff, SECTOR_SIZE(fs))) {
+				return NORFAT_ERR_IO;
+			}
+			if (!norfat_k_blank(fs->buff, SECTOR_SIZE(fs))) {
 				break;
 			}
 		}
-		if (j != (fs->sectorSize * fs->tableSectors)) {
+		if (j != TABLE_SECTORS(fs)) {
 			res = eraseTable(fs, i);
 			if (res) {
 				return res;
@@ -805,30 +2645,40 @@ int norfat_format(norFAT_FS* fs) {
 		}
 	}
 	/* Build up an initial _FAT on the first two sectors */
-	memset(fs->fat, 0xFF, (fs->sectorSize * fs->tableSectors));
+#if NORFAT_FAT_CACHE_PAGES
+	//The erased table 0 reads back as the rest of it
+	invalidateCache(fs);
+	fs->cacheTable = 0;
+	fs->spillTable = 0;
+	size = headerPages(fs) * PROGRAM_SIZE(fs);
+#else
+	size = SECTOR_SIZE(fs) * TABLE_SECTORS(fs);
+#endif
+	memset(fs->fat, 0xFF, size);
 	fs->fat->garbageCount = 0;
 	fs->fat->swapCount = 0;
+	rebuildTableCrc(fs);
 	updateTableCrc(fs, 0);
 	//crcRes = NORFAT_CRC(&fs->fat->commit[1], NORFAT_TABLE_BYTES(fs->flashSectors) - sizeof(_commit), 0xFFFFFFFF);
 	//snprintf(cr, 9, "%08X", crcRes);
 	//memcpy(&fs->fat->commit[0], cr, 8);
-	if (fs->program_block_page(fs->addressStart, (uint8_t*)fs->fat,
-		(fs->sectorSize * fs->tableSectors))) {
+	if (programBlock(fs, fs->addressStart, (uint8_t*)fs->fat, size)) {
 		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 		return NORFAT_ERR_IO;
 	}
-	if (fs->program_block_page((fs->sectorSize * fs->tableSectors) + fs->addressStart,
-		(uint8_t*)fs->fat, (fs->sectorSize * fs->tableSectors))) {
+	if (programBlock(fs, (SECTOR_SIZE(fs) * TABLE_SECTORS(fs)) + fs->addressStart,
+		(uint8_t*)fs->fat, size)) {
 		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 		return NORFAT_ERR_IO;
 	}
 	fs->firstFAT = 0;
+	clearDirty(fs);
 	//NORFAT_DEBUG(("Volume formatted crc 0x%X\r\n", crcRes));
 	NORFAT_TRACE(("FORMAT:done\r\n"));
 	return 0;
 }
 
-int norfat_fsinfo(norFAT_FS* fs) {
+static int fsinfoUnlocked(norFAT_FS* fs) {
 	NORFAT_ASSERT(fs);
 	NORFAT_ASSERT(fs->volumeMounted);
 	uint32_t i;
@@ -836,23 +2686,48 @@ int norfat_fsinfo(norFAT_FS* fs) {
 	uint32_t bytesUsed = 0;
 	uint32_t bytesUncollected = 0;
 	uint32_t bytesAvailable = 0;
+	uint32_t bytesErased = 0;
 	uint32_t fileCount = 0;
-	uint32_t tableOverhead = (fs->tableSectors * fs->tableCount * fs->sectorSize);
+	uint32_t tableOverhead = (TABLE_SECTORS(fs) * TABLE_COUNT(fs) * SECTOR_SIZE(fs));
 	norFAT_fileHeader f;
 	struct tm ts;
 	time_t now;
 	uint8_t buf[32];
 	NORFAT_INFO_PRINT(("\r\nnorFAT Version %s\r\n", NORFAT_VERSION));
 	NORFAT_INFO_PRINT(("\r\nVolume info:Capacity %9i\r\n",
-		(fs->flashSectors * fs->sectorSize) - tableOverhead));
-	for (i = (fs->tableCount * fs->tableSectors); i < fs->flashSectors; i++) {
-		if ((fs->fat->sector[i].base & NORFAT_SOF_MSK) == NORFAT_SOF_MATCH) {
-			if (fs->read_block_device(fs->addressStart + (i * fs->sectorSize),
+		(fs->flashSectors * SECTOR_SIZE(fs)) - tableOverhead));
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+		if ((readSector(fs, i).base & NORFAT_SOF_MSK) == NORFAT_SOF_MATCH) {
+			if (readBlock(fs, fs->addressStart + (i * SECTOR_SIZE(fs)),
 				fs->buff, sizeof(norFAT_fileHeader))) {
 				return NORFAT_ERR_IO;
 			}
 			
+#if NORFAT_PACK_THRESHOLD
+			if (sameName(fs->buff, NORFAT_PACK_NAME)) {
+				uint32_t offset = PROGRAM_SIZE(fs);
+				_packRecord* r;
+				if (readPackSector(fs, i)) {
+					return NORFAT_ERR_IO;
+				}
+				while ((r = packWalk(fs, &offset)) != NULL) {
+					if (r->state != NORFAT_PACK_DELETED) {
+						now = (time_t)r->fh.timeStamp;
+						ts = *localtime(&now);
+						strftime((char*)buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &ts);
+						NORFAT_INFO_PRINT(("%s  %9i %s (packed)\r\n", buf, (int)r->fh.fileLen, r->fh.fileName));
+						bytesUsed += r->fh.fileLen;
+						fileCount++;
+					}
+					offset += packRecordSize(fs, r->fh.fileLen);
+				}
+				continue;
+			}
+#endif
 			memcpy(&f, fs->buff, sizeof(norFAT_fileHeader));
+			if (readAppendRecords(fs, i, &f, NULL)) {
+				return NORFAT_ERR_IO;
+			}
 			now = (time_t)f.timeStamp;
 			ts = *localtime(&now);
 			strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &ts);
@@ -860,13 +2735,17 @@ int norfat_fsinfo(norFAT_FS* fs) {
 			bytesUsed += f.fileLen;
 			fileCount++;
 		}
-		else if (fs->fat->sector[i].available) {
-			bytesAvailable += fs->sectorSize;
-			bytesFree += fs->sectorSize;
+		else if (readSector(fs, i).available) {
+			bytesAvailable += SECTOR_SIZE(fs);
+			bytesFree += SECTOR_SIZE(fs);
 		}
-		else if (!fs->fat->sector[i].active) {
-			bytesUncollected += fs->sectorSize;
-			bytesFree += fs->sectorSize;
+		else if (!readSector(fs, i).active) {
+			bytesUncollected += SECTOR_SIZE(fs);
+			bytesFree += SECTOR_SIZE(fs);
+		}
+		else if (inPool(fs, i)) {
+			bytesErased += SECTOR_SIZE(fs);
+			bytesFree += SECTOR_SIZE(fs);
 		}
 		else {
 
@@ -875,13 +2754,233 @@ int norfat_fsinfo(norFAT_FS* fs) {
 	NORFAT_INFO_PRINT(("     Files    %9i\r\n", fileCount));
 	NORFAT_INFO_PRINT(("     Used     %9i\r\n", bytesUsed));
 	NORFAT_INFO_PRINT(("     Free     %9i\r\n", bytesFree));
+	NORFAT_INFO_PRINT(("     Erased   %9i\r\n", bytesErased));
 
 	NORFAT_INFO_PRINT(("     Swaps %i\r\n", fs->fat->swapCount));
 	NORFAT_INFO_PRINT(("     Garbage %i\r\n", fs->fat->garbageCount));
+#if NORFAT_FAT_CACHE_PAGES
+	NORFAT_INFO_PRINT(("     Cache hits %u misses %u spills %u\r\n",
+		(unsigned)fs->cacheHits, (unsigned)fs->cacheMisses, (unsigned)fs->cacheSpills));
+#endif
 	return 0;
 }
 
-norfat_FILE* norfat_fopen(norFAT_FS* fs, const char* filename, const char* mode) {
+/* Append by copying the old contents into a new chain, same as "w" followed
+ * by writing the file back. Used when the header page has no record left,
+ * or the tail of the last sector is not blank after a failed append. */
+static int32_t appendRewrite(norFAT_FS* fs, norfat_FILE* stream) {
+	uint32_t n;
+	uint8_t* chunk;
+	norfat_FILE rd;
+	NORFAT_TRACE(("appendRewrite(%i)\r\n", stream->oldFileSector));
+	memset(&rd, 0, sizeof(norfat_FILE));
+	rd.fh = stream->fh;
+	rd.startSector = rd.currentSector = stream->oldFileSector;
+	rd.rwPosInSector = PROGRAM_SIZE(fs);
+#if NORFAT_PACK_THRESHOLD
+	if (stream->oldPack != NORFAT_INVALID_SECTOR) {
+		rd.startSector = rd.currentSector = locSector(fs, stream->oldPack);
+		rd.rwPosInSector = locRecord(fs, stream->oldPack) + sizeof(_packRecord);
+	}
+#endif
+	rd.dataStart = rd.rwPosInSector;
+	rd.openFlags = NORFAT_FLAG_READ;
+	chunk = NORFAT_MALLOC(PROGRAM_SIZE(fs));
+	if (!chunk) {
+		fs->lastError = NORFAT_ERR_MALLOC;
+		return NORFAT_ERR_MALLOC;
+	}
+	while ((n = freadUnlocked(fs, chunk, 1, PROGRAM_SIZE(fs), &rd)) > 0) {
+		if (fwriteUnlocked(fs, chunk, 1, n, stream) != n) {
+			break;
+		}
+	}
+	NORFAT_FREE(chunk);
+	if (rd.position != stream->fh->fileLen || stream->position != rd.position) {
+		stream->error = 1;
+		return fs->lastError ? fs->lastError : NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+
+/* Positions a write stream at the end of the file in oldFileSector, to
+ * continue in the erased tail of its last sector */
+static int32_t openAppend(norFAT_FS* fs, norfat_FILE* stream) {
+	uint32_t slot;
+	uint32_t last;
+	uint32_t sector = stream->oldFileSector;
+	uint32_t rawEnd = stream->fh->fileLen + PROGRAM_SIZE(fs);
+	uint32_t capacity;
+#if NORFAT_PACK_THRESHOLD
+	if (stream->oldPack != NORFAT_INVALID_SECTOR) {
+		return appendRewrite(fs, stream);
+	}
+#endif
+	if (readAppendRecords(fs, sector, stream->fh, &slot)) {
+		return NORFAT_ERR_IO;
+	}
+	capacity = chainCapacity(fs, sector, &last);
+	stream->rwPosInSector = rawEnd - (((rawEnd - 1) / SECTOR_SIZE(fs)) * SECTOR_SIZE(fs));
+	if (slot == appendSlots(fs) || stream->fh->fileLen > capacity ||
+		capacity - stream->fh->fileLen >= SECTOR_SIZE(fs)) {
+		return appendRewrite(fs, stream);
+	}
+	//Data from an append that never got its record
+	if (readBlock(fs, fs->addressStart + (last * SECTOR_SIZE(fs)) + stream->rwPosInSector,
+		fs->buff, SECTOR_SIZE(fs) - stream->rwPosInSector)) {
+		fs->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	if (!norfat_k_blank(fs->buff, SECTOR_SIZE(fs) - stream->rwPosInSector)) {
+		return appendRewrite(fs, stream);
+	}
+	stream->openFlags |= NORFAT_FLAG_APPEND;
+	stream->startSector = sector;
+	stream->currentSector = last;
+	stream->position = stream->fh->fileLen;
+	stream->oldFileSector = NORFAT_FILE_NOT_FOUND;
+	stream->appendLast = last;
+	stream->appendSlot = slot;
+#if NORFAT_PACK_THRESHOLD
+	stream->packing = 0;
+#endif
+#if NORFAT_WRITE_BUFFER
+	//Programmed over the bytes already in the tail page
+	memset(stream->wbuf, 0xFF, PROGRAM_SIZE(fs));
+#endif
+	NORFAT_DEBUG(("Appending at sector %i offset %i\r\n", last, stream->rwPosInSector));
+	return NORFAT_OK;
+}
+
+#if NORFAT_STREAM_BUFFER
+#define NORFAT_IOBUF_USER	0
+#define NORFAT_IOBUF_POOL	1
+#define NORFAT_IOBUF_HEAP	2
+
+/* A free streamPool buffer, or one from the heap. NULL leaves the stream
+ * on fs->buff */
+static void takeStreamBuffer(norFAT_FS* fs, norfat_FILE* stream) {
+	uint32_t i;
+	NORFAT_ASSERT(NORFAT_STREAM_BUFFER % PROGRAM_SIZE(fs) == 0);
+	for (i = 0; i < fs->streamBuffers && i < 32; i++) {
+		if (!(fs->streamPoolUsed & (1u << i))) {
+			fs->streamPoolUsed |= 1u << i;
+			stream->iobuf = &fs->streamPool[i * NORFAT_STREAM_BUFFER];
+			stream->iobufFrom = NORFAT_IOBUF_POOL;
+			return;
+		}
+	}
+	stream->iobuf = NORFAT_MALLOC(NORFAT_STREAM_BUFFER);
+	stream->iobufFrom = NORFAT_IOBUF_HEAP;
+}
+
+static void releaseStreamBuffer(norFAT_FS* fs, norfat_FILE* stream) {
+	if (!stream->iobuf) {
+		return;
+	}
+	if (stream->iobufFrom == NORFAT_IOBUF_POOL) {
+		fs->streamPoolUsed &= ~(1u << ((stream->iobuf - fs->streamPool) / NORFAT_STREAM_BUFFER));
+	}
+	else if (stream->iobufFrom == NORFAT_IOBUF_HEAP) {
+		NORFAT_FREE(stream->iobuf);
+	}
+	stream->iobuf = NULL;
+}
+#endif
+
+#if NORFAT_ASYNC_PROGRAM
+/* Waits for the program norfat_fwrite submitted, a failed one counts as
+ * any other program error against the volume and its stream */
+static int32_t asyncWait(norFAT_FS* fs) {
+	uint32_t status;
+	norfat_FILE* stream;
+	while (fs->asyncBusy) {
+		if (fs->program_poll) {
+			status = fs->program_poll();
+			if (status != 1) {
+				fs->asyncStatus = status;
+				fs->asyncBusy = 0;
+				break;
+			}
+		}
+		if (fs->async_yield) {
+			fs->async_yield();
+		}
+	}
+	stream = fs->asyncStream;
+	fs->asyncStream = NULL;
+	if (fs->asyncStatus) {
+		fs->asyncStatus = 0;
+		NORFAT_TRACE(("asyncWait:NORFAT_ERR_IO\r\n"));
+		if (stream) {
+			stream->lastError = NORFAT_ERR_IO;
+		}
+		fs->lastError = NORFAT_ERR_IO;
+		return NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+
+/* Starts programming data once the previous program is done, data must
+ * stay as it is until the next asyncWait */
+static int32_t asyncSubmit(norFAT_FS* fs, norfat_FILE* stream, uint32_t blockAddress, uint8_t* data, uint32_t length) {
+	if (asyncWait(fs)) {
+		return NORFAT_ERR_IO;
+	}
+	NORFAT_TRACE(("asyncSubmit(0x%X)(%i)\r\n", blockAddress, length));
+	fs->asyncStream = stream;
+	fs->asyncBusy = 1;
+	if (submitBlock(fs, fs->addressStart + blockAddress, data, length)) {
+		fs->asyncBusy = 0;
+		fs->asyncStream = NULL;
+		fs->lastError = stream->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+#else
+#define asyncWait(fs) NORFAT_OK
+#endif
+
+/* Streams come from fs->filePool when NORFAT_MAX_OPEN_FILES is set, the
+ * heap otherwise. The header is kept inside the stream either way */
+static norfat_FILE* newStream(norFAT_FS* fs) {
+	norfat_FILE* stream;
+#if NORFAT_MAX_OPEN_FILES
+	if (!fs->fileFreeCount) {
+		return NULL;
+	}
+	stream = &fs->filePool[fs->fileFree[--fs->fileFreeCount]];
+#else
+	stream = NORFAT_MALLOC(sizeof(norfat_FILE));
+	if (!stream) {
+		return NULL;
+	}
+#endif
+	memset(stream, 0, sizeof(norfat_FILE));
+	stream->fh = &stream->header;
+	return stream;
+}
+
+static void freeStream(norFAT_FS* fs, norfat_FILE* stream) {
+#if NORFAT_MAX_OPEN_FILES
+	uint32_t slot = (uint32_t)(stream - fs->filePool);
+	NORFAT_ASSERT(slot < NORFAT_MAX_OPEN_FILES);
+	NORFAT_ASSERT(fs->fileFreeCount < NORFAT_MAX_OPEN_FILES);
+	fs->fileFree[fs->fileFreeCount++] = (uint8_t)slot;
+#else
+#if NORFAT_PACK_THRESHOLD
+	if (stream->pack) {
+		NORFAT_FREE(stream->pack);
+	}
+#endif
+	NORFAT_FREE(stream);
+#endif
+}
+
+static norfat_FILE* fopenUnlocked(norFAT_FS* fs, const char* filename, const char* mode) {
 	uint32_t sector;
 	uint32_t flags;
 	NORFAT_ASSERT(fs);
@@ -897,36 +2996,55 @@ norfat_FILE* norfat_fopen(norFAT_FS* fs, const char* filename, const char* mode)
 	else if (strcmp("rb", mode) == 0) {
 		flags = NORFAT_FLAG_READ;
 	}
+	else if (strcmp("rz", mode) == 0 || strcmp("rbz", mode) == 0) {
+		flags = NORFAT_FLAG_READ | NORFAT_FLAG_ZERO_COPY;
+	}
 	else if (strcmp("w", mode) == 0) {
 		flags = NORFAT_FLAG_WRITE;
 	}
 	else if (strcmp("wb", mode) == 0) {
 		flags = NORFAT_FLAG_WRITE;
 	}
+	else if (strcmp("a", mode) == 0 || strcmp("ab", mode) == 0) {
+		flags = NORFAT_FLAG_WRITE | NORFAT_FLAG_APPEND;
+	}
 	else {
 		fs->lastError = NORFAT_ERR_UNSUPPORTED;
 		NORFAT_TRACE(("norfat_fopen:unsupported\r\n"));
 		return NULL;
 	}
-	norFAT_fileHeader* f = fileSearch(fs, filename, &sector);
+	uint32_t stale, staleRecord;
+	norFAT_fileHeader fh;
+	uint32_t found = fileSearch(fs, filename, &fh, &sector, &stale, &staleRecord);
 	norfat_FILE* file;
 	if (flags & NORFAT_FLAG_READ) {
-		if (f) {
-			file = NORFAT_MALLOC(sizeof(norfat_FILE));
+		if (found) {
+			file = newStream(fs);
 			if (!file) {
 				fs->lastError = NORFAT_ERR_MALLOC;
 				NORFAT_TRACE(("NORFAT_ERR_MALLOC\r\n"));
 				return NULL;
 			}
-			memset(file, 0, sizeof(norfat_FILE));
-			file->fh = f;
+			file->header = fh;
 			file->startSector = sector;
 			file->currentSector = sector;
-			file->rwPosInSector = fs->programSize;
+			file->rwPosInSector = PROGRAM_SIZE(fs);
+#if NORFAT_PACK_THRESHOLD
+			if (isPacked(sector)) {
+				file->startSector = file->currentSector = locSector(fs, sector);
+				file->rwPosInSector = locRecord(fs, sector) + sizeof(_packRecord);
+			}
+#endif
+			file->dataStart = file->rwPosInSector;
 			file->openFlags = flags;
 			if (flags & NORFAT_FLAG_ZERO_COPY) {
 				file->zeroCopy = 1;
 			}
+#if NORFAT_STREAM_BUFFER && !NORFAT_DIRECT_READ
+			if (!file->zeroCopy) {
+				takeStreamBuffer(fs, file);
+			}
+#endif
 			NORFAT_TRACE(("norfat_fopen:file opened for reading\r\n"));
 			NORFAT_DEBUG(("FILE %s opened for reading\r\n", filename));
 			return file;
@@ -941,44 +3059,85 @@ norfat_FILE* norfat_fopen(norFAT_FS* fs, const char* filename, const char* mode)
 		}
 	}
 	else if (flags & NORFAT_FLAG_WRITE) {
-		if (f == NULL &&
+		if (!found &&
 			sector == NORFAT_INVALID_SECTOR &&
 			fs->lastError == NORFAT_ERR_IO) {
 			NORFAT_TRACE(("norfat_fopen:failed\r\n"));
 			return NULL;
 		}
-		file = NORFAT_MALLOC(sizeof(norfat_FILE));
+		file = newStream(fs);
 		if (!file) {
 			fs->lastError = NORFAT_ERR_MALLOC;
 			NORFAT_TRACE(("NORFAT_ERR_MALLOC\r\n"));
-			if (f) {
-				NORFAT_FREE(f);
-			}
 			return NULL;
 		}
-		memset(file, 0, sizeof(norfat_FILE));
 		file->oldFileSector = NORFAT_FILE_NOT_FOUND;
 		file->startSector = NORFAT_INVALID_SECTOR;
-		file->openFlags = flags;
+		file->openFlags = flags & ~NORFAT_FLAG_APPEND;
 		file->currentSector = -1;
-		if (f) {
-			file->fh = f;
+		file->appendLast = NORFAT_INVALID_SECTOR;
+		file->appendNext = NORFAT_INVALID_SECTOR;
+		file->dataStart = PROGRAM_SIZE(fs);
+#if NORFAT_PACK_THRESHOLD
+		file->oldPack = NORFAT_INVALID_SECTOR;
+		file->staleRecord = staleRecord;
+		if (isPacked(sector)) {
+			//A sector file left next to it goes as well
+			file->oldPack = sector;
+			sector = stale;
+		}
+#endif
+		if (found) {
+			file->header = fh;
 			file->oldFileSector = sector;//Mark for removal
-			NORFAT_ASSERT(sector >= fs->tableCount);
+#if NORFAT_ELIDE_UNCHANGED
+			file->oldCrc = fh.crc;
+#endif
+			NORFAT_ASSERT(sector >= TABLE_COUNT(fs));
 			NORFAT_DEBUG(("Sector %i marked for removal\r\n", sector));
 			NORFAT_TRACE(("norfat_fopen:sector[%i] marked to remove\r\n", sector));
 		}
 		else {
-			file->fh = NORFAT_MALLOC(sizeof(norFAT_fileHeader));
-			if (!file->fh) {
-				fs->lastError = NORFAT_ERR_MALLOC;
-				NORFAT_TRACE(("NORFAT_ERR_MALLOC\r\n"));
-				NORFAT_FREE(file);
-				return NULL;
-			}
-			memset(file->fh, 0, sizeof(norFAT_fileHeader));
 			strncpy(file->fh->fileName, filename, 32);
 		}
+#if NORFAT_STREAM_BUFFER
+		takeStreamBuffer(fs, file);
+#endif
+#if NORFAT_WRITE_BUFFER
+#if NORFAT_STREAM_BUFFER
+		//Whole page writes never leave anything in wbuf, so it can share
+		file->wbuf = file->iobuf;
+#endif
+		if (!file->wbuf) {
+			file->wbuf = NORFAT_MALLOC(PROGRAM_SIZE(fs));
+		}
+		if (!file->wbuf) {
+			fs->lastError = NORFAT_ERR_MALLOC;
+			NORFAT_TRACE(("NORFAT_ERR_MALLOC\r\n"));
+#if NORFAT_STREAM_BUFFER
+			releaseStreamBuffer(fs, file);
+#endif
+			freeStream(fs, file);
+			return NULL;
+		}
+#endif
+#if NORFAT_PACK_THRESHOLD
+		//Without the buffer (or in a batch) it is written as a sector file
+		if (!fs->batchDepth) {
+#if NORFAT_MAX_OPEN_FILES
+			file->pack = fs->packPool[file - fs->filePool];
+#else
+			file->pack = NORFAT_MALLOC(NORFAT_PACK_THRESHOLD);
+#endif
+			file->packing = file->pack != NULL;
+		}
+#endif
+		if (found && (flags & NORFAT_FLAG_APPEND) && openAppend(fs, file)) {
+			NORFAT_TRACE(("norfat_fopen:append failed\r\n"));
+			file->error = 1;//Leaves the old file alone
+			fcloseUnlocked(fs, file);
+			return NULL;
+		}
 		NORFAT_TRACE(("norfat_fopen:file opened for writing\r\n"));
 		NORFAT_DEBUG(("FILE %s opened for writing\r\n", filename));
 		return file;
@@ -988,7 +3147,288 @@ norfat_FILE* norfat_fopen(norFAT_FS* fs, const char* filename, const char* mode)
 	return NULL;
 }
 
-int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream) {
+static int32_t programAppendRecord(norFAT_FS* fs, norfat_FILE* stream) {
+	_appendRecord* r;
+	if (stream->position == stream->fh->fileLen) {
+		return NORFAT_OK;
+	}
+	//Whole header page, 0xFF leaves everything but the record as it is
+	memset(fs->buff, 0xFF, PROGRAM_SIZE(fs));
+	r = (_appendRecord*)&fs->buff[sizeof(norFAT_fileHeader) + (stream->appendSlot * sizeof(_appendRecord))];
+	r->fileLen = stream->fh->fileLen = stream->position;
+	r->timeStamp = stream->fh->timeStamp = (uint32_t)time(NULL);
+	r->crc = stream->fh->crc;
+	r->check = appendRecordCrc(r);
+	NORFAT_TRACE(("programAppendRecord(%i,%i)\r\n", stream->appendSlot, r->fileLen));
+	if (programBlock(fs, fs->addressStart +
+		(stream->startSector * SECTOR_SIZE(fs)), fs->buff, PROGRAM_SIZE(fs))) {
+		fs->lastError = stream->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+
+/* Programs the buffered part of the page behind rwPosInSector, 0xFF padded.
+ * The page is programmed again when more data fills it after an fflush,
+ * the bytes already there are programmed with the same values. */
+static int32_t flushPage(norFAT_FS* fs, norfat_FILE* stream) {
+#if NORFAT_WRITE_BUFFER
+	uint32_t offset;
+	uint32_t blockAddress;
+	if (!stream->wbufDirty) {
+		return NORFAT_OK;
+	}
+	if (asyncWait(fs)) {
+		return NORFAT_ERR_IO;
+	}
+	offset = stream->rwPosInSector % PROGRAM_SIZE(fs);
+	if (offset == 0) {
+		offset = PROGRAM_SIZE(fs);
+	}
+	blockAddress = (stream->currentSector * SECTOR_SIZE(fs)) + (stream->rwPosInSector - offset);
+	memset(&stream->wbuf[offset], 0xFF, PROGRAM_SIZE(fs) - offset);
+	NORFAT_TRACE(("flushPage(0x%X)(%i)\r\n", blockAddress, offset));
+	if (programBlock(fs, fs->addressStart + blockAddress, stream->wbuf, PROGRAM_SIZE(fs))) {
+		NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+		fs->lastError = stream->lastError = NORFAT_ERR_IO;
+		return NORFAT_ERR_IO;
+	}
+	stream->wbufDirty = 0;
+#endif
+	return NORFAT_OK;
+}
+
+static int fflushUnlocked(norFAT_FS* fs, norfat_FILE* stream) {
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_ASSERT(stream);
+	NORFAT_TRACE(("norfat_fflush()\r\n"));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+	if (!(stream->openFlags & NORFAT_FLAG_WRITE) || stream->error) {
+		return NORFAT_OK;
+	}
+	return flushPage(fs, stream);
+}
+
+static int setbufUnlocked(norFAT_FS* fs, norfat_FILE* stream, uint8_t* buf) {
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(stream);
+	NORFAT_TRACE(("norfat_setbuf()\r\n"));
+#if NORFAT_STREAM_BUFFER
+	if (buf == NULL) {
+		return stream->lastError = NORFAT_ERR_NULL;
+	}
+#if NORFAT_WRITE_BUFFER
+	if (stream->wbuf && stream->wbuf == stream->iobuf) {
+		//Carries a partial page over
+		memcpy(buf, stream->wbuf, PROGRAM_SIZE(fs));
+		stream->wbuf = buf;
+	}
+#endif
+	releaseStreamBuffer(fs, stream);
+	stream->iobuf = buf;
+	stream->iobufFrom = NORFAT_IOBUF_USER;
+	return NORFAT_OK;
+#else
+	return stream->lastError = NORFAT_ERR_UNSUPPORTED;
+#endif
+}
+
+/* Marks an uncommitted chain as garbage, from sector to EOF */
+static int32_t discardChain(norFAT_FS* fs, uint32_t current) {
+	uint32_t limit = fs->flashSectors;
+	uint32_t next;
+	if (current == NORFAT_INVALID_SECTOR) {
+		return NORFAT_OK;
+	}
+	next = readSector(fs, current).next;
+	NORFAT_DEBUG(("..INVALID..%i.%i", current, next));
+	NORFAT_TRACE(("discardChain:%i.%i", current, next));
+	while (1) {
+		writeSector(fs, current)->base &= NORFAT_GARBAGE_MASK;
+		if (next == NORFAT_EOF) {
+			break;
+		}
+		if (next < TABLE_COUNT(fs) || (next >= fs->flashSectors && next != NORFAT_EOF)) {
+			NORFAT_ERROR(("Corrupt file system next = %i\r\n", next));
+			NORFAT_TRACE(("NORFAT_ERR_CORRUPT next \r\n", next));
+			return chainError(fs);
+		}
+		current = next;
+		next = readSector(fs, next).next;
+		NORFAT_DEBUG((".%i", next));
+		NORFAT_TRACE((".%i", next));
+		if (--limit < 1) {
+			NORFAT_TRACE(("NORFAT_ERR_CORRUPT limit\r\n"));
+			return chainError(fs);
+		}
+	}
+	NORFAT_DEBUG((".\r\n"));
+	NORFAT_TRACE((".\r\n"));
+	return NORFAT_OK;
+}
+
+#if NORFAT_ELIDE_UNCHANGED > 1
+/* Compares the written chain, plus the page still in wbuf, with the file
+ * it replaces. Both chains have the same layout, so they are walked in step.
+ * Returns 1 when equal, 0 when not, or NORFAT_ERR_IO */
+static int32_t sameContent(norFAT_FS* fs, norfat_FILE* stream) {
+	uint32_t oldSector = stream->oldFileSector;
+	uint32_t newSector = stream->startSector;
+	uint32_t pos = PROGRAM_SIZE(fs);
+	uint32_t remaining = stream->position;
+	uint32_t half = SECTOR_SIZE(fs) / 2;
+	uint32_t tail = 0;
+	uint32_t len;
+	uint32_t fromFlash;
+#if NORFAT_WRITE_BUFFER
+	if (stream->wbufDirty) {
+		tail = stream->rwPosInSector % PROGRAM_SIZE(fs);
+	}
+#endif
+	while (remaining) {
+		if (pos == SECTOR_SIZE(fs)) {
+			oldSector = readSector(fs, oldSector).next;
+			newSector = readSector(fs, newSector).next;
+			if (oldSector < TABLE_COUNT(fs) || oldSector >= fs->flashSectors ||
+				newSector < TABLE_COUNT(fs) || newSector >= fs->flashSectors) {
+				return 0;
+			}
+			pos = 0;
+		}
+		len = SECTOR_SIZE(fs) - pos;
+		if (len > half) {
+			len = half;
+		}
+		if (len > remaining) {
+			len = remaining;
+		}
+		fromFlash = remaining > tail ? remaining - tail : 0;
+		if (fromFlash > len) {
+			fromFlash = len;
+		}
+		if (readBlock(fs, fs->addressStart + (oldSector * SECTOR_SIZE(fs)) + pos, fs->buff, len) ||
+			(fromFlash && readBlock(fs, fs->addressStart + (newSector * SECTOR_SIZE(fs)) + pos,
+				&fs->buff[half], fromFlash))) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+#if NORFAT_WRITE_BUFFER
+		if (len > fromFlash) {
+			memcpy(&fs->buff[half + fromFlash], &stream->wbuf[(pos + fromFlash) % PROGRAM_SIZE(fs)], len - fromFlash);
+		}
+#endif
+		if (memcmp(fs->buff, &fs->buff[half], len)) {
+			return 0;
+		}
+		pos += len;
+		remaining -= len;
+	}
+	return 1;
+}
+#endif
+
+#if NORFAT_PACK_THRESHOLD
+/* The file outgrew NORFAT_PACK_THRESHOLD, or fclose can't pack it: what
+ * was held so far starts a sector file */
+static int32_t unpack(norFAT_FS* fs, norfat_FILE* stream) {
+	uint32_t held = stream->position;
+	NORFAT_TRACE(("unpack(%i)\r\n", held));
+	stream->packing = 0;
+	stream->position = 0;
+	if (held && fwriteUnlocked(fs, stream->pack, 1, held, stream) != held) {
+		stream->error = 1;
+		return stream->lastError ? stream->lastError : NORFAT_ERR_IO;
+	}
+	return NORFAT_OK;
+}
+
+/* fclose of a write stream small enough to pack. The old copies go after
+ * the new record is in place, a sector file with a commit */
+static int32_t closePacked(norFAT_FS* fs, norfat_FILE* stream) {
+	int32_t ret;
+	uint32_t loc;
+	uint32_t size = packRecordSize(fs, stream->position);
+	_packRecord* r;
+	if (stream->position) {
+#if NORFAT_ELIDE_UNCHANGED
+		if ((stream->oldPack == NORFAT_INVALID_SECTOR) != (stream->oldFileSector == NORFAT_FILE_NOT_FOUND) &&
+			stream->position == stream->fh->fileLen && stream->fh->crc == stream->oldCrc) {
+#if NORFAT_ELIDE_UNCHANGED > 1
+			loc = (stream->oldFileSector * SECTOR_SIZE(fs)) + PROGRAM_SIZE(fs);
+			if (stream->oldPack != NORFAT_INVALID_SECTOR) {
+				loc = (locSector(fs, stream->oldPack) * SECTOR_SIZE(fs)) +
+					locRecord(fs, stream->oldPack) + sizeof(_packRecord);
+			}
+			if (readBlock(fs, fs->addressStart + loc, fs->buff, stream->position)) {
+				fs->lastError = NORFAT_ERR_IO;
+				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+				return NORFAT_ERR_IO;
+			}
+			if (memcmp(fs->buff, stream->pack, stream->position) == 0)
+#endif
+			{
+				NORFAT_TRACE(("closePacked(%s):unchanged\r\n", stream->fh->fileName));
+				fs->elidedWrites++;
+				return NORFAT_OK;
+			}
+		}
+#endif
+		ret = packPlace(fs, size, stream->oldPack, &loc);
+		if (ret) {
+			return ret;
+		}
+		if (stream->oldPack != NORFAT_INVALID_SECTOR &&
+			packSetState(fs, stream->oldPack, NORFAT_PACK_SHADOWED)) {
+			return NORFAT_ERR_IO;
+		}
+		memset(fs->buff, 0xFF, size);
+		r = (_packRecord*)fs->buff;
+		memcpy(&r->fh, stream->fh, sizeof(norFAT_fileHeader));
+		r->fh.fileLen = stream->position;
+		r->fh.timeStamp = (uint32_t)time(NULL);
+		r->check = packRecordCrc(r);
+		memcpy(&r[1], stream->pack, stream->position);
+		NORFAT_TRACE(("closePacked(%s):record[%i.%i]\r\n", stream->fh->fileName, locSector(fs, loc), locRecord(fs, loc)));
+		if (programBlock(fs, fs->addressStart + (locSector(fs, loc) * SECTOR_SIZE(fs)) + locRecord(fs, loc),
+			fs->buff, size)) {
+			fs->lastError = NORFAT_ERR_IO;
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			return NORFAT_ERR_IO;
+		}
+#if NORFAT_HASH_INDEX_SIZE
+		if (fs->indexState != NORFAT_INDEX_NONE) {
+			indexInsert(fs, stream->fh->fileName, loc);
+		}
+#endif
+	}
+	if (stream->oldPack != NORFAT_INVALID_SECTOR &&
+		packSetState(fs, stream->oldPack, NORFAT_PACK_DELETED)) {
+		return NORFAT_ERR_IO;
+	}
+	if (stream->oldFileSector == NORFAT_FILE_NOT_FOUND) {
+		NORFAT_DEBUG(("FILE %s packed\r\n", stream->fh->fileName));
+		return NORFAT_OK;
+	}
+	ret = discardChain(fs, stream->oldFileSector);
+	if (ret) {
+		return ret;
+	}
+#if NORFAT_HASH_INDEX_SIZE
+	if (fs->indexState != NORFAT_INDEX_NONE) {
+		indexRemove(fs, stream->oldFileSector);
+	}
+#endif
+	return requestCommit(fs);
+}
+#endif
+
+static int fcloseUnlocked(norFAT_FS* fs, norfat_FILE* stream) {
 	//Write header to page
 	NORFAT_TRACE(("norfat_fclose()\r\n"));
 	NORFAT_ASSERT(fs);
@@ -996,7 +3436,7 @@ int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream) {
 	NORFAT_ASSERT(stream);
 	int32_t ret;
 	uint32_t limit;
-	uint32_t current;
+	uint32_t current = NORFAT_INVALID_SECTOR;
 	uint32_t next;
 	/* Protect fs state */
 	if (fs->lastError == NORFAT_ERR_IO) {
@@ -1004,84 +3444,129 @@ int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream) {
 		goto finalize;
 	}
 #if 0
-	memset(fs->buff, 0xFF, fs->programSize);
+	memset(fs->buff, 0xFF, PROGRAM_SIZE(fs));
 	stream->fh->fileLen = stream->position;
 	stream->fh->timeStamp = time(NULL);
 	memcpy(fs->buff, stream->fh, sizeof(norFAT_fileHeader));
+#endif
+#if NORFAT_PACK_THRESHOLD
+	//Before the copy being replaced gives way, two shadowed copies can't tell which is older
+	if (stream->openFlags & NORFAT_FLAG_WRITE && !stream->error) {
+		ret = dropStaleRecord(fs, stream->staleRecord, (const char*)stream->fh->fileName);
+		if (ret) {
+			goto finalize;
+		}
+	}
+	if (stream->packing && fs->batchDepth) {
+		//A batch commits together, a record would count right away
+		unpack(fs, stream);
+	}
+	if (stream->packing && !stream->error) {
+		ret = closePacked(fs, stream);
+		goto finalize;
+	}
 #endif
 	if (stream->error && stream->openFlags & NORFAT_FLAG_WRITE) {
-		//invalidate the last
-		if (stream->startSector != NORFAT_INVALID_SECTOR) {
-			limit = fs->flashSectors;
-			current = stream->startSector;
-			next = fs->fat->sector[current].next;
-			NORFAT_DEBUG(("..INVALID[%i]..%i.%i", stream->position, current, next));
-			NORFAT_TRACE(("norfat_fclose:INVALID[%i]:%i.%i\r\n", stream->position, current, next));
-			while (1) {
-				fs->fat->sector[current].base &= NORFAT_GARBAGE_MASK;
-				if (next == NORFAT_EOF) {
-					break;
-				}
-				if (next < fs->tableCount || (next >= fs->flashSectors && next != NORFAT_EOF)) {
-					NORFAT_ERROR(("Corrupt file system next = %i\r\n", next));
-					NORFAT_TRACE(("NORFAT_ERR_CORRUPT next \r\n", next));
-					ret = NORFAT_ERR_CORRUPT;
-					goto finalize;
-				}
-				current = next;
-				next = fs->fat->sector[next].next;
-				NORFAT_DEBUG((".%i", next));
-				NORFAT_TRACE((".%i", next));
-				if (--limit < 1) {
-					NORFAT_TRACE(("NORFAT_ERR_CORRUPT limit\r\n"));
-					ret = NORFAT_ERR_CORRUPT;
-					goto finalize;
-				}
-			}
-			NORFAT_DEBUG((".\r\n"));
-			NORFAT_TRACE((".\r\n", next));
+		//invalidate the last, or just the appended sectors
+		current = (stream->openFlags & NORFAT_FLAG_APPEND) ? stream->appendNext : stream->startSector;
+		NORFAT_TRACE(("norfat_fclose:INVALID[%i]\r\n", stream->position));
+		ret = discardChain(fs, current);
+		if (ret == NORFAT_OK) {
+			ret = fs->lastError;
 		}
-		ret = fs->lastError;
 		goto finalize;
 	}
+#if NORFAT_ELIDE_UNCHANGED
+	if (stream->openFlags & NORFAT_FLAG_WRITE && !(stream->openFlags & NORFAT_FLAG_APPEND)
+		&& stream->startSector != NORFAT_INVALID_SECTOR
+		&& stream->oldFileSector != NORFAT_FILE_NOT_FOUND
+#if NORFAT_PACK_THRESHOLD
+		&& stream->oldPack == NORFAT_INVALID_SECTOR
+#endif
+		&& stream->position == stream->fh->fileLen
+		&& stream->fh->crc == stream->oldCrc) {
+#if NORFAT_ELIDE_UNCHANGED > 1
+		ret = sameContent(fs, stream);
+		if (ret < 0) {
+			goto finalize;
+		}
+#else
+		ret = 1;
+#endif
+		if (ret) {
+			//Old file stays, the new chain was never committed
+			NORFAT_DEBUG(("FILE %s unchanged\r\n", stream->fh->fileName));
+			NORFAT_TRACE(("norfat_fclose(%s):unchanged\r\n", stream->fh->fileName));
+			fs->elidedWrites++;
+			ret = discardChain(fs, stream->startSector);
+			goto finalize;
+		}
+	}
+#endif
 	if (stream->openFlags & NORFAT_FLAG_WRITE && stream->startSector != NORFAT_INVALID_SECTOR) {
-		//Write the header
-		memset(fs->buff, 0xFF, fs->programSize);
-		stream->fh->fileLen = stream->position;
-		stream->fh->timeStamp = time(NULL);
-		memcpy(fs->buff, stream->fh, sizeof(norFAT_fileHeader));
-
-		if (fs->program_block_page(fs->addressStart +
-			(stream->startSector * fs->sectorSize), fs->buff, fs->programSize)) {
+		if (flushPage(fs, stream)) {
 			ret = NORFAT_ERR_IO;
-			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 			goto finalize;
 		}
+		if (stream->openFlags & NORFAT_FLAG_APPEND) {
+			ret = programAppendRecord(fs, stream);
+			if (ret) {
+				goto finalize;
+			}
+			current = stream->appendNext;
+			if (current != NORFAT_INVALID_SECTOR) {
+				writeSector(fs, stream->appendLast)->next = current;
+			}
+		}
+		else {
+#if NORFAT_PACK_THRESHOLD
+			//Gives way to this file once it is committed
+			if (stream->oldPack != NORFAT_INVALID_SECTOR &&
+				packSetState(fs, stream->oldPack, NORFAT_PACK_SHADOWED)) {
+				ret = NORFAT_ERR_IO;
+				goto finalize;
+			}
+#endif
+			//Write the header
+			memset(fs->buff, 0xFF, PROGRAM_SIZE(fs));
+			stream->fh->fileLen = stream->position;
+			stream->fh->timeStamp = time(NULL);
+			memcpy(fs->buff, stream->fh, sizeof(norFAT_fileHeader));
+
+			if (programBlock(fs, fs->addressStart +
+				(stream->startSector * SECTOR_SIZE(fs)), fs->buff, PROGRAM_SIZE(fs))) {
+				ret = NORFAT_ERR_IO;
+				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+				goto finalize;
+			}
+			current = stream->startSector;
+		}
+	}
+	if (stream->openFlags & NORFAT_FLAG_WRITE && current != NORFAT_INVALID_SECTOR) {
 		//Commit to _FAT table
-		fs->fat->sector[stream->startSector].write = 0;//Set write inactive
+		writeSector(fs, current)->write = 0;//Set write inactive
 		limit = fs->flashSectors;
-		current = stream->startSector;
-		next = fs->fat->sector[current].next;
+		next = readSector(fs, current).next;
 		NORFAT_DEBUG(("..WRITE[%i]..%i.%i.", stream->position, current, next));
 		NORFAT_TRACE(("norfat_fclose:WRITE[%i]:%i.%i.", stream->position, current, next));
 		while (1) {
 			if (next == NORFAT_EOF) {
 				break;
 			}
-			if (next < fs->tableCount || (next >= fs->flashSectors && next != NORFAT_EOF)) {
+			if (next < TABLE_COUNT(fs) || (next >= fs->flashSectors && next != NORFAT_EOF)) {
 				NORFAT_ERROR(("Corrupt file system next = %i\r\n", next));
 				NORFAT_TRACE(("NORFAT_ERR_CORRUPT next \r\n", next));
-				ret = NORFAT_ERR_CORRUPT;
+				ret = chainError(fs);
 				goto finalize;
 			}
-			fs->fat->sector[next].write = 0;//Set write inactive
+			writeSector(fs, next)->write = 0;//Set write inactive
 			current = next;
-			next = fs->fat->sector[next].next;
+			next = readSector(fs, next).next;
 			NORFAT_DEBUG(("%i.", next));
 			NORFAT_TRACE(("%i.", next));
 			if (--limit < 1) {
 				NORFAT_TRACE(("NORFAT_ERR_CORRUPT limit\r\n"));
-				ret = NORFAT_ERR_CORRUPT;
+				ret = chainError(fs);
 				goto finalize;
 			}
 
@@ -1096,33 +3581,50 @@ int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream) {
 
 		limit = fs->flashSectors;
 		current = stream->oldFileSector;
-		next = fs->fat->sector[current].next;
+		next = readSector(fs, current).next;
 		NORFAT_TRACE(("norfat_fclose:DELETE:%i.%i.", current, next));
 		while (1) {
-			fs->fat->sector[current].base &= NORFAT_GARBAGE_MASK;//Delete action
+			writeSector(fs, current)->base &= NORFAT_GARBAGE_MASK;//Delete action
 			if (next == NORFAT_EOF) {
 				break;
 			}
-			if (next < fs->tableCount || (next >= fs->flashSectors && next != NORFAT_EOF)) {
+			if (next < TABLE_COUNT(fs) || (next >= fs->flashSectors && next != NORFAT_EOF)) {
 				NORFAT_ERROR(("Corrupt file system next = %i\r\n", next));
 				NORFAT_TRACE(("NORFAT_ERR_CORRUPT next \r\n", next));
-				ret = NORFAT_ERR_CORRUPT;
+				ret = chainError(fs);
 				goto finalize;
 			}
 			current = next;
-			next = fs->fat->sector[next].next;
+			next = readSector(fs, next).next;
 			NORFAT_TRACE(("%i.", next));
 			if (--limit < 1) {
 				NORFAT_TRACE(("NORFAT_ERR_CORRUPT limit\r\n"));
-				ret = NORFAT_ERR_CORRUPT;
+				ret = chainError(fs);
 				goto finalize;
 			}
 
 		}
 		NORFAT_TRACE(("\r\n"));
 	}
-	if (stream->openFlags & NORFAT_FLAG_WRITE) {
-		ret = commitChanges(fs, 0);
+	if ((stream->openFlags & NORFAT_FLAG_APPEND) && stream->appendNext == NORFAT_INVALID_SECTOR) {
+		//Appended within the last sector, the record alone did it
+		ret = NORFAT_OK;
+	}
+	else if (stream->openFlags & NORFAT_FLAG_WRITE) {
+#if NORFAT_HASH_INDEX_SIZE
+		if (fs->indexState != NORFAT_INDEX_NONE && !(stream->openFlags & NORFAT_FLAG_APPEND)) {
+			indexRemove(fs, stream->oldFileSector);
+			if (stream->startSector != NORFAT_INVALID_SECTOR) {
+				indexInsert(fs, stream->fh->fileName, stream->startSector);
+			}
+		}
+#endif
+		ret = requestCommit(fs);
+#if NORFAT_PACK_THRESHOLD
+		if (ret == NORFAT_OK && stream->oldPack != NORFAT_INVALID_SECTOR) {
+			ret = packSetState(fs, stream->oldPack, NORFAT_PACK_DELETED);
+		}
+#endif
 
 		if (ret) {
 			NORFAT_DEBUG(("FILE %s commit failed\r\n", stream->fh->fileName));
@@ -1139,12 +3641,29 @@ int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream) {
 finalize:
 	NORFAT_DEBUG(("FILE %s closed\r\n", stream->fh->fileName));
 	NORFAT_TRACE(("norfat_fclose(%s):finalize\r\n", stream->fh->fileName));
-	NORFAT_FREE(stream->fh);
-	NORFAT_FREE(stream);
+#if NORFAT_WRITE_BUFFER
+#if NORFAT_STREAM_BUFFER
+	if (stream->wbuf == stream->iobuf) {
+		stream->wbuf = NULL;
+	}
+#endif
+	if (stream->wbuf) {
+		NORFAT_FREE(stream->wbuf);
+	}
+#endif
+#if NORFAT_STREAM_BUFFER
+	releaseStreamBuffer(fs, stream);
+#endif
+#if NORFAT_SEEK_INDEX
+	if (stream->chain) {
+		NORFAT_FREE(stream->chain);
+	}
+#endif
+	freeStream(fs, stream);
 	return ret;
 }
 
-size_t norfat_fwrite(norFAT_FS* fs, const void* ptr, size_t size, size_t count, norfat_FILE* stream) {
+static size_t fwriteUnlocked(norFAT_FS* fs, const void* ptr, size_t size, size_t count, norfat_FILE* stream) {
 	int32_t nextSector;
 	uint32_t writeable;
 	uint32_t blockWriteLength;
@@ -1153,18 +3672,53 @@ size_t norfat_fwrite(norFAT_FS* fs, const void* ptr, size_t size, size_t count,
 	uint32_t offset;
 	uint8_t* out = (uint8_t*)ptr;
 	uint32_t len = size * count;
+	uint8_t* buf = fs->buff;
+	uint32_t bufSize = SECTOR_SIZE(fs);
+#if NORFAT_ASYNC_PROGRAM
+	uint32_t async;
+#endif
 	NORFAT_TRACE(("norfat_fwrite(%i)\r\n", len));
 	NORFAT_ASSERT(fs);
 	NORFAT_ASSERT(fs->volumeMounted);
 	NORFAT_ASSERT(stream);
 	NORFAT_ASSERT(stream->openFlags & NORFAT_FLAG_WRITE);
 	NORFAT_ASSERT(size * count > 0);
+#if NORFAT_ASYNC_PROGRAM
+	//Only a program of this stream may run on
+	if (fs->asyncStream != stream && asyncWait(fs)) {
+		stream->error = 1;
+		fs->lastError = stream->lastError = NORFAT_ERR_IO;
+		NORFAT_TRACE(("norfat_fwrite:NORFAT_ERR_IO\r\n"));
+		return NORFAT_ERR_IO;
+	}
+#endif
 	/* Protect fs state */
 	if (fs->lastError == NORFAT_ERR_IO) {
 		return 0;
 	}
+#if NORFAT_PACK_THRESHOLD
+	if (stream->packing) {
+		if (stream->position + len <= NORFAT_PACK_THRESHOLD) {
+			//Held until fclose packs it
+			if (stream->position == 0) {
+				stream->fh->crc = 0xFFFFFFFF;
+			}
+			memcpy(&stream->pack[stream->position], out, len);
+			stream->fh->crc = NORFAT_CRC(out, len, stream->fh->crc);
+			stream->position += len;
+			return (size * count);
+		}
+		if (unpack(fs, stream)) {
+			return 0;
+		}
+	}
+#endif
 	if (stream->currentSector == -1) {
-		stream->currentSector = findEmptySector(fs);
+		if (asyncWait(fs)) {
+			stream->error = 1;
+			return NORFAT_ERR_IO;
+		}
+		stream->currentSector = takeErasedSector(fs, NORFAT_INVALID_SECTOR);
 		if (stream->currentSector == NORFAT_ERR_FULL) {
 			stream->error = 1;
 			stream->lastError = NORFAT_ERR_FULL;
@@ -1177,25 +3731,38 @@ size_t norfat_fwrite(norFAT_FS* fs, const void* ptr, size_t size, size_t count,
 			NORFAT_TRACE(("norfat_fwrite:NORFAT_ERR_IO\r\n"));
 			return NORFAT_ERR_IO;
 		}
-		if (fs->erase_block_sector(fs->addressStart + (fs->sectorSize * stream->currentSector))) {
-			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-			fs->lastError = stream->lastError = NORFAT_ERR_IO;
-			return NORFAT_ERR_IO;
-		}
 		NORFAT_DEBUG(("New file sector %i\r\n", stream->currentSector));
 		NORFAT_TRACE(("norfat_fwrite:add sector[%i]\r\n", stream->currentSector));
 		//New file
 		stream->startSector = stream->currentSector;
-		stream->rwPosInSector = fs->programSize;
+		stream->rwPosInSector = PROGRAM_SIZE(fs);
 		stream->fh->crc = 0xFFFFFFFF;
-		NORFAT_ASSERT(stream->startSector >= fs->tableCount && stream->startSector != NORFAT_INVALID_SECTOR);
+		NORFAT_ASSERT(stream->startSector >= TABLE_COUNT(fs) && stream->startSector != NORFAT_INVALID_SECTOR);
+	}
+#if NORFAT_STREAM_BUFFER
+	if (stream->iobuf) {
+		buf = stream->iobuf;
+		bufSize = NORFAT_STREAM_BUFFER;
 	}
+#endif
+#if NORFAT_ASYNC_PROGRAM
+	//Past the wbuf page, each half of the stream buffer fills while the other programs
+	async = stream->iobuf && fs->program_page_submit && NORFAT_STREAM_BUFFER >= 3 * PROGRAM_SIZE(fs);
+	if (async) {
+		bufSize = (NORFAT_STREAM_BUFFER - PROGRAM_SIZE(fs)) / 2;
+		bufSize -= bufSize % PROGRAM_SIZE(fs);
+	}
+#endif
 	//At this point we should have a writeable area
 	while (len) {
 		//Calculate available space to write in this sector
-		writeable = fs->sectorSize - stream->rwPosInSector;
+		writeable = SECTOR_SIZE(fs) - stream->rwPosInSector;
 		if (writeable == 0) {
-			nextSector = findEmptySector(fs);
+			if (asyncWait(fs)) {
+				stream->error = 1;//Flag for fclose delete
+				return NORFAT_ERR_IO;
+			}
+			nextSector = takeErasedSector(fs, stream->currentSector + 1);
 			if (nextSector == NORFAT_ERR_FULL) {
 				stream->error = 1;//Flag for fclose delete
 				stream->lastError = NORFAT_ERR_FULL;
@@ -1208,179 +3775,565 @@ size_t norfat_fwrite(norFAT_FS* fs, const void* ptr, size_t size, size_t count,
 				NORFAT_TRACE(("norfat_fwrite:NORFAT_ERR_IO\r\n"));
 				return NORFAT_ERR_IO;
 			}
-			if (fs->erase_block_sector(fs->addressStart + (fs->sectorSize * nextSector))) {
-				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-				fs->lastError = stream->lastError = NORFAT_ERR_IO;
-				return NORFAT_ERR_IO;
-			}
 			NORFAT_TRACE(("norfat_fwrite:add sector[%i]->[%i]\r\n", stream->currentSector, nextSector));
 			NORFAT_DEBUG(("File sector added %i -> %i\r\n", stream->currentSector, nextSector));
-			fs->fat->sector[stream->currentSector].next = nextSector;
-			fs->fat->sector[nextSector].sof = 0;
+			if ((uint32_t)stream->currentSector == stream->appendLast) {
+				//Linked in fclose, after the append record
+				stream->appendNext = nextSector;
+			}
+			else {
+				writeSector(fs, stream->currentSector)->next = nextSector;
+			}
+			writeSector(fs, nextSector)->sof = 0;
 			stream->currentSector = nextSector;
-			writeable = fs->sectorSize;
+			writeable = SECTOR_SIZE(fs);
 			stream->rwPosInSector = 0;
 		}
 		//Calculate starting offset
 		blockWriteLength = 0;
-		offset = stream->rwPosInSector % fs->programSize;
-		blockAddress = (stream->currentSector * fs->sectorSize) + (stream->rwPosInSector - offset);
-		//buf = fs->buff;
+		offset = stream->rwPosInSector % PROGRAM_SIZE(fs);
+		blockAddress = (stream->currentSector * SECTOR_SIZE(fs)) + (stream->rwPosInSector - offset);
+#if NORFAT_WRITE_BUFFER
+		if (offset || len < PROGRAM_SIZE(fs)) {
+			//Partial pages collect in the stream, programmed once full
+			DataLengthToWrite = PROGRAM_SIZE(fs) - offset;
+			if (DataLengthToWrite > len) {
+				DataLengthToWrite = len;
+			}
+			memcpy(&stream->wbuf[offset], out, DataLengthToWrite);
+			stream->wbufDirty = 1;
+			if (offset + DataLengthToWrite == PROGRAM_SIZE(fs)) {
+				stream->rwPosInSector += DataLengthToWrite;
+				if (flushPage(fs, stream)) {
+					stream->error = 1;
+					return NORFAT_ERR_IO;
+				}
+				stream->rwPosInSector -= DataLengthToWrite;
+			}
+			goto advance;
+		}
+#endif
+#if NORFAT_ASYNC_PROGRAM
+		if (async) {
+			buf = &stream->iobuf[PROGRAM_SIZE(fs) + (stream->asyncHalf * bufSize)];
+		}
+#endif
 		if (offset) {
-			memset(fs->buff, 0xFF, offset);
+			memset(buf, 0xFF, offset);
 			blockWriteLength += offset;
 		}
 		DataLengthToWrite = len > writeable ? writeable : len;
-		memcpy(&fs->buff[blockWriteLength], out, DataLengthToWrite);
+		if (DataLengthToWrite > bufSize - offset) {
+			DataLengthToWrite = bufSize - offset;
+		}
+#if NORFAT_WRITE_BUFFER
+		//Whole pages only, the tail goes to the stream buffer
+		DataLengthToWrite -= DataLengthToWrite % PROGRAM_SIZE(fs);
+#endif
+		memcpy(&buf[blockWriteLength], out, DataLengthToWrite);
 		blockWriteLength += DataLengthToWrite;
-		if (blockWriteLength % fs->programSize) {
+		if (blockWriteLength % PROGRAM_SIZE(fs)) {
 			//Fill remaining page with 0xFF
-			uint32_t fill = fs->programSize - (blockWriteLength % fs->programSize);
-			memset(&fs->buff[blockWriteLength], 0xFF, fill);
+			uint32_t fill = PROGRAM_SIZE(fs) - (blockWriteLength % PROGRAM_SIZE(fs));
+			memset(&buf[blockWriteLength], 0xFF, fill);
 			blockWriteLength += fill;
 		}
 
-		NORFAT_ASSERT((blockAddress % fs->sectorSize) + blockWriteLength <= fs->sectorSize);
-		if (fs->program_block_page(fs->addressStart + blockAddress, fs->buff, blockWriteLength)) {
+		NORFAT_ASSERT((blockAddress % SECTOR_SIZE(fs)) + blockWriteLength <= SECTOR_SIZE(fs));
+#if NORFAT_ASYNC_PROGRAM
+		if (async) {
+			if (asyncSubmit(fs, stream, blockAddress, buf, blockWriteLength)) {
+				stream->error = 1;
+				return NORFAT_ERR_IO;
+			}
+			stream->asyncHalf ^= 1;
+			goto advance;
+		}
+#endif
+		if (programBlock(fs, fs->addressStart + blockAddress, buf, blockWriteLength)) {
 			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
 			fs->lastError = stream->lastError = NORFAT_ERR_IO;
 			return NORFAT_ERR_IO;
 		}
-		stream->fh->crc = NORFAT_CRC(out, DataLengthToWrite, stream->fh->crc);
-		stream->position += DataLengthToWrite;
-		stream->rwPosInSector += DataLengthToWrite;
-		out += DataLengthToWrite;
-		len -= DataLengthToWrite;
+#if NORFAT_WRITE_BUFFER || NORFAT_ASYNC_PROGRAM
+advance:
+#endif
+		stream->fh->crc = NORFAT_CRC(out, DataLengthToWrite, stream->fh->crc);
+		stream->position += DataLengthToWrite;
+		stream->rwPosInSector += DataLengthToWrite;
+		out += DataLengthToWrite;
+		len -= DataLengthToWrite;
+	}
+	NORFAT_TRACE(("norfat_fwrite:wrote %i\r\n", (size * count)));
+	return (size * count);
+}
+
+static size_t freadUnlocked(norFAT_FS* fs, void* ptr, size_t size, size_t count, norfat_FILE* stream) {
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_ASSERT(stream);
+	NORFAT_ASSERT(stream->openFlags & NORFAT_FLAG_READ);
+	uint32_t next;
+	uint32_t readable;
+	uint32_t remaining;
+	uint32_t rlen;
+	uint32_t rawAdr;
+	uint32_t want;
+	uint32_t span;
+	uint32_t limit;
+	uint32_t last;
+	uint32_t direct;
+	int32_t readCount = 0;
+	uint8_t* in = (uint8_t*)ptr;
+	uint32_t len = size * count;
+	uint8_t* buf = fs->buff;
+	uint32_t bufSize = SECTOR_SIZE(fs) * TABLE_SECTORS(fs);
+	NORFAT_TRACE(("norfat_fread(%i)\r\n", len));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return 0;
+	}
+#if NORFAT_STREAM_BUFFER
+	if (stream->iobuf) {
+		buf = stream->iobuf;
+		bufSize = NORFAT_STREAM_BUFFER;
+	}
+#endif
+	while (len) {
+		readable = SECTOR_SIZE(fs) - stream->rwPosInSector;
+		remaining = stream->fh->fileLen - stream->position;
+		if (remaining == 0) {
+			return readCount;
+		}
+		if (readable == 0) {
+			next = readSector(fs, stream->currentSector).next;
+			NORFAT_TRACE(("norfat_fread:next sector[%i]\r\n", next));
+			if (next == NORFAT_EOF) {
+				return readCount;
+			}
+			stream->rwPosInSector = 0;
+			stream->currentSector = next;
+			readable = SECTOR_SIZE(fs);
+		}
+
+		want = len > remaining ? remaining : len;
+		rlen = want > readable ? readable : want;
+		//Readers share the lock, so fs->buff is out of bounds for them
+		direct = stream->zeroCopy || NORFAT_DIRECT_READ || (NORFAT_THREAD_SAFE && buf == fs->buff);
+		limit = direct ? want : bufSize;
+		rlen = rlen > limit ? limit : rlen;
+		rawAdr = (stream->currentSector * SECTOR_SIZE(fs)) + stream->rwPosInSector;
+		//Physically adjacent chain sectors go out as one read
+		last = stream->currentSector;
+		while (rlen < want && rlen < limit && readSector(fs, last).next == last + 1) {
+			last++;
+			span = want - rlen;
+			span = span > SECTOR_SIZE(fs) ? SECTOR_SIZE(fs) : span;
+			span = span > limit - rlen ? limit - rlen : span;
+			rlen += span;
+		}
+		if (direct) {
+			// Requires user implemented cache free operation
+			if (readBlock(fs, fs->addressStart + rawAdr, in, rlen)) {
+				fs->lastError = stream->lastError = NORFAT_ERR_IO;
+				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+				return 0;
+			}
+		}
+		else {
+			if (readBlock(fs, fs->addressStart + rawAdr, buf, rlen)) {
+				fs->lastError = stream->lastError = NORFAT_ERR_IO;
+				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+				return 0;
+			}
+			memcpy(in, buf, rlen);
+		}
+
+		//crc32(out, wlen, &file->fh->crc);
+		stream->position += rlen;
+		stream->rwPosInSector += rlen - ((last - stream->currentSector) * SECTOR_SIZE(fs));
+		stream->currentSector = last;
+		in += rlen;
+		len -= rlen;
+		readCount += rlen;
+
+	}
+	NORFAT_TRACE(("norfat_fread:read %i\r\n", readCount));
+	return readCount;
+}
+
+static int removeUnlocked(norFAT_FS* fs, const char* filename) {
+	uint32_t sector;
+	int ret = NORFAT_OK;
+	uint32_t limit, current, next;
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_TRACE(("norfat_remove(%s)\r\n", filename));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+	uint32_t stale, staleRecord;
+	norFAT_fileHeader fh;
+	if (!fileSearch(fs, filename, &fh, &sector, &stale, &staleRecord)) {
+		return NORFAT_OK;
+	}
+#if NORFAT_PACK_THRESHOLD
+	//Older copy first, it would come back once the file is gone
+	ret = dropStaleRecord(fs, staleRecord, filename);
+	if (ret) {
+		return ret;
+	}
+	if (isPacked(sector)) {
+		//Sector file behind the record first, or it would come back
+		if (stale != NORFAT_INVALID_SECTOR) {
+			ret = discardChain(fs, stale);
+#if NORFAT_HASH_INDEX_SIZE
+			if (fs->indexState != NORFAT_INDEX_NONE) {
+				indexRemove(fs, stale);
+			}
+#endif
+			if (ret == NORFAT_OK) {
+				ret = requestCommit(fs);
+			}
+		}
+		if (ret == NORFAT_OK) {
+			ret = packSetState(fs, sector, NORFAT_PACK_DELETED);
+		}
+		NORFAT_DEBUG(("FILE %s delete\r\n", filename));
+		goto finalize;
+	}
+#endif
+
+	limit = fs->flashSectors;
+	current = sector;
+	next = readSector(fs, current).next;
+	NORFAT_TRACE(("norfat_remove:DELETE:%i.%i.", current, next));
+	while (1) {
+		writeSector(fs, current)->base &= NORFAT_GARBAGE_MASK;//Delete action
+		if (next == NORFAT_EOF) {
+			break;
+		}
+		if (next < TABLE_COUNT(fs) || (next >= fs->flashSectors && next != NORFAT_EOF)) {
+			NORFAT_ERROR(("Corrupt file system next = %i\r\n", next));
+			NORFAT_TRACE(("NORFAT_ERR_CORRUPT\r\n", next));
+			fs->lastError = chainError(fs);
+			ret = chainError(fs);
+			goto finalize;
+		}
+		current = next;
+		next = readSector(fs, next).next;
+		NORFAT_TRACE(("%i.", next));
+		if (--limit < 1) {
+			NORFAT_TRACE(("NORFAT_ERR_CORRUPT limit\r\n"));
+			fs->lastError = chainError(fs);
+			ret = chainError(fs);
+			goto finalize;
+		}
+
+	}
+	NORFAT_TRACE(("\r\n", next));
+#if NORFAT_HASH_INDEX_SIZE
+	if (fs->indexState != NORFAT_INDEX_NONE) {
+		indexRemove(fs, sector);
+	}
+#endif
+	ret = requestCommit(fs);
+	NORFAT_TRACE(("norfat_remove:committed\r\n"));
+	NORFAT_DEBUG(("FILE %s delete\r\n", filename));
+finalize:
+	NORFAT_TRACE(("norfat_remove:finalize\r\n"));
+	return ret;
+}
+
+static int beginUnlocked(norFAT_FS* fs) {
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_TRACE(("norfat_begin(%i)\r\n", fs->batchDepth));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+	fs->batchDepth++;
+	return NORFAT_OK;
+}
+
+static int commitUnlocked(norFAT_FS* fs) {
+	int ret = NORFAT_OK;
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_ASSERT(fs->batchDepth);
+	NORFAT_TRACE(("norfat_commit(%i)\r\n", fs->batchDepth));
+	if (fs->batchDepth == 0) {
+		return NORFAT_ERR_UNSUPPORTED;
+	}
+	if (--fs->batchDepth == 0 && fs->batchPending) {
+		ret = commitChanges(fs, 0);
+		NORFAT_DEBUG(("Batch %s\r\n", ret ? "commit failed" : "committed"));
+	}
+	return ret;
+}
+
+static int maintainUnlocked(norFAT_FS* fs, uint32_t budget) {
+	int ret = 0;
+#if NORFAT_PREERASE_POOL
+	int32_t sector;
+	int32_t res;
+#endif
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_TRACE(("norfat_maintain(%i)\r\n", budget));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
+	}
+#if NORFAT_PREERASE_POOL
+	while (budget && fs->poolCount < NORFAT_PREERASE_POOL) {
+		//Garbage collection is left to the writers
+		sector = pickSector(fs, randomSector(fs));
+		if (sector < 0) {
+			break;
+		}
+		if (eraseBlock(fs, fs->addressStart + (SECTOR_SIZE(fs) * sector))) {
+			NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
+			fs->lastError = NORFAT_ERR_IO;
+			return NORFAT_ERR_IO;
+		}
+		fs->pool[fs->poolCount++] = sector;
+		budget--;
+		ret++;
+	}
+	if (ret) {
+		res = requestCommit(fs);
+		if (res) {
+			return res;
+		}
 	}
-	NORFAT_TRACE(("norfat_fwrite:wrote %i\r\n", (size * count)));
-	return (size * count);
+	NORFAT_DEBUG(("Erased %i sectors, %i in pool\r\n", ret, fs->poolCount));
+#endif
+	return ret;
 }
 
-size_t norfat_fread(norFAT_FS* fs, void* ptr, size_t size, size_t count, norfat_FILE* stream) {
+static uint32_t belowWatermark(norFAT_FS* fs) {
+	uint32_t dataSectors = fs->flashSectors - (TABLE_COUNT(fs) * TABLE_SECTORS(fs));
+#if NORFAT_FREE_MAP_SECTORS
+	uint32_t available = fs->freeCount;
+#else
+	uint32_t i;
+	uint32_t available = 0;
+	for (i = (TABLE_COUNT(fs) * TABLE_SECTORS(fs)); i < fs->flashSectors; i++) {
+		available += readSector(fs, i).available;
+	}
+#endif
+	return available * 100 < dataSectors * NORFAT_GC_WATERMARK;
+}
+
+static int gcStepUnlocked(norFAT_FS* fs) {
+	int32_t res;
 	NORFAT_ASSERT(fs);
 	NORFAT_ASSERT(fs->volumeMounted);
-	NORFAT_ASSERT(stream);
-	NORFAT_ASSERT(stream->openFlags & NORFAT_FLAG_READ);
-	uint32_t next;
-	uint32_t readable;
-	uint32_t remaining;
-	uint32_t rlen;
-	uint32_t rawAdr;
-	int32_t readCount = 0;
-	uint8_t* in = (uint8_t*)ptr;
-	uint32_t len = size * count;
-	NORFAT_TRACE(("norfat_fread(%i)\r\n", len));
 	/* Protect fs state */
 	if (fs->lastError == NORFAT_ERR_IO) {
-		return 0;
+		return NORFAT_ERR_IO;
 	}
-	while (len) {
-		readable = fs->sectorSize - stream->rwPosInSector;
-		remaining = stream->fh->fileLen - stream->position;
-		if (remaining == 0) {
-			return readCount;
+	if (!fs->swapPending) {
+		if (fs->batchPending || !belowWatermark(fs) || !sweepGarbage(fs)) {
+			return 0;
 		}
-		if (readable == 0) {
-			next = fs->fat->sector[stream->currentSector].next;
-			NORFAT_TRACE(("norfat_fread:next sector[%i]\r\n", next));
-			if (next == NORFAT_EOF) {
-				return readCount;
-			}
-			stream->rwPosInSector = 0;
-			stream->currentSector = next;
-			readable = fs->sectorSize;
+		NORFAT_TRACE(("norfat_gc_step:swept\r\n"));
+		return 1;
+	}
+	//Programming the new table would publish half a batch
+	if (fs->swapStep == TABLE_SECTORS(fs) && fs->batchPending) {
+		return 0;
+	}
+	res = swapStep(fs);
+	if (res) {
+		return res;
+	}
+	NORFAT_TRACE(("norfat_gc_step:%i\r\n", fs->swapStep));
+	return fs->swapPending;
+}
+
+static int gcUnlocked(norFAT_FS* fs, uint32_t maxMicros) {
+	int res;
+	uint32_t start = NORFAT_MICROS();
+	NORFAT_TRACE(("norfat_gc(%i)\r\n", maxMicros));
+	while ((res = gcStepUnlocked(fs)) > 0) {
+		if ((uint32_t)(NORFAT_MICROS() - start) >= maxMicros) {
+			break;
 		}
+	}
+	return res;
+}
 
-		rlen = len > readable ? readable : len;
-		rlen = rlen > remaining ? remaining : rlen;
-		//TODO: only allow reads up to real len
-		//uint32_t rawlen = wlen;
-		rawAdr = (stream->currentSector * fs->sectorSize) + stream->rwPosInSector;
-		if (stream->zeroCopy) {
-			// Requires user implemented cache free operation
-			if (fs->read_block_device(fs->addressStart + rawAdr, in, rlen)) {
-				fs->lastError = stream->lastError = NORFAT_ERR_IO;
-				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-				return 0;
-			}
+/* Sector number k of the file chain. With NORFAT_SEEK_INDEX the chain is
+ * walked once per stream into stream->chain, otherwise on every seek */
+static int32_t chainSector(norFAT_FS* fs, norfat_FILE* stream, uint32_t k) {
+	uint32_t i;
+	uint32_t sector = stream->startSector;
+	uint32_t count = (stream->fh->fileLen + stream->dataStart + SECTOR_SIZE(fs) - 1) / SECTOR_SIZE(fs);
+	uint32_t last = k;
+#if NORFAT_SEEK_INDEX
+	if (stream->chain) {
+		return stream->chain[k];
+	}
+	stream->chain = NORFAT_MALLOC(count * sizeof(uint32_t));
+	if (!stream->chain) {
+		fs->lastError = NORFAT_ERR_MALLOC;
+		NORFAT_TRACE(("NORFAT_ERR_MALLOC\r\n"));
+		return NORFAT_ERR_MALLOC;
+	}
+	last = count - 1;
+#endif
+	NORFAT_ASSERT(k < count);
+	for (i = 0; ; i++) {
+#if NORFAT_SEEK_INDEX
+		stream->chain[i] = sector;
+#endif
+		if (i == last) {
+			break;
 		}
-		else {
-			if (fs->read_block_device(fs->addressStart + rawAdr, fs->buff, rlen)) {
-				fs->lastError = stream->lastError = NORFAT_ERR_IO;
-				NORFAT_TRACE(("NORFAT_ERR_IO\r\n"));
-				return 0;
-			}
-			memcpy(in, fs->buff, rlen);
+		sector = readSector(fs, sector).next;
+		if (sector < (TABLE_COUNT(fs) * TABLE_SECTORS(fs)) || sector >= fs->flashSectors) {
+			NORFAT_ERROR(("Corrupt file system next = %i\r\n", sector));
+			NORFAT_TRACE(("NORFAT_ERR_CORRUPT next %i\r\n", sector));
+#if NORFAT_SEEK_INDEX
+			NORFAT_FREE(stream->chain);
+			stream->chain = NULL;
+#endif
+			return chainError(fs);
 		}
+	}
+#if NORFAT_SEEK_INDEX
+	return stream->chain[k];
+#else
+	return sector;
+#endif
+}
 
-		//crc32(out, wlen, &file->fh->crc);
-		stream->position += rlen;
-		stream->rwPosInSector += rlen;
-		in += rlen;
-		len -= rlen;
-		readCount += rlen;
-
+static int fseekUnlocked(norFAT_FS* fs, norfat_FILE* stream, int32_t offset, int origin) {
+	int32_t sector;
+	uint32_t k;
+	uint32_t rawPos;
+	int64_t target;
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(fs->volumeMounted);
+	NORFAT_ASSERT(stream);
+	NORFAT_TRACE(("norfat_fseek(%i,%i)\r\n", offset, origin));
+	/* Protect fs state */
+	if (fs->lastError == NORFAT_ERR_IO) {
+		return NORFAT_ERR_IO;
 	}
-	NORFAT_TRACE(("norfat_fread:read %i\r\n", readCount));
-	return readCount;
+	if (!(stream->openFlags & NORFAT_FLAG_READ)) {
+		return stream->lastError = NORFAT_ERR_UNSUPPORTED;
+	}
+	switch (origin) {
+	case NORFAT_SEEK_SET:
+		target = offset;
+		break;
+	case NORFAT_SEEK_CUR:
+		target = (int64_t)stream->position + offset;
+		break;
+	case NORFAT_SEEK_END:
+		target = (int64_t)stream->fh->fileLen + offset;
+		break;
+	default:
+		return stream->lastError = NORFAT_ERR_SEEK;
+	}
+	if (target < 0 || target > stream->fh->fileLen) {
+		return stream->lastError = NORFAT_ERR_SEEK;
+	}
+	//Data starts after the header page, or the packed record header
+	rawPos = (uint32_t)target + stream->dataStart;
+	k = rawPos / SECTOR_SIZE(fs);
+	if (k && rawPos % SECTOR_SIZE(fs) == 0) {
+		//End of the previous sector, fread steps on from there
+		k--;
+	}
+	sector = chainSector(fs, stream, k);
+	if (sector < 0) {
+		return stream->lastError = sector;
+	}
+	stream->currentSector = sector;
+	stream->rwPosInSector = rawPos - (k * SECTOR_SIZE(fs));
+	stream->position = (uint32_t)target;
+	return NORFAT_OK;
 }
 
-int norfat_remove(norFAT_FS* fs, const char* filename) {
+int32_t norfat_ftell(norFAT_FS* fs, norfat_FILE* stream) {
+	NORFAT_ASSERT(fs);
+	NORFAT_ASSERT(stream);
+	return (int32_t)stream->position;
+}
+
+static int32_t fmapUnlocked(norFAT_FS* fs, const char* filename, norfat_span* spans, uint32_t count) {
 	uint32_t sector;
-	int ret = NORFAT_OK;
-	uint32_t limit, current, next;
+	uint32_t remaining;
+	uint32_t address;
+	uint32_t length;
+	uint32_t limit;
+	uint32_t end = 0;
+	int32_t used = 0;
+	norFAT_fileHeader fh;
 	NORFAT_ASSERT(fs);
 	NORFAT_ASSERT(fs->volumeMounted);
-	NORFAT_TRACE(("norfat_remove(%s)\r\n", filename));
+	NORFAT_TRACE(("norfat_fmap(%s)\r\n", filename));
 	/* Protect fs state */
 	if (fs->lastError == NORFAT_ERR_IO) {
 		return NORFAT_ERR_IO;
 	}
-	norFAT_fileHeader* f = fileSearch(fs, filename, &sector);
-	if (!f) {
-		return NORFAT_OK;
+	if (fs->mapBase == NULL) {
+		return NORFAT_ERR_UNSUPPORTED;
 	}
-
+	if (!fileSearch(fs, filename, &fh, &sector, NULL, NULL)) {
+		return fs->lastError == NORFAT_ERR_IO ? NORFAT_ERR_IO : NORFAT_ERR_FILE_NOT_FOUND;
+	}
+	remaining = fh.fileLen;
+	//Data starts after the header page
+	address = (sector * SECTOR_SIZE(fs)) + PROGRAM_SIZE(fs);
+	length = SECTOR_SIZE(fs) - PROGRAM_SIZE(fs);
+#if NORFAT_PACK_THRESHOLD
+	if (isPacked(sector)) {
+		address = (locSector(fs, sector) * SECTOR_SIZE(fs)) + locRecord(fs, sector) + sizeof(_packRecord);
+		length = remaining;
+	}
+#endif
 	limit = fs->flashSectors;
-	current = sector;
-	next = fs->fat->sector[current].next;
-	NORFAT_TRACE(("norfat_remove:DELETE:%i.%i.", current, next));
-	while (1) {
-		fs->fat->sector[current].base &= NORFAT_GARBAGE_MASK;//Delete action
-		if (next == NORFAT_EOF) {
-			break;
+	while (remaining) {
+		length = length > remaining ? remaining : length;
+		if (used && address == end) {
+			//Physically adjacent, grow the last span
+			if ((uint32_t)used <= count) {
+				spans[used - 1].length += length;
+			}
 		}
-		if (next < fs->tableCount || (next >= fs->flashSectors && next != NORFAT_EOF)) {
-			NORFAT_ERROR(("Corrupt file system next = %i\r\n", next));
-			NORFAT_TRACE(("NORFAT_ERR_CORRUPT\r\n", next));
-			fs->lastError = NORFAT_ERR_CORRUPT;
-			ret = NORFAT_ERR_CORRUPT;
-			goto finalize;
+		else {
+			if ((uint32_t)used < count) {
+				spans[used].address = fs->mapBase + fs->addressStart + address;
+				spans[used].length = length;
+			}
+			used++;
 		}
-		current = next;
-		next = fs->fat->sector[next].next;
-		NORFAT_TRACE(("%i.", next));
-		if (--limit < 1) {
-			NORFAT_TRACE(("NORFAT_ERR_CORRUPT limit\r\n"));
-			fs->lastError = NORFAT_ERR_CORRUPT;
-			ret = NORFAT_ERR_CORRUPT;
-			goto finalize;
+		end = address + length;
+		remaining -= length;
+		if (remaining == 0) {
+			break;
 		}
-
+		sector = readSector(fs, sector).next;
+		if (sector < (TABLE_COUNT(fs) * TABLE_SECTORS(fs)) || sector >= fs->flashSectors || --limit < 1) {
+			NORFAT_TRACE(("NORFAT_ERR_CORRUPT next %i\r\n", sector));
+			return chainError(fs);
+		}
+		address = sector * SECTOR_SIZE(fs);
+		length = SECTOR_SIZE(fs);
 	}
-	NORFAT_TRACE(("\r\n", next));
-	ret = commitChanges(fs, 0);
-	NORFAT_TRACE(("norfat_remove:committed\r\n"));
-	NORFAT_DEBUG(("FILE %s delete\r\n", filename));
-finalize:
-	NORFAT_FREE(f);
-	NORFAT_TRACE(("norfat_remove:finalize\r\n"));
-	return ret;
+	return used;
 }
 
-int norfat_exists(norFAT_FS* fs, const char* filename) {
+static int existsUnlocked(norFAT_FS* fs, const char* filename) {
 	uint32_t sector;
-	uint32_t flags;
+	norFAT_fileHeader fh;
 	int ret = 0;
 	NORFAT_ASSERT(fs);
 	NORFAT_ASSERT(fs->volumeMounted);
@@ -1389,11 +4342,9 @@ int norfat_exists(norFAT_FS* fs, const char* filename) {
 	if (fs->lastError == NORFAT_ERR_IO) {
 		return NORFAT_ERR_IO;
 	}
-	norFAT_fileHeader* f = fileSearch(fs, filename, &sector);
-
-	if (f) {
-		ret = f->fileLen;
-		free(f);
+	//The header lives on the stack, nothing to allocate
+	if (fileSearch(fs, filename, &fh, &sector, NULL, NULL)) {
+		ret = fh.fileLen;
 	}
 	else {
 		if (fs->lastError == NORFAT_ERR_IO) {
@@ -1403,6 +4354,10 @@ int norfat_exists(norFAT_FS* fs, const char* filename) {
 	return ret;
 }
 
+uint32_t norfat_crc32(const void* buf, uint32_t len, uint32_t seed) {
+	return NORFAT_CRC((void*)buf, len, seed);
+}
+
 int norfat_ferror(norFAT_FS* fs, norfat_FILE* file) {
 	return file->error;
 }
@@ -1418,3 +4373,317 @@ size_t norfat_flength(norfat_FILE* f) {
 	}
 	return f->fh->fileLen;
 }
+
+#if NORFAT_THREAD_SAFE
+static void lockExclusive(norFAT_FS* fs) {
+	NORFAT_ASSERT(fs);
+	if (fs->lock_exclusive) {
+		fs->lock_exclusive(fs->lockContext);
+	}
+}
+
+static void unlockExclusive(norFAT_FS* fs) {
+	if (fs->unlock_exclusive) {
+		fs->unlock_exclusive(fs->lockContext);
+	}
+}
+
+/* Returns 1 when it took the exclusive side instead, unlockShared needs it */
+static uint32_t lockShared(norFAT_FS* fs) {
+	NORFAT_ASSERT(fs);
+#if NORFAT_FAT_CACHE_PAGES
+	//Chain lookups load and evict cache pages, readers share only behind the
+	//cache lock, and only while every page is clean. Once all slots are dirty
+	//a miss programs the table, so it waits for the other readers
+	if (!fs->lock_cache) {
+		lockExclusive(fs);
+		return 1;
+	}
+	if (fs->lock_shared) {
+		fs->lock_shared(fs->lockContext);
+	}
+	//Only the exclusive side dirties pages, this holds until unlockShared
+	if (!anyDirty(fs)) {
+		return 0;
+	}
+	if (fs->unlock_shared) {
+		fs->unlock_shared(fs->lockContext);
+	}
+	lockExclusive(fs);
+	return 1;
+#else
+	if (fs->lock_shared) {
+		fs->lock_shared(fs->lockContext);
+	}
+	return 0;
+#endif
+}
+
+static void unlockShared(norFAT_FS* fs, uint32_t exclusive) {
+	if (exclusive) {
+		unlockExclusive(fs);
+		return;
+	}
+	if (fs->unlock_shared) {
+		fs->unlock_shared(fs->lockContext);
+	}
+}
+#else
+#define lockShared(fs) 0
+#define unlockShared(fs, exclusive) (void)(exclusive)
+#define lockExclusive(fs)
+#define unlockExclusive(fs)
+#endif
+
+/* Every call but fwrite starts with the flash idle */
+static void lockWriter(norFAT_FS* fs) {
+	lockExclusive(fs);
+	(void)asyncWait(fs);
+}
+
+static uint32_t lockReader(norFAT_FS* fs) {
+	uint32_t exclusive = lockShared(fs);
+#if NORFAT_ASYNC_PROGRAM
+	while (fs->asyncBusy) {
+		unlockShared(fs, exclusive);
+		lockWriter(fs);
+		unlockExclusive(fs);
+		exclusive = lockShared(fs);
+	}
+#endif
+	return exclusive;
+}
+
+/* Public calls hold the fs lock around the work. Only fread and fseek,
+ * which touch nothing but their stream, share it */
+int norfat_mount(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_MOUNT);
+	ret = mountUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_unmount(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_UNMOUNT);
+	ret = unmountUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_format(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_FORMAT);
+	ret = formatUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_fsinfo(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_OTHER);
+	ret = fsinfoUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+norfat_FILE* norfat_fopen(norFAT_FS* fs, const char* filename, const char* mode) {
+	norfat_FILE* file;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_FOPEN);
+	file = fopenUnlocked(fs, filename, mode);
+	unlockExclusive(fs);
+	return file;
+}
+
+int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_FCLOSE);
+	ret = fcloseUnlocked(fs, stream);
+	unlockExclusive(fs);
+	return ret;
+}
+
+size_t norfat_fwrite(norFAT_FS* fs, const void* ptr, size_t size, size_t count, norfat_FILE* stream) {
+	size_t ret;
+	lockExclusive(fs);
+	STATS_API(fs, NORFAT_API_FWRITE);
+	ret = fwriteUnlocked(fs, ptr, size, count, stream);
+	//ret counts bytes, errors come back negative
+	if ((intptr_t)ret > 0) {
+		STATS_ADD(fs, userBytes, ret);
+	}
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_fflush(norFAT_FS* fs, norfat_FILE* stream) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_FFLUSH);
+	ret = fflushUnlocked(fs, stream);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_setbuf(norFAT_FS* fs, norfat_FILE* stream, uint8_t* buf) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_OTHER);
+	ret = setbufUnlocked(fs, stream, buf);
+	unlockExclusive(fs);
+	return ret;
+}
+
+size_t norfat_fread(norFAT_FS* fs, void* ptr, size_t size, size_t count, norfat_FILE* stream) {
+	size_t ret;
+	uint32_t exclusive = lockReader(fs);
+	STATS_API(fs, NORFAT_API_FREAD);
+	ret = freadUnlocked(fs, ptr, size, count, stream);
+	unlockShared(fs, exclusive);
+	return ret;
+}
+
+int norfat_fseek(norFAT_FS* fs, norfat_FILE* stream, int32_t offset, int origin) {
+	int ret;
+	uint32_t exclusive = lockShared(fs);
+	STATS_API(fs, NORFAT_API_FSEEK);
+	ret = fseekUnlocked(fs, stream, offset, origin);
+	unlockShared(fs, exclusive);
+	return ret;
+}
+
+int32_t norfat_fmap(norFAT_FS* fs, const char* filename, norfat_span* spans, uint32_t count) {
+	int32_t ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_OTHER);
+	ret = fmapUnlocked(fs, filename, spans, count);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_remove(norFAT_FS* fs, const char* filename) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_REMOVE);
+	ret = removeUnlocked(fs, filename);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_begin(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_OTHER);
+	ret = beginUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_commit(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_OTHER);
+	ret = commitUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_maintain(norFAT_FS* fs, uint32_t budget) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_GC);
+	ret = maintainUnlocked(fs, budget);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_gc_step(norFAT_FS* fs) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_GC);
+	ret = gcStepUnlocked(fs);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_gc(norFAT_FS* fs, uint32_t maxMicros) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_GC);
+	ret = gcUnlocked(fs, maxMicros);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_exists(norFAT_FS* fs, const char* filename) {
+	int ret;
+	lockWriter(fs);
+	STATS_API(fs, NORFAT_API_OTHER);
+	ret = existsUnlocked(fs, filename);
+	unlockExclusive(fs);
+	return ret;
+}
+
+int norfat_poll(norFAT_FS* fs) {
+	int ret = 0;
+#if NORFAT_ASYNC_PROGRAM
+	uint32_t status;
+	lockExclusive(fs);
+	if (fs->asyncBusy && fs->program_poll) {
+		status = fs->program_poll();
+		if (status != 1) {
+			fs->asyncStatus = status;
+			fs->asyncBusy = 0;
+		}
+	}
+	ret = fs->asyncBusy ? 1 : asyncWait(fs);
+	unlockExclusive(fs);
+#endif
+	return ret;
+}
+
+void norfat_async_done(norFAT_FS* fs, uint32_t status) {
+#if NORFAT_ASYNC_PROGRAM
+	fs->asyncStatus = status;
+	fs->asyncBusy = 0;
+#endif
+}
+
+#if NORFAT_TEST_HOOKS
+_sector norfat_sector(norFAT_FS* fs, uint32_t sector) {
+	_sector ret;
+	NORFAT_ASSERT(sector < fs->flashSectors);
+	uint32_t exclusive = lockShared(fs);
+	ret = readSector(fs, sector);
+	unlockShared(fs, exclusive);
+	return ret;
+}
+#endif
+
+#if NORFAT_STATS
+int norfat_get_stats(norFAT_FS* fs, norfat_stats* stats) {
+	uint32_t i;
+	NORFAT_ASSERT(fs && stats);
+	lockExclusive(fs);
+	memcpy(stats, &fs->stats, sizeof(norfat_stats));
+	unlockExclusive(fs);
+	memset(&stats->total, 0, sizeof(stats->total));
+	for (i = 0; i < NORFAT_API_COUNT; i++) {
+		stats->total.reads += stats->api[i].reads;
+		stats->total.programs += stats->api[i].programs;
+		stats->total.erases += stats->api[i].erases;
+		stats->total.readBytes += stats->api[i].readBytes;
+		stats->total.programBytes += stats->api[i].programBytes;
+	}
+	stats->writeAmplification = stats->userBytes ?
+		(uint32_t)((stats->total.programBytes * 100) / stats->userBytes) : 0;
+	return NORFAT_OK;
+}
+#endif
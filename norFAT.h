@@ -3,9 +3,10 @@
 #include <stdint.h>
 #include "norFATconfig.h"
 
-#define NORFAT_VERSION "1.02"
+#define NORFAT_VERSION "1.03"
 #define NORFAT_ERR_EMPTY			(-20)
 #define NORFAT_ERR_CORRUPT			(-10)
+#define NORFAT_ERR_SEEK				(-9)
 #define NORFAT_ERR_MALLOC			(-8)
 #define NORFAT_ERR_FILE_NOT_FOUND	(-7)
 #define NORFAT_ERR_UNSUPPORTED		(-6)
@@ -20,10 +21,143 @@
 #define NORFAT_MAX_TABLES 16
 #endif
 
+/* Upper bound of programSize pages in one table (tableSectors * sectorSize / programSize) */
+#ifndef NORFAT_MAX_TABLE_PAGES
+#define NORFAT_MAX_TABLE_PAGES 64
+#endif
+
+#ifndef NORFAT_INCREMENTAL_CRC
+#define NORFAT_INCREMENTAL_CRC 0
+#endif
+
+#ifndef NORFAT_HASH_INDEX_SIZE
+#define NORFAT_HASH_INDEX_SIZE 0
+#endif
+
+#ifndef NORFAT_FREE_MAP_SECTORS
+#define NORFAT_FREE_MAP_SECTORS 0
+#endif
+
+#ifndef NORFAT_PREERASE_POOL
+#define NORFAT_PREERASE_POOL 0
+#endif
+
+#ifndef NORFAT_GC_WATERMARK
+#define NORFAT_GC_WATERMARK 0
+#endif
+
+#ifndef NORFAT_MICROS
+#include <time.h>
+#define NORFAT_MICROS() ((uint32_t)((clock() * 1000000ull) / CLOCKS_PER_SEC))
+#endif
+
+#ifndef NORFAT_WRITE_BUFFER
+#define NORFAT_WRITE_BUFFER 0
+#endif
+
+#ifndef NORFAT_SEEK_INDEX
+#define NORFAT_SEEK_INDEX 0
+#endif
+
+#ifndef NORFAT_DIRECT_READ
+#define NORFAT_DIRECT_READ 0
+#endif
+
+#ifndef NORFAT_ELIDE_UNCHANGED
+#define NORFAT_ELIDE_UNCHANGED 0
+#endif
+
+#ifndef NORFAT_PACK_THRESHOLD
+#define NORFAT_PACK_THRESHOLD 0
+#endif
+
+#ifndef NORFAT_STREAM_BUFFER
+#define NORFAT_STREAM_BUFFER 0
+#endif
+
+#ifndef NORFAT_MAX_OPEN_FILES
+#define NORFAT_MAX_OPEN_FILES 0
+#endif
+#if NORFAT_MAX_OPEN_FILES > 255
+#error NORFAT_MAX_OPEN_FILES is at most 255
+#endif
+
+#ifndef NORFAT_ASYNC_PROGRAM
+#define NORFAT_ASYNC_PROGRAM 0
+#endif
+
+#if NORFAT_ASYNC_PROGRAM && !NORFAT_STREAM_BUFFER
+#error NORFAT_ASYNC_PROGRAM programs from the stream buffer, set NORFAT_STREAM_BUFFER
+#endif
+
+#ifndef NORFAT_THREAD_SAFE
+#define NORFAT_THREAD_SAFE 0
+#endif
+
+#ifndef NORFAT_FAT_CACHE_PAGES
+#define NORFAT_FAT_CACHE_PAGES 0
+#endif
+
+#if NORFAT_FAT_CACHE_PAGES && !NORFAT_INCREMENTAL_CRC
+#error NORFAT_FAT_CACHE_PAGES hashes the table a page at a time, set NORFAT_INCREMENTAL_CRC
+#endif
+
+#ifndef NORFAT_ENTRY_BITS
+#define NORFAT_ENTRY_BITS 32
+#endif
+
+#if NORFAT_ENTRY_BITS != 16 && NORFAT_ENTRY_BITS != 32
+#error NORFAT_ENTRY_BITS must be 16 or 32
+#endif
+
+#ifndef NORFAT_STATS
+#define NORFAT_STATS 0
+#endif
+
+/* Test jig hooks into volume internals, never set for applications */
+#ifndef NORFAT_TEST_HOOKS
+#define NORFAT_TEST_HOOKS 0
+#endif
+
+#ifndef NORFAT_KERNEL_SIMD
+#define NORFAT_KERNEL_SIMD 1
+#endif
+
+#ifndef NORFAT_STATIC_SECTOR_SIZE
+#define NORFAT_STATIC_SECTOR_SIZE 0
+#endif
+#ifndef NORFAT_STATIC_PROGRAM_SIZE
+#define NORFAT_STATIC_PROGRAM_SIZE 0
+#endif
+#ifndef NORFAT_STATIC_TABLE_SECTORS
+#define NORFAT_STATIC_TABLE_SECTORS 0
+#endif
+#ifndef NORFAT_STATIC_TABLE_COUNT
+#define NORFAT_STATIC_TABLE_COUNT 0
+#endif
+
+#if (NORFAT_STATIC_SECTOR_SIZE & (NORFAT_STATIC_SECTOR_SIZE - 1)) || \
+	(NORFAT_STATIC_PROGRAM_SIZE & (NORFAT_STATIC_PROGRAM_SIZE - 1))
+#error NORFAT_STATIC_SECTOR_SIZE and NORFAT_STATIC_PROGRAM_SIZE must be powers of 2
+#endif
+
 #ifndef NORFAT_CRC_COUNT
 #error NORFAT_CRC_COUNT must be defined in norFATconfig.h
 #endif
 
+#if NORFAT_ENTRY_BITS == 16
+/* Same four state bits over a 12 bit next, for up to 4095 sectors */
+typedef union {
+	struct {
+		uint16_t next : 12;
+		uint16_t active : 1;
+		uint16_t sof : 1;
+		uint16_t available : 1;
+		uint16_t write : 1;
+	};
+	uint16_t base;
+}_sector;
+#else
 typedef union {
 	struct {
 		uint32_t next : 28;
@@ -34,6 +168,7 @@ typedef union {
 	};
 	uint32_t base;
 }_sector;
+#endif
 
 typedef struct {
 	uint8_t crc[8];//Ascii crc-32
@@ -54,6 +189,130 @@ typedef struct {
 	_sector sector[];
 } _FAT;/* must equal sector size */
 
+/* Bytes to allocate fs->fat with NORFAT_FAT_CACHE_PAGES: the pages holding
+ * the table header, followed by the cache and a spare page */
+#define NORFAT_FAT_CACHE_BYTES(programSize) \
+	((((sizeof(_FAT) + (programSize) - 1) / (programSize)) + NORFAT_FAT_CACHE_PAGES + 1) * (programSize))
+
+typedef struct {
+	uint32_t hash;
+	uint32_t sector;
+} _indexEntry;
+
+typedef struct {
+	uint8_t fileName[NORFAT_MAX_FILENAME];
+	uint32_t fileLen;
+	uint32_t timeStamp;
+	uint32_t crc;
+}norFAT_fileHeader;
+
+/* Follows the header in the header page, one per append */
+typedef struct {
+	uint32_t fileLen;
+	uint32_t timeStamp;
+	uint32_t crc;
+	uint32_t check;//crc of the fields above
+} _appendRecord;
+
+/* A small file in a pack sector, followed by its data, padded to programSize */
+typedef struct {
+	uint32_t state;//Live, shadowed by a rewrite, then deleted
+	norFAT_fileHeader fh;
+	uint32_t check;//crc of fh
+} _packRecord;
+
+typedef struct {
+	uint32_t startSector;
+	uint32_t position;
+	norFAT_fileHeader * fh;//Points at header
+	norFAT_fileHeader header;
+	uint32_t oldFileSector;
+	int32_t currentSector;
+	uint32_t rwPosInSector;
+	uint32_t openFlags;
+	int lastError;
+	uint32_t zeroCopy : 1;
+	uint32_t error : 1;
+	uint32_t wbufDirty : 1;
+	uint32_t packing : 1;
+	uint32_t asyncHalf : 1;
+	/* Offset of the first data byte in startSector */
+	uint32_t dataStart;
+	/* Append: old last sector, first new sector, header page record */
+	uint32_t appendLast;
+	uint32_t appendNext;
+	uint32_t appendSlot;
+#if NORFAT_ELIDE_UNCHANGED
+	/* crc of the file being replaced */
+	uint32_t oldCrc;
+#endif
+#if NORFAT_PACK_THRESHOLD
+	/* Packed record being replaced, a shadowed copy a lookup found next to
+	 * it, and the data of a file small enough to pack */
+	uint32_t oldPack;
+	uint32_t staleRecord;
+	uint8_t* pack;
+#endif
+#if NORFAT_STREAM_BUFFER
+	/* Bounce and program buffer of this stream (NULL uses fs->buff),
+	 * and where it came from */
+	uint8_t* iobuf;
+	uint32_t iobufFrom;
+#endif
+#if NORFAT_WRITE_BUFFER
+	/* programSize page being filled by small writes, the start of iobuf
+	 * when there is one */
+	uint8_t* wbuf;
+#endif
+#if NORFAT_SEEK_INDEX
+	/* Sectors of the file in chain order, built on the first seek */
+	uint32_t* chain;
+#endif
+} norfat_FILE;
+
+#if NORFAT_STATS
+/* Public calls that flash operations are charged to */
+#define NORFAT_API_MOUNT	0
+#define NORFAT_API_UNMOUNT	1
+#define NORFAT_API_FORMAT	2
+#define NORFAT_API_FOPEN	3
+#define NORFAT_API_FWRITE	4
+#define NORFAT_API_FFLUSH	5
+#define NORFAT_API_FREAD	6
+#define NORFAT_API_FCLOSE	7
+#define NORFAT_API_REMOVE	8
+#define NORFAT_API_GC		9 //gc, gc_step and maintain
+#define NORFAT_API_FSEEK	10
+#define NORFAT_API_OTHER	11
+#define NORFAT_API_COUNT	12
+
+typedef struct {
+	/* Driver calls and the bytes they moved, async submits count as programs */
+	uint32_t reads;
+	uint32_t programs;
+	uint32_t erases;
+	uint64_t readBytes;
+	uint64_t programBytes;
+} norfat_io_stats;
+
+typedef struct {
+	norfat_io_stats api[NORFAT_API_COUNT];
+	/* Sum of api[] */
+	norfat_io_stats total;
+	/* Table commits, completed table swaps, garbage sweeps and the sectors
+	 * they freed, and file headers read by name lookups */
+	uint32_t commits;
+	uint32_t swaps;
+	uint32_t gcRuns;
+	uint32_t sectorsCollected;
+	uint32_t headerReads;
+	/* Bytes norfat_fwrite reported written */
+	uint64_t userBytes;
+	/* total.programBytes as a percentage of userBytes, 0 before the first write */
+	uint32_t writeAmplification;
+} norfat_stats;
+#endif
+
 typedef struct {
 	/* Physical address of media */
 	const uint32_t addressStart;
@@ -70,46 +329,239 @@ typedef struct {
 	/* buff is used for all IO, so if driver uses DMA, allocate accordingly */
 	uint8_t* buff;//User allocated to sectorSize
 	/* fat is used to store the working copy of the table */
-	_FAT* fat;//User allocated to sectorSize
+	_FAT* fat;//User allocated to tableSectors * sectorSize, or NORFAT_FAT_CACHE_BYTES
 	uint32_t(*read_block_device)(uint32_t address, uint8_t* data, uint32_t len);
 	uint32_t(*erase_block_sector)(uint32_t address);
 	uint32_t(*program_block_page)(uint32_t address, uint8_t* data, uint32_t length);
+	/* CPU address of device address 0 on memory mapped NOR, NULL otherwise */
+	const uint8_t* mapBase;
+#if NORFAT_ASYNC_PROGRAM
+	/* Optional, starts a program like program_block_page and returns at
+	 * once. data stays untouched until the program is done, found either by
+	 * program_poll or by the driver calling norfat_async_done */
+	uint32_t(*program_page_submit)(uint32_t address, uint8_t* data, uint32_t length);
+	/* 1 while the program runs, 0 once done, else failed. NULL waits for
+	 * norfat_async_done instead */
+	uint32_t(*program_poll)(void);
+	/* Called while norFAT has to wait for a program, NULL spins */
+	void(*async_yield)(void);
+#endif
+#if NORFAT_THREAD_SAFE
+	/* Lock hooks, handed lockContext. fread and fseek take the shared side,
+	 * every other call the exclusive side. A plain mutex may back both,
+	 * NULL hooks skip locking */
+	void* lockContext;
+	void(*lock_shared)(void* context);
+	void(*unlock_shared)(void* context);
+	void(*lock_exclusive)(void* context);
+	void(*unlock_exclusive)(void* context);
+#if NORFAT_FAT_CACHE_PAGES
+	/* Lock around the FAT cache, handed cacheLockContext. Readers sharing
+	 * the fs lock take it to load table pages. They share only while no
+	 * page is dirty, as a miss with every slot dirty programs the table,
+	 * and take the exclusive side otherwise. NULL hooks have fread and
+	 * fseek always take the exclusive side */
+	void* cacheLockContext;
+	void(*lock_cache)(void* context);
+	void(*unlock_cache)(void* context);
+#endif
+#endif
+#if NORFAT_STREAM_BUFFER
+	/* Optional pool of streamBuffers buffers of NORFAT_STREAM_BUFFER bytes,
+	 * lent to streams by fopen before falling back to NORFAT_MALLOC (max 32) */
+	uint8_t* streamPool;
+	uint32_t streamBuffers;
+#endif
 	//Non userspace stuff
 	uint32_t firstFAT;
 	uint32_t volumeMounted;
 	int lastError;
+	/* norfat_begin nesting, and whether a commit was held back */
+	uint32_t batchDepth;
+	uint32_t batchPending;
+	/* Flash tables carry the clean unmount marker */
+	uint32_t cleanMarked;
+	/* Table swap in progress, and the steps of it done */
+	uint32_t swapPending;
+	uint32_t swapStep;
+#if NORFAT_HASH_INDEX_SIZE
+	/* Filename hash -> start sector, built on first lookup */
+	_indexEntry index[NORFAT_HASH_INDEX_SIZE];
+	uint32_t indexCount;
+	uint32_t indexState;
+#endif
+#if NORFAT_FREE_MAP_SECTORS
+	/* Set bit for every available sector, and how many there are */
+	uint32_t freeMap[(NORFAT_FREE_MAP_SECTORS + 31) / 32];
+	uint32_t freeCount;
+#endif
+#if NORFAT_PREERASE_POOL
+	/* Sectors erased ahead of norfat_fwrite by norfat_maintain */
+	uint32_t pool[NORFAT_PREERASE_POOL];
+	uint32_t poolCount;
+#endif
+#if NORFAT_ELIDE_UNCHANGED
+	/* Rewrites dropped by fclose because the content was unchanged */
+	uint32_t elidedWrites;
+#endif
+#if NORFAT_MAX_OPEN_FILES
+	/* Streams, with their pack buffers, and a stack of the free ones */
+	norfat_FILE filePool[NORFAT_MAX_OPEN_FILES];
+#if NORFAT_PACK_THRESHOLD
+	uint8_t packPool[NORFAT_MAX_OPEN_FILES][NORFAT_PACK_THRESHOLD];
+#endif
+	uint8_t fileFree[NORFAT_MAX_OPEN_FILES];
+	uint32_t fileFreeCount;
+#endif
+#if NORFAT_STREAM_BUFFER
+	/* Bit per streamPool buffer lent out */
+	uint32_t streamPoolUsed;
+#endif
+#if NORFAT_ASYNC_PROGRAM
+	/* Submitted program still running, its result, and the stream it is for */
+	volatile uint32_t asyncBusy;
+	volatile uint32_t asyncStatus;
+	void* asyncStream;
+#endif
+#if NORFAT_PACK_THRESHOLD
+	/* Pack sector taking new small files, and its first unused byte */
+	uint32_t packSector;
+	uint32_t packFree;
+#endif
+#if NORFAT_FAT_CACHE_PAGES
+	/* Table page held by each cache slot (NORFAT_INVALID_PAGE when empty),
+	 * and the tick it was last used on */
+	uint32_t cachePage[NORFAT_FAT_CACHE_PAGES];
+	uint32_t cacheUsed[NORFAT_FAT_CACHE_PAGES];
+	uint32_t cacheTick;
+	/* Flash table clean pages load from, and the one dirty pages are
+	 * programmed to ahead of the commit when every slot is dirty */
+	uint32_t cacheTable;
+	uint32_t spillTable;
+	uint32_t spilled[(NORFAT_MAX_TABLE_PAGES + 31) / 32];
+	/* Garbage swept since the last swap, freed as pages load */
+	uint32_t sweepPending;
+	/* A table change was lost to a failed spill, broken chains read as
+	 * NORFAT_ERR_IO until the next mount */
+	uint32_t cacheFault;
+	/* Page lookups served from RAM, read from flash, and dirty pages
+	 * programmed ahead of their commit */
+	uint32_t cacheHits;
+	uint32_t cacheMisses;
+	uint32_t cacheSpills;
+#endif
+#if NORFAT_STATS
+	/* Counters behind norfat_get_stats, and the call being charged */
+	norfat_stats stats;
+	uint32_t statsApi;
+#endif
+	/* programSize pages of fat changed since the last commit */
+	uint32_t dirtyPages[(NORFAT_MAX_TABLE_PAGES + 31) / 32];
+#if NORFAT_INCREMENTAL_CRC
+	/* Seedless crc of each table page, combined into the table crc on commit */
+	uint32_t pageCrc[NORFAT_MAX_TABLE_PAGES];
+	uint32_t pageShift[NORFAT_MAX_TABLE_PAGES];
+	uint32_t crcStale[(NORFAT_MAX_TABLE_PAGES + 31) / 32];
+	uint32_t tableCrcSum;
+#endif
 } norFAT_FS;
 
-typedef struct {
-	uint8_t fileName[NORFAT_MAX_FILENAME];
-	uint32_t fileLen;
-	uint32_t timeStamp;
-	uint32_t crc;
-}norFAT_fileHeader;
-
-typedef struct {
-	uint32_t startSector;
-	uint32_t position;
-	norFAT_fileHeader * fh;
-	uint32_t oldFileSector;
-	int32_t currentSector;
-	uint32_t rwPosInSector;
-	uint32_t openFlags;
-	int lastError;
-	uint32_t zeroCopy : 1;
-	uint32_t error : 1;
-} norfat_FILE;
-
 int norfat_mount(norFAT_FS* fs);
+
+/* norfat_unmount()
+ * Commits anything pending and marks the tables clean, so the next
+ * norfat_mount only reads the commit lists and the active table pair.
+ * Costs one commit entry, files must be closed first.
+ */
+int norfat_unmount(norFAT_FS* fs);
 int norfat_format(norFAT_FS* fs);
 norfat_FILE* norfat_fopen(norFAT_FS* fs, const char* filename, const char* mode);
 int norfat_fclose(norFAT_FS* fs, norfat_FILE* stream);
 size_t norfat_fwrite(norFAT_FS* fs, const void* ptr, size_t size, size_t count, norfat_FILE* stream);
+/* norfat_fflush()
+ * Programs the partial page a write stream is holding with
+ * NORFAT_WRITE_BUFFER. fclose does this too.
+ */
+int norfat_fflush(norFAT_FS* fs, norfat_FILE* stream);
+
+/* norfat_setbuf()
+ * NORFAT_STREAM_BUFFER only. Hands the stream a buffer of its own of
+ * NORFAT_STREAM_BUFFER bytes, to use instead of the one fopen lent it,
+ * until norfat_fclose. DMA capable like fs->buff.
+ */
+int norfat_setbuf(norFAT_FS* fs, norfat_FILE* stream, uint8_t* buf);
+
+/* norfat_async_done() / norfat_poll()
+ * NORFAT_ASYNC_PROGRAM only. With program_page_submit set, norfat_fwrite
+ * programs whole pages from one half of the stream buffer while it fills
+ * the other, and returns with the last program still running. The driver
+ * reports the end of a program with norfat_async_done (interrupt safe),
+ * unless program_poll is set. norfat_poll returns 1 while a program is
+ * running, 0 when idle and < 0 when it failed, without waiting. Any other
+ * call waits for the program first.
+ */
+void norfat_async_done(norFAT_FS* fs, uint32_t status);
+int norfat_poll(norFAT_FS* fs);
+
+#define NORFAT_SEEK_SET 0
+#define NORFAT_SEEK_CUR 1
+#define NORFAT_SEEK_END 2
+/* norfat_fseek() / norfat_ftell()
+ * Read streams only, offsets past the end of file fail with
+ * NORFAT_ERR_SEEK.
+ */
+int norfat_fseek(norFAT_FS* fs, norfat_FILE* stream, int32_t offset, int origin);
+int32_t norfat_ftell(norFAT_FS* fs, norfat_FILE* stream);
+
+typedef struct {
+	const uint8_t* address;
+	uint32_t length;
+} norfat_span;
+
+/* norfat_fmap()
+ * Memory mapped NOR only (fs->mapBase). Fills up to count spans that make
+ * up the file contents in order, adjacent sectors share a span. Returns the
+ * number of spans the whole file needs, or < 0 on error. Spans stay valid
+ * until the file is rewritten or removed.
+ */
+int32_t norfat_fmap(norFAT_FS* fs, const char* filename, norfat_span* spans, uint32_t count);
 size_t norfat_fread(norFAT_FS* fs, void* ptr, size_t size, size_t count, norfat_FILE* stream);
 int norfat_remove(norFAT_FS* fs, const char* filename);
 size_t norfat_flength(norfat_FILE* file);
 int norfat_fsinfo(norFAT_FS* fs);
 
+/* norfat_begin() / norfat_commit()
+ * Batch the table updates of several fclose/remove calls into one commit.
+ * Nothing in the batch is visible after a power loss until norfat_commit
+ * returns, unless a garbage collection forced an early commit. Calls nest,
+ * the outermost norfat_commit does the commit.
+ */
+int norfat_begin(norFAT_FS* fs);
+int norfat_commit(norFAT_FS* fs);
+
+/* norfat_maintain()
+ * Idle time work, erases up to budget sectors into the pre-erase pool so
+ * norfat_fwrite only has to program. The pool is committed to the table
+ * and survives power loss. Returns the number of sectors erased.
+ */
+int norfat_maintain(norFAT_FS* fs, uint32_t budget);
+
+/* norfat_gc_step() / norfat_gc()
+ * Proactive garbage collection. Once less than NORFAT_GC_WATERMARK percent
+ * of the data sectors are available, a step frees the deleted sectors in
+ * RAM, and later steps do the table swap one erase or program at a time.
+ * norfat_gc runs steps until maxMicros have passed. Both return 1 while
+ * there is work left, 0 when done or nothing to do.
+ * From the step erasing the first old table until the new first table is
+ * programmed, and again from the step erasing the second old table until
+ * the new second table is programmed, flash holds only one valid table
+ * copy. Mount still recovers from power loss in those windows, but a
+ * damaged copy has no backup. Each window lasts as long as the gaps
+ * between steps, so keep stepping without long pauses while steps return 1.
+ */
+int norfat_gc_step(norFAT_FS* fs);
+int norfat_gc(norFAT_FS* fs, uint32_t maxMicros);
+
 /* norfat_exists()
  * Returns:
  * < 0 error 
@@ -118,6 +570,33 @@ int norfat_fsinfo(norFAT_FS* fs);
  */
 int norfat_exists(norFAT_FS* fs, const char* filename);
 int norfat_ferror(norFAT_FS* fs, norfat_FILE* file);
+
+/* norfat_crc32()
+ * The crc engine selected by NORFAT_CRC, as used for tables and file
+ * headers. Seed with 0xFFFFFFFF, or the previous result to continue.
+ */
+uint32_t norfat_crc32(const void* buf, uint32_t len, uint32_t seed);
 int norfat_errno(norFAT_FS* fs);
 
+#if NORFAT_TEST_HOOKS
+/* norfat_sector()
+ * Table entry of a sector, read through the FAT cache when paged. The
+ * entry layout is no interface, only the jig gets this
+ */
+_sector norfat_sector(norFAT_FS* fs, uint32_t sector);
+#endif
+
+#if NORFAT_STATS
+/* norfat_get_stats()
+ * Copies the counters since the volume structure was zeroed, with the
+ * totals and write amplification filled in. Each public call is charged to
+ * its own api[] slot, except gc_step and maintain which share
+ * NORFAT_API_GC, and the rest which share NORFAT_API_OTHER. fread and fseek
+ * calls sharing the lock count without one, so overlapping readers may lose
+ * the odd read or charge it to each other's slot. The counts are exact
+ * when no calls overlap.
+ */
+int norfat_get_stats(norFAT_FS* fs, norfat_stats* stats);
+#endif
+
 #endif
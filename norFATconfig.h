@@ -7,6 +7,104 @@
 
 #define NORFAT_MAX_FILENAME     64
 
+/* Built in crc engine, bytes per step: 1 (1KB table), 4, 8 or 16 (16KB of tables) */
+#define NORFAT_CRC_SLICES       8
+/* Or hand the crc to a hardware unit. It must match the built in engine:
+ * polynomial 0x04C11DB7, MSB first, no reflection and no final xor
+ * (e.g. the STM32 CRC peripheral fed with big endian words) */
+//#define NORFAT_CRC(buf, len, seed) hwCrc32(buf, len, seed)
+
+/* Keep a crc per table page (8 bytes of RAM each, NORFAT_MAX_TABLE_PAGES)
+ * so commits only rehash the pages they change */
+#define NORFAT_INCREMENTAL_CRC  1
+
+/* Filename hash index slots (power of 2, 8 bytes of RAM each, 0 disables).
+ * Lookups stay complete while files fit in 3/4 of the slots */
+#define NORFAT_HASH_INDEX_SIZE  64
+
+/* Largest flashSectors covered by the free sector bitmap, 1 bit each
+ * (0 scans the table for every allocation instead) */
+#define NORFAT_FREE_MAP_SECTORS 4096
+
+/* Sectors norfat_maintain keeps erased for norfat_fwrite (0 disables) */
+#define NORFAT_PREERASE_POOL    8
+
+/* norfat_gc starts collecting below this percentage of available sectors */
+#define NORFAT_GC_WATERMARK     25
+//#define NORFAT_MICROS() micros()
+
+/* Each write stream buffers one program page, small writes program it once
+ * it is full (costs programSize bytes of heap per write stream) */
+#define NORFAT_WRITE_BUFFER     1
+
+/* norfat_fseek caches the sector chain of a read stream on the heap,
+ * 4 bytes per file sector (0 walks the chain on every seek) */
+#define NORFAT_SEEK_INDEX       1
+
+/* fread goes straight into the caller's buffer instead of through fs->buff,
+ * the driver must accept any buffer (DMA alignment, cache maintenance) */
+#define NORFAT_DIRECT_READ      1
+
+/* fclose drops a rewrite whose length and crc match the old file, leaving
+ * the old file in place without a commit. 2 also compares the bytes, which
+ * reads the old file again on every close (0 or unset keeps every rewrite) */
+//#define NORFAT_ELIDE_UNCHANGED  1
+
+/* Files up to this many bytes share pack sectors as programSize aligned
+ * records instead of taking a sector each (0 or unset disables). A record
+ * holds a file header too, so keep it well below half a sector */
+//#define NORFAT_PACK_THRESHOLD   128
+
+/* Each stream stages its programs (and bounces its reads without
+ * NORFAT_DIRECT_READ) in a buffer of its own of this many bytes, a multiple
+ * of programSize, from fs->streamPool or the heap (0 or unset uses fs->buff) */
+//#define NORFAT_STREAM_BUFFER    1024
+
+/* Streams, their headers and pack buffers live in a pool of this many in
+ * norFAT_FS, so opening and looking up files never calls NORFAT_MALLOC
+ * (0 or unset takes them from the heap). Size it for the most streams
+ * open at once, plus one for lookups */
+//#define NORFAT_MAX_OPEN_FILES 16
+
+/* norfat_fwrite hands whole pages to program_page_submit when the driver
+ * sets it, and fills the other half of the stream buffer meanwhile. Needs
+ * NORFAT_STREAM_BUFFER (0 or unset programs synchronously) */
+//#define NORFAT_ASYNC_PROGRAM    1
+
+/* Public calls take the lock hooks in norFAT_FS, so several tasks can
+ * share a volume. fread and fseek take the shared side, everything else
+ * is serialized. With the FAT cache they share only when lock_cache is
+ * set too, and no write stream has left dirty table pages */
+#define NORFAT_THREAD_SAFE      1
+
+/* Width of a table entry: 32 (default), or 16 for up to 4095 sectors,
+ * which halves the table, its commits and crc. It sets the table format on
+ * flash, so a volume has to be formatted with the width it is mounted with */
+//#define NORFAT_ENTRY_BITS     16
+
+/* Geometry fixed at compile time for a build that serves one part, so
+ * divisions by it become shifts and masks (0 or unset reads norFAT_FS).
+ * norFAT_FS must still match, mount asserts on it. Sector and program
+ * sizes must be powers of 2. Leave out any that differ between volumes */
+//#define NORFAT_STATIC_SECTOR_SIZE   4096
+//#define NORFAT_STATIC_PROGRAM_SIZE  256
+//#define NORFAT_STATIC_TABLE_SECTORS 3
+//#define NORFAT_STATIC_TABLE_COUNT   6
+
+/* Count driver calls per public call, commits, swaps and collections
+ * for norfat_get_stats, 0 compiles the counting out */
+#define NORFAT_STATS            1
+
+/* Table scans and blank checks use SSE2, AVX2 or NEON when the compiler
+ * targets them, 0 keeps the portable word at a time kernels */
+#define NORFAT_KERNEL_SIMD      1
+
+/* Keep only the table header and this many pages of sector entries in
+ * fs->fat, the rest is read from flash on demand (0 holds the whole
+ * table, also when unset). Allocate fs->fat with
+ * NORFAT_FAT_CACHE_BYTES(programSize) */
+//#define NORFAT_FAT_CACHE_PAGES  8
+
 #define NORFAT_DEBUG(x) //printf x
 #define NORFAT_ERROR(x) //printf x
 #define NORFAT_INFO_PRINT(x) printf x
@@ -0,0 +1,415 @@
+#include <stdint.h>
+#include <string.h>
+#include "norFATkernel.h"
+
+#if NORFAT_KERNEL_SIMD && (defined(__aarch64__) || defined(_M_ARM64))
+#define NORFAT_K_NEON
+#include <arm_neon.h>
+#elif NORFAT_KERNEL_SIMD && defined(__AVX2__)
+#define NORFAT_K_AVX2
+#include <immintrin.h>
+#elif NORFAT_KERNEL_SIMD && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define NORFAT_K_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if NORFAT_ENTRY_BITS == 16
+#define K_ENTRY_MASK 0xFFFFu
+#define K_LANES(x) ((uint64_t)(x) * 0x0001000100010001ULL)
+#else
+#define K_ENTRY_MASK 0xFFFFFFFFu
+#define K_LANES(x) ((uint64_t)(x) * 0x0000000100000001ULL)
+#endif
+/* Top bit of each entry lane, and the bits below it */
+#define K_HIGH K_LANES(1u << (NORFAT_ENTRY_BITS - 1))
+#define K_LOW (~K_HIGH)
+#define K_PER_WORD (8 / sizeof(_sector))
+
+static uint64_t loadWord(const void* p) {
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+static uint32_t countBits(uint32_t v) {
+	v = v - ((v >> 1) & 0x55555555);
+	v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+	return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+#if defined(NORFAT_K_SSE2) || defined(NORFAT_K_AVX2)
+static uint32_t lowBit(uint32_t v) {
+#if defined(__GNUC__)
+	return __builtin_ctz(v);
+#else
+	unsigned long i;
+	_BitScanForward(&i, v);
+	return i;
+#endif
+}
+
+/* Sets n bits of map starting at bit pos */
+static void orBits(uint32_t* map, uint32_t pos, uint32_t bits, uint32_t n) {
+	uint32_t shift = pos % 32;
+	map[pos / 32] |= bits << shift;
+	if (shift + n > 32 && (bits >> (32 - shift))) {
+		map[(pos / 32) + 1] |= bits >> (32 - shift);
+	}
+}
+#endif
+
+static uint32_t entryMatches(const _sector* e, uint32_t mask, uint32_t match) {
+	return (e->base & mask) == match;
+}
+
+/* Portable versions, a 64 bit word at a time */
+
+uint32_t norfat_k_blank_portable(const uint8_t* p, uint32_t len) {
+	uint32_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		if ((loadWord(p + i) & loadWord(p + i + 8) & loadWord(p + i + 16) & loadWord(p + i + 24)) != ~(uint64_t)0) {
+			return 0;
+		}
+	}
+	for (; i + 8 <= len; i += 8) {
+		if (loadWord(p + i) != ~(uint64_t)0) {
+			return 0;
+		}
+	}
+	for (; i < len; i++) {
+		if (p[i] != 0xFF) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void norfat_k_and_portable(uint8_t* dst, const uint8_t* src, uint32_t len) {
+	uint32_t i = 0;
+	uint64_t w;
+	for (; i + 8 <= len; i += 8) {
+		w = loadWord(dst + i) & loadWord(src + i);
+		memcpy(dst + i, &w, sizeof(w));
+	}
+	for (; i < len; i++) {
+		dst[i] &= src[i];
+	}
+}
+
+/* Top bit set in each lane of w that equals zero, a lane never carries into the next */
+static uint64_t zeroLanes(uint64_t w) {
+	return ~(((w & K_LOW) + K_LOW) | w) & K_HIGH;
+}
+
+uint32_t norfat_k_find_portable(const _sector* e, uint32_t count, uint32_t mask, uint32_t match) {
+	uint32_t i = 0, k;
+	uint64_t m = K_LANES(mask & K_ENTRY_MASK);
+	uint64_t x = K_LANES(match & K_ENTRY_MASK);
+	for (; i + K_PER_WORD <= count; i += K_PER_WORD) {
+		if (zeroLanes((loadWord(&e[i]) & m) ^ x)) {
+			//Lane order follows byte order, so let the entries say which
+			for (k = 0; !entryMatches(&e[i + k], mask, match); k++);
+			return i + k;
+		}
+	}
+	for (; i < count; i++) {
+		if (entryMatches(&e[i], mask, match)) {
+			return i;
+		}
+	}
+	return count;
+}
+
+uint32_t norfat_k_match_portable(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first) {
+	uint32_t i = 0, k, n = 0;
+	uint64_t m = K_LANES(mask & K_ENTRY_MASK);
+	uint64_t x = K_LANES(match & K_ENTRY_MASK);
+	uint64_t hit;
+	for (; i + K_PER_WORD <= count; i += K_PER_WORD) {
+		hit = zeroLanes((loadWord(&e[i]) & m) ^ x);
+		if (!hit) {
+			continue;
+		}
+		n += countBits((uint32_t)hit) + countBits((uint32_t)(hit >> 32));
+		for (k = 0; map && k < K_PER_WORD; k++) {
+			if (entryMatches(&e[i + k], mask, match)) {
+				map[(first + i + k) / 32] |= 1u << ((first + i + k) % 32);
+			}
+		}
+	}
+	for (; i < count; i++) {
+		if (entryMatches(&e[i], mask, match)) {
+			if (map) {
+				map[(first + i) / 32] |= 1u << ((first + i) % 32);
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+#if defined(NORFAT_K_AVX2)
+const char* norfat_k_name(void) {
+	return "avx2";
+}
+
+uint32_t norfat_k_blank(const uint8_t* p, uint32_t len) {
+	uint32_t i = 0;
+	__m256i ones = _mm256_set1_epi8(-1);
+	for (; i + 128 <= len; i += 128) {
+		__m256i v = _mm256_and_si256(
+			_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + i)), _mm256_loadu_si256((const __m256i*)(p + i + 32))),
+			_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + i + 64)), _mm256_loadu_si256((const __m256i*)(p + i + 96))));
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ones)) != 0xFFFFFFFF) {
+			return 0;
+		}
+	}
+	for (; i + 32 <= len; i += 32) {
+		if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), ones)) != 0xFFFFFFFF) {
+			return 0;
+		}
+	}
+	return norfat_k_blank_portable(p + i, len - i);
+}
+
+void norfat_k_and(uint8_t* dst, const uint8_t* src, uint32_t len) {
+	uint32_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i*)(dst + i), _mm256_and_si256(
+			_mm256_loadu_si256((const __m256i*)(dst + i)), _mm256_loadu_si256((const __m256i*)(src + i))));
+	}
+	norfat_k_and_portable(dst + i, src + i, len - i);
+}
+
+#define K_VEC 32
+#define K_PER_VEC (K_VEC / sizeof(_sector))
+
+static __m256i compareEntries(const _sector* e, __m256i m, __m256i x) {
+	__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)e), m);
+#if NORFAT_ENTRY_BITS == 16
+	return _mm256_cmpeq_epi16(v, x);
+#else
+	return _mm256_cmpeq_epi32(v, x);
+#endif
+}
+
+/* One bit per entry of a compare */
+static uint32_t entryBits(__m256i c) {
+#if NORFAT_ENTRY_BITS == 16
+	//packs works within each 128 bit half, leaving entries 0-7 in bits 0-7 and 8-15 in 16-23
+	uint32_t m = _mm256_movemask_epi8(_mm256_packs_epi16(c, c));
+	return (m & 0xFF) | ((m >> 8) & 0xFF00);
+#else
+	return _mm256_movemask_ps(_mm256_castsi256_ps(c));
+#endif
+}
+
+uint32_t norfat_k_find(const _sector* e, uint32_t count, uint32_t mask, uint32_t match) {
+	uint32_t i = 0, bits;
+#if NORFAT_ENTRY_BITS == 16
+	__m256i m = _mm256_set1_epi16((short)mask), x = _mm256_set1_epi16((short)match);
+#else
+	__m256i m = _mm256_set1_epi32((int)mask), x = _mm256_set1_epi32((int)match);
+#endif
+	for (; i + K_PER_VEC <= count; i += K_PER_VEC) {
+		bits = _mm256_movemask_epi8(compareEntries(&e[i], m, x));
+		if (bits) {
+			return i + (lowBit(bits) / sizeof(_sector));
+		}
+	}
+	return i + norfat_k_find_portable(&e[i], count - i, mask, match);
+}
+
+uint32_t norfat_k_match(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first) {
+	uint32_t i = 0, bits, n = 0;
+#if NORFAT_ENTRY_BITS == 16
+	__m256i m = _mm256_set1_epi16((short)mask), x = _mm256_set1_epi16((short)match);
+#else
+	__m256i m = _mm256_set1_epi32((int)mask), x = _mm256_set1_epi32((int)match);
+#endif
+	for (; i + K_PER_VEC <= count; i += K_PER_VEC) {
+		bits = entryBits(compareEntries(&e[i], m, x));
+		if (bits) {
+			n += countBits(bits);
+			if (map) {
+				orBits(map, first + i, bits, K_PER_VEC);
+			}
+		}
+	}
+	return n + norfat_k_match_portable(&e[i], count - i, mask, match, map, first + i);
+}
+#elif defined(NORFAT_K_SSE2)
+const char* norfat_k_name(void) {
+	return "sse2";
+}
+
+uint32_t norfat_k_blank(const uint8_t* p, uint32_t len) {
+	uint32_t i = 0;
+	__m128i ones = _mm_set1_epi8(-1);
+	for (; i + 64 <= len; i += 64) {
+		__m128i v = _mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i)), _mm_loadu_si128((const __m128i*)(p + i + 16))),
+			_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), _mm_loadu_si128((const __m128i*)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF) {
+			return 0;
+		}
+	}
+	for (; i + 16 <= len; i += 16) {
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), ones)) != 0xFFFF) {
+			return 0;
+		}
+	}
+	return norfat_k_blank_portable(p + i, len - i);
+}
+
+void norfat_k_and(uint8_t* dst, const uint8_t* src, uint32_t len) {
+	uint32_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(
+			_mm_loadu_si128((const __m128i*)(dst + i)), _mm_loadu_si128((const __m128i*)(src + i))));
+	}
+	norfat_k_and_portable(dst + i, src + i, len - i);
+}
+
+#define K_VEC 16
+#define K_PER_VEC (K_VEC / sizeof(_sector))
+
+static __m128i compareEntries(const _sector* e, __m128i m, __m128i x) {
+	__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)e), m);
+#if NORFAT_ENTRY_BITS == 16
+	return _mm_cmpeq_epi16(v, x);
+#else
+	return _mm_cmpeq_epi32(v, x);
+#endif
+}
+
+/* One bit per entry of a compare */
+static uint32_t entryBits(__m128i c) {
+#if NORFAT_ENTRY_BITS == 16
+	return _mm_movemask_epi8(_mm_packs_epi16(c, c)) & 0xFF;
+#else
+	return _mm_movemask_ps(_mm_castsi128_ps(c));
+#endif
+}
+
+uint32_t norfat_k_find(const _sector* e, uint32_t count, uint32_t mask, uint32_t match) {
+	uint32_t i = 0, bits;
+#if NORFAT_ENTRY_BITS == 16
+	__m128i m = _mm_set1_epi16((short)mask), x = _mm_set1_epi16((short)match);
+#else
+	__m128i m = _mm_set1_epi32((int)mask), x = _mm_set1_epi32((int)match);
+#endif
+	for (; i + K_PER_VEC <= count; i += K_PER_VEC) {
+		bits = _mm_movemask_epi8(compareEntries(&e[i], m, x));
+		if (bits) {
+			return i + (lowBit(bits) / sizeof(_sector));
+		}
+	}
+	return i + norfat_k_find_portable(&e[i], count - i, mask, match);
+}
+
+uint32_t norfat_k_match(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first) {
+	uint32_t i = 0, bits, n = 0;
+#if NORFAT_ENTRY_BITS == 16
+	__m128i m = _mm_set1_epi16((short)mask), x = _mm_set1_epi16((short)match);
+#else
+	__m128i m = _mm_set1_epi32((int)mask), x = _mm_set1_epi32((int)match);
+#endif
+	for (; i + K_PER_VEC <= count; i += K_PER_VEC) {
+		bits = entryBits(compareEntries(&e[i], m, x));
+		if (bits) {
+			n += countBits(bits);
+			if (map) {
+				orBits(map, first + i, bits, K_PER_VEC);
+			}
+		}
+	}
+	return n + norfat_k_match_portable(&e[i], count - i, mask, match, map, first + i);
+}
+#elif defined(NORFAT_K_NEON)
+/* AArch64 only, it relies on the across-vector reductions */
+const char* norfat_k_name(void) {
+	return "neon";
+}
+
+uint32_t norfat_k_blank(const uint8_t* p, uint32_t len) {
+	uint32_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		uint8x16_t v = vandq_u8(vandq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)),
+			vandq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+		if (vminvq_u8(v) != 0xFF) {
+			return 0;
+		}
+	}
+	return norfat_k_blank_portable(p + i, len - i);
+}
+
+void norfat_k_and(uint8_t* dst, const uint8_t* src, uint32_t len) {
+	uint32_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		vst1q_u8(dst + i, vandq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+	}
+	norfat_k_and_portable(dst + i, src + i, len - i);
+}
+
+#define K_PER_VEC (16 / sizeof(_sector))
+
+/* Non zero when any of the K_PER_VEC entries at e matches */
+static uint32_t anyMatch(const _sector* e, uint32_t mask, uint32_t match) {
+#if NORFAT_ENTRY_BITS == 16
+	uint16x8_t v = vandq_u16(vld1q_u16((const uint16_t*)e), vdupq_n_u16((uint16_t)mask));
+	return vmaxvq_u16(vceqq_u16(v, vdupq_n_u16((uint16_t)match)));
+#else
+	uint32x4_t v = vandq_u32(vld1q_u32((const uint32_t*)e), vdupq_n_u32(mask));
+	return vmaxvq_u32(vceqq_u32(v, vdupq_n_u32(match)));
+#endif
+}
+
+uint32_t norfat_k_find(const _sector* e, uint32_t count, uint32_t mask, uint32_t match) {
+	uint32_t i = 0;
+	for (; i + K_PER_VEC <= count; i += K_PER_VEC) {
+		if (anyMatch(&e[i], mask, match)) {
+			break;
+		}
+	}
+	return i + norfat_k_find_portable(&e[i], count - i, mask, match);
+}
+
+uint32_t norfat_k_match(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first) {
+	uint32_t i = 0, n = 0;
+	for (; i + K_PER_VEC <= count; i += K_PER_VEC) {
+		if (anyMatch(&e[i], mask, match)) {
+			n += norfat_k_match_portable(&e[i], K_PER_VEC, mask, match, map, first + i);
+		}
+	}
+	return n + norfat_k_match_portable(&e[i], count - i, mask, match, map, first + i);
+}
+#else
+const char* norfat_k_name(void) {
+	return "portable";
+}
+
+uint32_t norfat_k_blank(const uint8_t* p, uint32_t len) {
+	return norfat_k_blank_portable(p, len);
+}
+
+void norfat_k_and(uint8_t* dst, const uint8_t* src, uint32_t len) {
+	norfat_k_and_portable(dst, src, len);
+}
+
+uint32_t norfat_k_find(const _sector* e, uint32_t count, uint32_t mask, uint32_t match) {
+	return norfat_k_find_portable(e, count, mask, match);
+}
+
+uint32_t norfat_k_match(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first) {
+	return norfat_k_match_portable(e, count, mask, match, map, first);
+}
+#endif
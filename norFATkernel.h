@@ -0,0 +1,43 @@
+#ifndef NORFAT_KERNEL_H
+#define NORFAT_KERNEL_H
+#include <stdint.h>
+#include "norFAT.h"
+
+/* Inner loops over flash buffers and table entries. Each kernel has a
+ * portable version working a machine word at a time, and the plain name
+ * picks SSE2, AVX2 or NEON (AArch64) when the compiler targets it and
+ * NORFAT_KERNEL_SIMD is set. Both give the same results for any length
+ * and alignment.
+ */
+
+/* norfat_k_blank()
+ * Returns 1 when all len bytes read erased (0xFF)
+ */
+uint32_t norfat_k_blank(const uint8_t* p, uint32_t len);
+uint32_t norfat_k_blank_portable(const uint8_t* p, uint32_t len);
+
+/* norfat_k_and()
+ * dst &= src, the way a NOR program merges data into a page
+ */
+void norfat_k_and(uint8_t* dst, const uint8_t* src, uint32_t len);
+void norfat_k_and_portable(uint8_t* dst, const uint8_t* src, uint32_t len);
+
+/* norfat_k_find()
+ * Index of the first entry with (base & mask) == match, count if none
+ */
+uint32_t norfat_k_find(const _sector* e, uint32_t count, uint32_t mask, uint32_t match);
+uint32_t norfat_k_find_portable(const _sector* e, uint32_t count, uint32_t mask, uint32_t match);
+
+/* norfat_k_match()
+ * Number of entries with (base & mask) == match. With map set, entry i
+ * also sets bit first + i of it, other bits are left alone.
+ */
+uint32_t norfat_k_match(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first);
+uint32_t norfat_k_match_portable(const _sector* e, uint32_t count, uint32_t mask, uint32_t match,
+	uint32_t* map, uint32_t first);
+
+/* Name of the instruction set behind the plain kernels */
+const char* norfat_k_name(void);
+
+#endif